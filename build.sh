@@ -5,7 +5,11 @@ BUILD=build
 THIRD_PARTY=third_party
 CLIENT=${BUILD}/client
 SERVER=${BUILD}/server
-CFLAGS="-fsanitize=address -g -O2 -lpthread -lm -std=gnu2x -Wno-constant-logical-operand -I${BUILD}/raylib/raylib/include"
+# Add -DFIXED_POINT to run the simulation in fixed-point, see src/fixed.h.
+# Clients and servers only talk to each other if built the same way.
+SIM_FLAGS=""
+CFLAGS="-fsanitize=address -g -O2 -lpthread -lm -std=gnu2x -Wno-constant-logical-operand -I${BUILD}/raylib/raylib/include ${SIM_FLAGS}"
+BENCH_CFLAGS="-g -O2 -lpthread -lm -std=gnu2x ${SIM_FLAGS}"
 
 # Create build directory if needed
 [ ! -d ${BUILD} ] && mkdir ${BUILD}
@@ -16,8 +20,20 @@ CFLAGS="-fsanitize=address -g -O2 -lpthread -lm -std=gnu2x -Wno-constant-logical
 # Build raylib if needed
 [ ! -d ${BUILD}/raylib ] && mkdir ${BUILD}/raylib && cmake -DUSE_WAYLAND=on -DCMAKE_BUILD_TYPE=Release -DCMAKE_INSTALL_PREFIX=${BUILD} -S ${THIRD_PARTY}/raylib -B ${BUILD}/raylib && make -j16 -C ${BUILD}/raylib && make install -C ${BUILD}/raylib
 
-${CC} -o ${SERVER}-nodraw ${CFLAGS} src/server.c src/game.c &
-#${CC} -o ${SERVER}        ${CFLAGS} src/server.c src/game.c src/draw.c src/audio.c ${BUILD}/lib/libraylib.a -DDRAW &
-${CC} -o ${CLIENT}        ${CFLAGS} src/client.c src/game.c src/draw.c src/audio.c ${BUILD}/lib/libraylib.a -DDRAW -DCLIENT &
+${CC} -o ${SERVER}-nodraw ${CFLAGS} src/server.c src/net.c src/match.c src/game.c src/trace.c &
+#${CC} -o ${SERVER}        ${CFLAGS} src/server.c src/net.c src/match.c src/game.c src/trace.c src/draw.c src/audio.c ${BUILD}/lib/libraylib.a -DDRAW &
+${CC} -o ${CLIENT}        ${CFLAGS} src/client.c src/game.c src/draw.c src/audio.c src/trace.c ${BUILD}/lib/libraylib.a -DDRAW -DCLIENT &
+${CC} -o ${CLIENT}-stress ${CFLAGS} src/client_stress.c src/game.c -DCLIENT &
+${CC} -o ${BUILD}/replay         ${BENCH_CFLAGS} src/replay.c src/game.c &
+
+# Benchmarks, built without sanitizers
+${CC} -o ${BUILD}/bench-raycast  ${BENCH_CFLAGS} src/bench_raycast.c src/game.c &
+${CC} -o ${BUILD}/bench-codec    ${BENCH_CFLAGS} src/bench_codec.c src/game.c &
+${CC} -o ${BUILD}/bench-interest ${BENCH_CFLAGS} src/bench_interest.c src/game.c &
+${CC} -o ${BUILD}/bench-tick     ${BENCH_CFLAGS} src/bench_tick.c &
+${CC} -o ${BUILD}/bench-hash-map ${BENCH_CFLAGS} src/bench_hash_map.c src/game.c &
+${CC} -o ${BUILD}/bench-projectiles ${BENCH_CFLAGS} src/bench_projectiles.c src/game.c &
+${CC} -o ${BUILD}/bench-match    ${BENCH_CFLAGS} src/bench_match.c src/match.c src/game.c src/trace.c &
+${CC} -o ${BUILD}/bench-soak     ${BENCH_CFLAGS} src/bench_soak.c src/net.c src/match.c src/game.c src/trace.c -DTRANSPORT_LOOPBACK &
 
 wait
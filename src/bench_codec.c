@@ -0,0 +1,229 @@
+#include "packet.h"
+#include "random.h"
+#include <stdio.h>
+#include <math.h>
+
+//
+// Round-trip checks for the player/input codec in packet.h, followed by a
+// report of bytes per network tick compared to sending the Pack() structs
+// as is, with and without delta encoding against acknowledged baselines.
+//
+
+#define NUM_ROUND_TRIPS 100000
+#define NUM_DELTA_TICKS 100000
+// Typical age of the acknowledged baseline, ~100 ms
+#define DELTA_BASELINE_AGE 6
+
+static u32 failures = 0;
+
+#define CHECK(cond)                                                         \
+    do {                                                                    \
+        if (!(cond)) {                                                      \
+            if (failures < 16)                                              \
+                printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++failures;                                                     \
+        }                                                                   \
+    } while (0)
+
+static inline f32 random_range(struct random_series_pcg *random, f32 min, f32 max) {
+    return min + (max - min)*random_next_unilateral(random);
+}
+
+static inline v2 random_dir(struct random_series_pcg *random) {
+    const f32 angle = random_range(random, 0.0f, 2.0f*M_PI);
+    return (v2) {cosf(angle), sinf(angle)};
+}
+
+static inline bool dir_close(v2 a, v2 b) {
+    // One step of CODEC_ANGLE_BITS is 2pi/65536 ~ 1e-4 rad
+    return v2len(v2sub(a, b)) < 2e-4f;
+}
+
+static void round_trip_players(struct random_series_pcg *random, const struct map *m) {
+    for (u32 i = 0; i < NUM_ROUND_TRIPS; ++i) {
+        struct player p = {
+            .id = 1 + random_next_u32(random) % 100000,
+            .pos = {
+                random_range(random, m->origin.x, m->origin.x + m->width*m->tile_size),
+                random_range(random, m->origin.y, m->origin.y + m->height*m->tile_size),
+            },
+            .velocity = v2scale(random_range(random, 0.0f, max_dodge_speed), random_dir(random)),
+            .dodge = (i % 4 == 0) ? (v2) {0, 0} : random_dir(random),
+            .look = random_dir(random),
+            .step_delay = random_range(random, 0.0f, step_delay),
+            .step_left_side = random_next_u32(random) & 1,
+            .time_left_in_dodge = random_range(random, 0.0f, dodge_time),
+            .time_left_in_dodge_delay = random_range(random, 0.0f, dodge_delay_time),
+            .hue = random_range(random, 0.0f, 360.0f),
+            .health = (f32) (100 - 100*(i32) (i % 3)),
+            .time_left_in_weapon_cooldown = {
+                random_range(random, 0.0f, weapon_sniper_cooldown),
+                random_range(random, 0.0f, weapon_nade_cooldown),
+            },
+            .weapons = {PLAYER_WEAPON_SNIPER, PLAYER_WEAPON_NADE},
+            .current_weapon = random_next_u32(random) & 1,
+            .nade_distance = random_range(random, 0.0f, 3.1f),
+            .sniper_zoom = random_range(random, 0.0f, 1.01f),
+            .state = (random_next_u32(random) & 1) ? PLAYER_STATE_SLIDING : PLAYER_STATE_DEFAULT,
+        };
+
+        struct packed_player packed = player_encode(m, &p);
+        struct player d = player_decode(m, &packed);
+
+        CHECK(d.id == p.id);
+        CHECK(v2equal(d.pos, p.pos));
+        CHECK(v2equal(d.velocity, p.velocity));
+        CHECK(dir_close(d.dodge, p.dodge));
+        CHECK(dir_close(d.look, p.look));
+        CHECK(f32_equal(d.step_delay, p.step_delay));
+        CHECK(d.step_left_side == p.step_left_side);
+        CHECK(f32_equal(d.time_left_in_dodge, p.time_left_in_dodge));
+        CHECK(f32_equal(d.time_left_in_dodge_delay, p.time_left_in_dodge_delay));
+        CHECK(fabsf(d.hue - p.hue) < 1e-2f);
+        CHECK(d.health == p.health);
+        CHECK(f32_equal(d.time_left_in_weapon_cooldown[0], p.time_left_in_weapon_cooldown[0]));
+        CHECK(f32_equal(d.time_left_in_weapon_cooldown[1], p.time_left_in_weapon_cooldown[1]));
+        CHECK(d.weapons[0] == p.weapons[0] && d.weapons[1] == p.weapons[1]);
+        CHECK(d.current_weapon == p.current_weapon);
+        CHECK(f32_equal(d.nade_distance, p.nade_distance));
+        CHECK(f32_equal(d.sniper_zoom, p.sniper_zoom));
+        CHECK(d.state == p.state);
+    }
+}
+
+static void round_trip_inputs(struct random_series_pcg *random) {
+    for (u32 i = 0; i < NUM_ROUND_TRIPS; ++i) {
+        struct input input = {
+            .look = v2scale(random_range(random, 0.1f, 10.0f), random_dir(random)),
+        };
+        for (u32 j = 0; j < INPUT_LAST; ++j)
+            input.active[j] = random_next_u32(random) & 1;
+
+        struct packed_input packed = input_encode(&input);
+        struct input d = input_decode(&packed);
+
+        CHECK(dir_close(d.look, v2normalize(input.look)));
+        CHECK(memcmp(d.active, input.active, sizeof(input.active)) == 0);
+    }
+}
+
+// Simulates a player wandering around, shooting and dodging, and returns the
+// average size of its delta encoded state per network tick
+static f32 measure_delta(struct random_series_pcg *random, const struct map *m) {
+    static struct game game;
+    memset(&game, 0, sizeof(game));
+    game.map = *m;
+
+    struct player p = {
+        .id = 1,
+        .pos = {m->width/2.0f, m->height/2.0f},
+        .weapons = {PLAYER_WEAPON_SNIPER, PLAYER_WEAPON_NADE},
+        .hue = 100.0f,
+        .health = 100.0f,
+    };
+
+    struct player_fields history[DELTA_BASELINE_AGE+1] = {0};
+    struct input input = {0};
+    size_t total = 0;
+    u32 samples = 0;
+    for (u32 tick = 0; tick < NUM_DELTA_TICKS; ++tick) {
+        // Change direction every half second or so
+        if (tick % 60 == 0) {
+            memset(input.active, 0, sizeof(input.active));
+            input.active[INPUT_MOVE_LEFT + random_next_u32(random) % 4] = true;
+            input.look = random_dir(random);
+        }
+        input.active[INPUT_MOVE_DODGE] = random_next_u32(random) % 240 == 0;
+        input.active[INPUT_SHOOT_PRESSED] = random_next_u32(random) % 120 == 0;
+
+        update_player(&game, &p, &input, 1.0f / (f32) FPS);
+        collect_and_resolve_static_collisions_for_player(&game, &p);
+        update_projectiles(&game, 1.0f / (f32) FPS);
+        ListClear(game.sound_list);
+        ListClear(game.damage_list);
+        ListClear(game.new_hitscan_list);
+        ListClear(game.new_nade_list);
+
+        if (tick % NET_PER_SIM_TICKS != 0)
+            continue;
+
+        const u32 net_tick = tick / NET_PER_SIM_TICKS;
+        const struct player_fields fields = player_quantize(m, &p);
+        history[net_tick % ARRLEN(history)] = fields;
+        if (net_tick < DELTA_BASELINE_AGE)
+            continue;
+
+        const struct player_fields *baseline = &history[(net_tick - DELTA_BASELINE_AGE) % ARRLEN(history)];
+        u8 data[PLAYER_DELTA_MAX_BYTES];
+        const size_t size = player_write_delta(data, sizeof(data), baseline, &fields);
+
+        const struct player_fields d = player_read_delta(data, size, baseline, (u32) p.id);
+        CHECK(memcmp(&d, &fields, sizeof(d)) == 0);
+
+        total += size;
+        ++samples;
+    }
+
+    return (f32) total / (f32) samples;
+}
+
+static void report_bandwidth(f32 avg_delta_size) {
+    const size_t header = sizeof(struct server_header);
+
+    // Sizes of the packets carrying player state/input before the codec
+    const size_t legacy_auth      = header + sizeof(struct player) + sizeof(u64);
+    const size_t legacy_peer_auth = header + sizeof(struct player) + sizeof(u64) + sizeof(u8);
+    const size_t legacy_update    = sizeof(struct client_header) + sizeof(struct input);
+
+    const size_t auth      = header + sizeof(struct server_packet_auth);
+    const size_t update    = sizeof(struct client_header) + sizeof(struct client_packet_update);
+
+    u8 data[PLAYER_DELTA_MAX_BYTES];
+    const struct player_fields fields = {0};
+    const size_t full_peer_auth  = header + sizeof(struct server_packet_peer_auth) + player_write_delta(data, sizeof(data), NULL, &fields);
+    const f32    delta_peer_auth = header + sizeof(struct server_packet_peer_auth) + avg_delta_size;
+
+    printf("player: %zu -> %zu bytes (%u bits), input: %zu -> %zu bytes (%u bits)\n",
+           sizeof(struct player), sizeof(struct packed_player), PLAYER_CODEC_BITS,
+           sizeof(struct input), sizeof(struct packed_input), INPUT_CODEC_BITS);
+    printf("PEER_AUTH: %zu bytes full, %.1f bytes delta on average (baseline %u net ticks old)\n",
+           full_peer_auth, delta_peer_auth, DELTA_BASELINE_AGE);
+
+    // Per network tick every peer receives NET_PER_SIM_TICKS AUTHs for its
+    // own player and one PEER_AUTH per other player, and sends
+    // NET_PER_SIM_TICKS updates.
+    const u32 player_counts[] = {2, 8, 32, 64, 128};
+    const f32 net_ticks_per_second = (f32) FPS / (f32) NET_PER_SIM_TICKS;
+    for (u32 i = 0; i < ARRLEN(player_counts); ++i) {
+        const u32 n = player_counts[i];
+        const f32 legacy_down = NET_PER_SIM_TICKS*legacy_auth + (n-1)*legacy_peer_auth;
+        const f32 full_down   = NET_PER_SIM_TICKS*auth + (n-1)*full_peer_auth;
+        const f32 delta_down  = NET_PER_SIM_TICKS*auth + (n-1)*delta_peer_auth;
+        const size_t legacy_up = NET_PER_SIM_TICKS*legacy_update;
+        const size_t up        = NET_PER_SIM_TICKS*update;
+        printf("%3u players | down: %6.0f -> %6.0f full -> %6.0f delta bytes/tick (%7.1f -> %7.1f kB/s per peer) | up: %3zu -> %3zu bytes/tick\n",
+               n, legacy_down, full_down, delta_down,
+               net_ticks_per_second*legacy_down/1000.0f, net_ticks_per_second*delta_down/1000.0f,
+               legacy_up, up);
+    }
+}
+
+int main() {
+    struct random_series_pcg random = random_seed_pcg(0x9053, 0x9005);
+
+    const struct map maps[] = {
+        MAP_INIT(map_data_small,  16, 16),
+        MAP_INIT(map_data_medium, 30, 30),
+        MAP_INIT(map_data_large,  36, 36),
+    };
+    for (u32 i = 0; i < ARRLEN(maps); ++i)
+        round_trip_players(&random, &maps[i]);
+    round_trip_inputs(&random);
+    const f32 avg_delta_size = measure_delta(&random, &maps[1]);
+
+    printf("round trips: %s (%u failures)\n", (failures == 0) ? "ok" : "FAILED", failures);
+
+    report_bandwidth(avg_delta_size);
+
+    return (failures == 0) ? 0 : 1;
+}
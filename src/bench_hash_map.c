@@ -0,0 +1,284 @@
+#include "game.h"
+#include "random.h"
+#include <stdio.h>
+
+//
+// Compares the Robin Hood hash map in hash_map.h against the fixed size
+// linear probing map it replaced, with players as values. The old map is
+// sized to exactly the number of players, like player_map was.
+//
+// Times lookups of present and missing ids, iterating over all values,
+// and churn: removing a random player and inserting a new one. The old
+// map never shifted entries back on remove, so it's only checked for
+// speed there, not for correctness.
+//
+// Also times the server's fan-out loops, one pass over all peers per
+// event, at low and high occupancy. The old peer_map always had
+// MAX_CLIENTS slots to walk no matter how many peers were connected.
+//
+
+#define NUM_OPS 1000000
+
+//
+// The previous implementation
+//
+
+#define OldHashMap(type, size)  \
+    struct {                    \
+        type data[size];        \
+        size_t occupied[size];  \
+        size_t num_items;       \
+    }
+
+#define OldHashMapExists(map, ptr) \
+    (map.occupied[ArrayPtrToIndex(map.data, ptr)] != HASH_MAP_INVALID_HASH)
+
+#define OldHashMapInsert(map, hash, output_value)                       \
+    do {                                                                \
+        assert(map.num_items < ARRLEN(map.data));                       \
+        size_t index = hash % ARRLEN(map.data);                         \
+        while (map.occupied[index] != HASH_MAP_INVALID_HASH) {          \
+            index = (index + 1) % ARRLEN(map.data);                     \
+        }                                                               \
+        memset(&map.data[index], 0, sizeof(map.data[index]));           \
+        map.data[index].id = hash;                                      \
+        map.occupied[index] = hash;                                     \
+        ++map.num_items;                                                \
+        output_value = &map.data[index];                                \
+    } while (0)
+
+#define OldHashMapLookup(map, hash, output_value)                       \
+    do {                                                                \
+        size_t index = HASH_MAP_INVALID_HASH;                           \
+        for (size_t offset = 0; offset < ARRLEN(map.data); ++offset) {  \
+            index = (hash + offset) % ARRLEN(map.data);                 \
+            if (map.occupied[index] == hash)                            \
+                break;                                                  \
+        }                                                               \
+        output_value =  &map.data[index];                               \
+    } while (0)
+
+#define OldHashMapRemove(map, hash)                                     \
+    do {                                                                \
+        void *_p = NULL;                                                \
+        OldHashMapLookup(map, hash, _p);                                \
+        size_t index = ArrayPtrToIndex(map.data, _p);                   \
+        map.occupied[index] = HASH_MAP_INVALID_HASH;                    \
+        --map.num_items;                                                \
+    } while (0)
+
+#define OldHashMapForEach(map, type, iter) \
+    for (type *iter = &map.data[0], *_top = &map.data[ARRLEN(map.data)]; iter != _top; ++iter)
+
+struct result {
+    f64 hit_ns;
+    f64 miss_ns;
+    f64 iterate_ns;
+    f64 churn_ns;
+    f32 sum;
+};
+
+static void print_result(const char *name, u32 n, struct result r) {
+    printf("%-6s %5u players | hit: %7.1f ns | miss: %8.1f ns | iterate: %7.1f ns/player | churn: %8.1f ns | (%.0f)\n",
+           name, n, r.hit_ns, r.miss_ns, r.iterate_ns, r.churn_ns, r.sum);
+}
+
+// ids[0..n) are in the map
+static PlayerId ids[4096];
+
+static u64 next_id = 1;
+
+// Same workload for both maps, body of each op is given as a macro
+#define BENCH(map, lookup, insert, remove, foreach, n, result)                  \
+    do {                                                                        \
+        struct random_series_pcg random = random_seed_pcg(0x9053, n);           \
+        u64 start = time_current();                                             \
+        for (u32 i = 0; i < NUM_OPS; ++i) {                                     \
+            const PlayerId id = ids[random_next_u32(&random) % n];                  \
+            struct player *p = NULL;                                            \
+            lookup(map, id, p);                                                 \
+            result.sum += p->pos.x;                                             \
+        }                                                                       \
+        result.hit_ns = (f64) (time_current() - start) / NUM_OPS;               \
+                                                                                \
+        start = time_current();                                                 \
+        for (u32 i = 0; i < NUM_OPS; ++i) {                                     \
+            const PlayerId id = next_id + random_next_u32(&random) % n;             \
+            struct player *p = NULL;                                            \
+            lookup(map, id, p);                                                 \
+            result.sum += (p != NULL);                                          \
+        }                                                                       \
+        result.miss_ns = (f64) (time_current() - start) / NUM_OPS;              \
+                                                                                \
+        const u32 num_iterations = NUM_OPS / n;                                 \
+        start = time_current();                                                 \
+        for (u32 i = 0; i < num_iterations; ++i) {                              \
+            foreach(map, p) {                                                   \
+                result.sum += p->pos.x;                                         \
+            }                                                                   \
+        }                                                                       \
+        result.iterate_ns = (f64) (time_current() - start) / (num_iterations*n); \
+                                                                                \
+        start = time_current();                                                 \
+        for (u32 i = 0; i < NUM_OPS; ++i) {                                     \
+            const u32 j = random_next_u32(&random) % n;                             \
+            remove(map, ids[j]);                                                \
+            struct player *p = NULL;                                            \
+            ids[j] = next_id++;                                                 \
+            insert(map, ids[j], p);                                             \
+            p->pos.x = 1.0f;                                                    \
+        }                                                                       \
+        result.churn_ns = (f64) (time_current() - start) / NUM_OPS;             \
+    } while (0)
+
+#define NEW_FOREACH(map, p) \
+    HashMapForEach(map, struct player, p)
+
+// The old map has to skip empty slots
+#define OLD_FOREACH(map, p) \
+    OldHashMapForEach(map, struct player, p) if (OldHashMapExists(map, p))
+
+// Old lookups return some slot on a miss, treat it like NULL
+#define OLD_LOOKUP(map, hash, p)                                \
+    do {                                                        \
+        OldHashMapLookup(map, hash, p);                         \
+        if (!OldHashMapExists(map, p) || p->id != (hash))       \
+            p = NULL;                                           \
+    } while (0)
+
+static void fill(u32 n) {
+    for (u32 i = 0; i < n; ++i)
+        ids[i] = next_id++;
+}
+
+#define BENCH_SIZE(n)                                                               \
+    do {                                                                            \
+        static OldHashMap(struct player, n) old_map;                                \
+        memset(&old_map, 0, sizeof(old_map));                                       \
+        HashMap(struct player) new_map = {0};                                       \
+                                                                                    \
+        next_id = 1;                                                                \
+        fill(n);                                                                    \
+        for (u32 i = 0; i < n; ++i) {                                               \
+            struct player *p = NULL;                                                \
+            OldHashMapInsert(old_map, ids[i], p);                                   \
+            p->pos.x = 1.0f;                                                        \
+        }                                                                           \
+        struct result old_result = {0};                                             \
+        BENCH(old_map, OLD_LOOKUP, OldHashMapInsert, OldHashMapRemove, OLD_FOREACH, n, old_result); \
+        print_result("old", n, old_result);                                         \
+                                                                                    \
+        next_id = 1;                                                                \
+        fill(n);                                                                    \
+        for (u32 i = 0; i < n; ++i) {                                               \
+            struct player *p = NULL;                                                \
+            HashMapInsert(new_map, ids[i], p);                                      \
+            p->pos.x = 1.0f;                                                        \
+        }                                                                           \
+        struct result new_result = {0};                                             \
+        BENCH(new_map, HashMapLookup, HashMapInsert, HashMapRemove, NEW_FOREACH, n, new_result); \
+        print_result("robin", n, new_result);                                       \
+                                                                                    \
+        /* Every id we think is in the map should be, and nothing else */           \
+        u32 errors = (new_map.num_items != n);                                      \
+        for (u32 i = 0; i < n; ++i) {                                               \
+            struct player *p = NULL;                                                \
+            HashMapLookup(new_map, ids[i], p);                                      \
+            errors += (p == NULL || p->id != ids[i]);                               \
+        }                                                                           \
+        u32 max_dist = 0;                                                           \
+        u32 num_displaced = 0;                                                      \
+        for (u32 i = 0; i < new_map.base.num_slots; ++i) {                          \
+            if (new_map.base.slots[i].key == HASH_MAP_INVALID_HASH)                 \
+                continue;                                                           \
+            if (new_map.base.slots[i].dist > max_dist)                              \
+                max_dist = new_map.base.slots[i].dist;                              \
+            num_displaced += (new_map.base.slots[i].dist > 0);                      \
+        }                                                                           \
+        printf("             | %u slots, longest probe %u, %u not in home slot, %u errors\n", \
+               new_map.base.num_slots, max_dist, num_displaced, errors);            \
+        HashMapFree(new_map);                                                       \
+    } while (0)
+
+//
+// Fan-out
+//
+
+#define NUM_EVENTS 100000
+
+// Roughly the size of a server_peer, most of which a fan-out loop doesn't
+// touch
+struct fan_out_peer {
+    PlayerId id;
+    i64 budget;
+    u8 state[2048];
+};
+
+static void bench_fan_out(u32 num_peers) {
+    static OldHashMap(struct fan_out_peer, MAX_CLIENTS) old_map;
+    memset(&old_map, 0, sizeof(old_map));
+    HashMap(struct fan_out_peer) new_map = {0};
+
+    // Connect MAX_CLIENTS peers and disconnect all but num_peers of them
+    // at random, so the old map has holes like it would on a live server
+    PlayerId connected[MAX_CLIENTS];
+    for (u32 i = 0; i < MAX_CLIENTS; ++i) {
+        connected[i] = i + 1;
+        struct fan_out_peer *p = NULL;
+        OldHashMapInsert(old_map, connected[i], p);
+        HashMapInsert(new_map, connected[i], p);
+    }
+    struct random_series_pcg random = random_seed_pcg(0x9053, num_peers);
+    for (u32 n = MAX_CLIENTS; n > num_peers; --n) {
+        const u32 i = random_next_u32(&random) % n;
+        OldHashMapRemove(old_map, connected[i]);
+        HashMapRemove(new_map, connected[i]);
+        connected[i] = connected[n - 1];
+    }
+
+    u64 start = time_current();
+    for (u32 i = 0; i < NUM_EVENTS; ++i) {
+        OldHashMapForEach(old_map, struct fan_out_peer, p) if (OldHashMapExists(old_map, p)) {
+            p->budget -= i;
+        }
+    }
+    const f64 old_ns = (f64) (time_current() - start) / NUM_EVENTS;
+
+    start = time_current();
+    for (u32 i = 0; i < NUM_EVENTS; ++i) {
+        HashMapForEach(new_map, struct fan_out_peer, p) {
+            p->budget -= i;
+        }
+    }
+    const f64 new_ns = (f64) (time_current() - start) / NUM_EVENTS;
+
+    i64 old_sum = 0;
+    OldHashMapForEach(old_map, struct fan_out_peer, p) if (OldHashMapExists(old_map, p)) {
+        old_sum += p->budget;
+    }
+    i64 new_sum = 0;
+    HashMapForEach(new_map, struct fan_out_peer, p) {
+        new_sum += p->budget;
+    }
+
+    printf("fan-out %3u/%u peers | old: %7.1f ns | dense: %6.1f ns | per event%s\n",
+           num_peers, MAX_CLIENTS, old_ns, new_ns, (old_sum == new_sum) ? "" : " (sums differ!)");
+    HashMapFree(new_map);
+}
+
+int main() {
+    time_init();
+
+    BENCH_SIZE(16);
+    BENCH_SIZE(128);
+    BENCH_SIZE(4096);
+
+    printf("\n");
+    bench_fan_out(2);
+    bench_fan_out(16);
+    bench_fan_out(64);
+    bench_fan_out(MAX_CLIENTS);
+
+    time_deinit();
+    return 0;
+}
@@ -0,0 +1,207 @@
+#include "interest.h"
+#include "packet.h"
+#include "random.h"
+#include <stdio.h>
+#include <math.h>
+
+//
+// Simulates players wandering around maps of increasing size, shooting and
+// stepping, and compares the downstream bytes per peer of replicating
+// everything to everyone against only replicating what is in each peer's
+// area of interest. Also reports the CPU time spent on interest management
+// per peer, and how often players leave a peer's view per second with and
+// without hysteresis.
+//
+// PEER_AUTH is counted as a full state to isolate the effect of interest
+// management from delta compression.
+//
+
+#define NUM_NET_TICKS (30*FPS/NET_PER_SIM_TICKS)
+#define HITSCAN_LENGTH 20.0f
+
+struct sim_player {
+    PlayerId id;
+    v2 pos;
+    v2 dir;
+    f32 time_to_turn;
+    f32 time_to_step;
+    f32 time_to_shoot;
+    struct interest interest;
+};
+
+static struct sim_player players[MAX_CLIENTS];
+
+static inline f32 random_range(struct random_series_pcg *random, f32 min, f32 max) {
+    return min + (max - min)*random_next_unilateral(random);
+}
+
+static inline v2 random_dir(struct random_series_pcg *random) {
+    const f32 angle = random_range(random, 0.0f, 2.0f*M_PI);
+    return (v2) {cosf(angle), sinf(angle)};
+}
+
+static void bench(u32 map_size, u32 num_players, u32 hysteresis) {
+    struct random_series_pcg random = random_seed_pcg(0x9053, 0x9005);
+
+    const struct map m = {
+        .width = map_size,
+        .height = map_size,
+        .tile_size = 1.0f,
+    };
+
+    struct interest_grid grid = interest_grid_init(&m, INTEREST_CELL_SIZE, INTEREST_RADIUS, hysteresis);
+    static struct interest_events events = {0};
+    events.buffer = byte_buffer_alloc(1 << 20);
+
+    for (u32 i = 0; i < num_players; ++i) {
+        players[i] = (struct sim_player) {
+            .id = i + 1,
+            .pos = {random_range(&random, 1.0f, map_size - 1.0f), random_range(&random, 1.0f, map_size - 1.0f)},
+            .dir = random_dir(&random),
+            .time_to_turn = random_range(&random, 0.0f, 1.0f),
+            .time_to_step = random_range(&random, 0.0f, step_delay),
+            .time_to_shoot = random_range(&random, 0.0f, 2.0f),
+            .interest = interest_alloc(&grid),
+        };
+    }
+
+    u8 data[PLAYER_DELTA_MAX_BYTES];
+    const struct player_fields fields = {0};
+    const size_t peer_auth_size = sizeof(struct server_header) + sizeof(struct server_packet_peer_auth) +
+                                  player_write_delta(data, sizeof(data), NULL, &fields);
+    const size_t leave_size = sizeof(struct server_header) + sizeof(struct server_packet_peer_leave);
+    const size_t batch_header_size = sizeof(struct server_header) + sizeof(struct server_packet_events);
+
+    const f32 dt = (f32) NET_PER_SIM_TICKS / (f32) FPS;
+    u64 bytes_all = 0;
+    u64 bytes_interest = 0;
+    u64 num_visible = 0;
+    u64 num_left_total = 0;
+    u64 interest_time = 0;
+
+    for (u32 tick = 0; tick < NUM_NET_TICKS; ++tick) {
+        // Move players and generate events
+        interest_events_reset(&events);
+        for (u32 i = 0; i < num_players; ++i) {
+            struct sim_player *p = &players[i];
+
+            p->time_to_turn -= dt;
+            if (p->time_to_turn <= 0.0f) {
+                p->dir = random_dir(&random);
+                p->time_to_turn = random_range(&random, 0.5f, 1.5f);
+            }
+            p->pos = v2add(p->pos, v2scale(max_move_speed*dt, p->dir));
+            if (p->pos.x < 1.0f || p->pos.x > map_size - 1.0f) p->dir.x = -p->dir.x;
+            if (p->pos.y < 1.0f || p->pos.y > map_size - 1.0f) p->dir.y = -p->dir.y;
+            p->pos.x = f32_clamp(p->pos.x, 1.0f, map_size - 1.0f);
+            p->pos.y = f32_clamp(p->pos.y, 1.0f, map_size - 1.0f);
+
+            p->time_to_step -= dt;
+            if (p->time_to_step <= 0.0f) {
+                p->time_to_step = step_delay;
+                struct server_packet_step step = {.step = {.player_id_from = p->id, .pos = p->pos}};
+                struct interest_event *event = interest_event_begin(&events, &grid, SERVER_PACKET_STEP, p->id, p->pos, p->pos);
+                APPEND(&events.buffer, &step);
+                interest_event_end(&events, event);
+            }
+
+            p->time_to_shoot -= dt;
+            if (p->time_to_shoot <= 0.0f) {
+                p->time_to_shoot = random_range(&random, 1.0f, 3.0f);
+                const v2 impact = v2add(p->pos, v2scale(HITSCAN_LENGTH, random_dir(&random)));
+
+                struct server_packet_hitscan hitscan = {.hitscan = {.player_id_from = p->id, .pos = p->pos, .impact = impact}};
+                struct interest_event *event = interest_event_begin(&events, &grid, SERVER_PACKET_HITSCAN, p->id, p->pos, impact);
+                APPEND(&events.buffer, &hitscan);
+                interest_event_end(&events, event);
+
+                struct server_packet_sound sound = {.sound = {.player_id_from = p->id, .sound = SOUND_SNIPER_FIRE, .pos = p->pos}};
+                event = interest_event_begin(&events, &grid, SERVER_PACKET_SOUND, p->id, p->pos, p->pos);
+                APPEND(&events.buffer, &sound);
+                interest_event_end(&events, event);
+            }
+        }
+
+        // Without interest management every peer gets every other player
+        // and every event not made by itself
+        for (u32 i = 0; i < num_players; ++i) {
+            bytes_all += (num_players - 1)*peer_auth_size;
+            bool has_type[INTEREST_MAX_TYPES] = {0};
+            for (u32 e = 0; e < events.num_events; ++e) {
+                if (events.events[e].exclude_id == players[i].id)
+                    continue;
+                bytes_all += events.events[e].size;
+                has_type[events.events[e].type] = true;
+            }
+            for (u32 t = 0; t < INTEREST_MAX_TYPES; ++t)
+                bytes_all += has_type[t] ? batch_header_size : 0;
+        }
+
+        const u64 start = time_current();
+
+        interest_grid_begin(&grid);
+        for (u32 i = 0; i < num_players; ++i)
+            interest_grid_add(&grid, players[i].id, players[i].pos);
+        interest_grid_build(&grid);
+
+        u64 tick_bytes = 0;
+        for (u32 i = 0; i < num_players; ++i) {
+            struct sim_player *p = &players[i];
+            interest_update(&grid, &p->interest, p->pos);
+
+            PlayerId entered[MAX_CLIENTS];
+            PlayerId left[MAX_CLIENTS];
+            u32 num_entered = 0;
+            u32 num_left = 0;
+            const u32 visible = interest_collect(&grid, &p->interest, p->id, entered, &num_entered, left, &num_left);
+
+            tick_bytes += visible*peer_auth_size + num_left*leave_size;
+            static struct interest_batches batches;
+            interest_events_batch(&events, &p->interest, p->id, &batches);
+            for (u32 t = 0; t < INTEREST_MAX_TYPES; ++t) {
+                if (batches.counts[t] == 0)
+                    continue;
+                tick_bytes += batch_header_size;
+                for (u32 j = 0; j < batches.counts[t]; ++j)
+                    tick_bytes += events.events[batches.indices[batches.starts[t] + j]].size;
+            }
+
+            num_visible += visible;
+            num_left_total += num_left;
+        }
+
+        interest_time += time_current() - start;
+        bytes_interest += tick_bytes;
+    }
+
+    const f64 peer_ticks = (f64) num_players*NUM_NET_TICKS;
+    const f64 seconds = (f64) NUM_NET_TICKS*dt;
+    printf("%3ux%-3u %3u players hysteresis %u | visible: %5.1f | down: %7.0f -> %7.0f bytes/tick per peer (%5.1fx) | interest: %6.0f ns/tick per peer | leaves: %5.2f /s per peer\n",
+           map_size, map_size, num_players, hysteresis,
+           (f64) num_visible/peer_ticks,
+           (f64) bytes_all/peer_ticks, (f64) bytes_interest/peer_ticks,
+           (f64) bytes_all/(f64) bytes_interest,
+           (f64) interest_time/peer_ticks,
+           (f64) num_left_total/(peer_ticks/NUM_NET_TICKS)/seconds);
+
+    for (u32 i = 0; i < num_players; ++i)
+        interest_free(&players[i].interest);
+    byte_buffer_free(&events.buffer);
+    interest_grid_free(&grid);
+}
+
+int main() {
+    time_init();
+
+    const u32 map_sizes[] = {30, 64, 128, 256};
+    const u32 player_counts[] = {8, 32, 128};
+    for (u32 i = 0; i < ARRLEN(map_sizes); ++i) {
+        for (u32 j = 0; j < ARRLEN(player_counts); ++j) {
+            bench(map_sizes[i], player_counts[j], 0);
+            bench(map_sizes[i], player_counts[j], INTEREST_HYSTERESIS);
+        }
+    }
+
+    time_deinit();
+    return 0;
+}
@@ -0,0 +1,209 @@
+#define ENET_IMPLEMENTATION
+#include "enet.h"
+#include "match.h"
+#include "packet.h"
+#include "random.h"
+#include <stdio.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+//
+// Runs matches full of virtual players on an increasing number of worker
+// threads, as fast as possible and without any sockets, and reports how
+// many matches a core can tick at FPS.
+//
+// Each worker plays the part of the network I/O thread for its matches:
+// it pushes connects and input batches into the inbound rings and drains
+// the outbound rings, destroying the packets instead of sending them.
+//
+
+#define NUM_TICKS (5*FPS)
+#define MAX_WORKERS 64
+#define MAX_BENCH_MATCHES 1024
+
+struct virtual_player {
+    ENetPeer peer;
+    PlayerId id;
+    struct input input;
+};
+
+struct bench_match {
+    struct match *match;
+    struct match_net net;
+    struct virtual_player players[MAX_CLIENTS];
+    u32 num_players;
+    struct random_series_pcg random;
+};
+
+struct bench_worker {
+    pthread_t thread;
+    struct bench_match **matches;
+    u32 num_matches;
+};
+
+static void push_event(struct bench_match *b, struct net_event e) {
+    bool ok = false;
+    SPSC_RING_PUSH(&b->net.inbound, e, ok);
+    assert(ok);
+}
+
+static void drain_outbound(struct bench_match *b) {
+    bool ok = true;
+    struct net_send send;
+    while (true) {
+        SPSC_RING_POP(&b->net.outbound, send, ok);
+        if (!ok)
+            break;
+        if (send.release && --send.packet->referenceCount == 0)
+            enet_packet_destroy(send.packet);
+    }
+}
+
+static void send_inputs(struct bench_match *b, u64 sim_tick) {
+    for (u32 i = 0; i < b->num_players; ++i) {
+        struct virtual_player *p = &b->players[i];
+
+        // Wander around, changing direction every second or so and
+        // shooting now and then
+        if (random_next_u32(&b->random) % FPS == 0) {
+            memset(p->input.active, 0, sizeof(p->input.active));
+            p->input.active[INPUT_MOVE_LEFT + random_next_u32(&b->random) % 4] = true;
+            const f32 angle = 2.0f*M_PI*random_next_unilateral(&b->random);
+            p->input.look = (v2) {cosf(angle), sinf(angle)};
+        }
+        p->input.active[INPUT_SHOOT_PRESSED] = random_next_u32(&b->random) % (2*FPS) == 0;
+        p->input.active[INPUT_MOVE_DODGE] = random_next_u32(&b->random) % (2*FPS) == 0;
+
+        u8 data[256];
+        struct byte_buffer buffer = byte_buffer_init(data, sizeof(data));
+        struct client_batch_header batch = {
+            .codec_version = CODEC_VERSION,
+            .net_tick = sim_tick / NET_PER_SIM_TICKS,
+            .num_packets = NET_PER_SIM_TICKS,
+        };
+        APPEND(&buffer, &batch);
+        for (u32 j = 0; j < NET_PER_SIM_TICKS; ++j) {
+            struct client_header header = {
+                .type = CLIENT_PACKET_UPDATE,
+                .sim_tick = sim_tick + 2 + j,
+            };
+            struct client_packet_update update = {
+                .input = input_encode(&p->input),
+            };
+            APPEND(&buffer, &header);
+            APPEND(&buffer, &update);
+        }
+
+        ENetPacket *packet = enet_packet_create(data, buffer.top - buffer.base, ENET_PACKET_FLAG_UNSEQUENCED);
+        push_event(b, (struct net_event) {
+            .type = NET_EVENT_RECEIVE,
+            .id = p->id,
+            .peer = &p->peer,
+            .packet = packet,
+        });
+    }
+}
+
+static void *worker_run(void *arg) {
+    struct bench_worker *w = arg;
+    for (u64 tick = 0; tick < NUM_TICKS; ++tick) {
+        for (u32 i = 0; i < w->num_matches; ++i) {
+            struct bench_match *b = w->matches[i];
+            if (tick % NET_PER_SIM_TICKS == 0)
+                send_inputs(b, tick);
+            match_tick(b->match);
+            drain_outbound(b);
+        }
+    }
+    return NULL;
+}
+
+static struct bench_match *bench_match_create(u32 id, u32 num_players) {
+    struct bench_match *b = calloc(1, sizeof(struct bench_match));
+    assert(b);
+    b->match = match_create(id, &b->net, 0x9053 + id, false);
+    b->random = random_seed_pcg(0x9053 + id, 0x9005);
+    b->num_players = num_players;
+    for (u32 i = 0; i < num_players; ++i) {
+        struct virtual_player *p = &b->players[i];
+        p->id = player_id();
+        push_event(b, (struct net_event) {
+            .type = NET_EVENT_CONNECT,
+            .id = p->id,
+            .peer = &p->peer,
+        });
+    }
+    return b;
+}
+
+static void bench_match_destroy(struct bench_match *b) {
+    drain_outbound(b);
+    // Inputs still in the ring are owned by us
+    bool ok = true;
+    struct net_event e;
+    while (true) {
+        SPSC_RING_POP(&b->net.inbound, e, ok);
+        if (!ok)
+            break;
+        if (e.packet != NULL)
+            enet_packet_destroy(e.packet);
+    }
+    match_destroy(b->match);
+    free(b);
+}
+
+// Returns matches per core at FPS
+static f64 bench(u32 num_workers, u32 matches_per_worker, u32 num_players) {
+    static struct bench_worker workers[MAX_WORKERS];
+    static struct bench_match *matches[MAX_BENCH_MATCHES];
+
+    const u32 num_matches = num_workers*matches_per_worker;
+    assert(num_matches <= MAX_BENCH_MATCHES);
+    for (u32 i = 0; i < num_matches; ++i)
+        matches[i] = bench_match_create(i, num_players);
+    for (u32 i = 0; i < num_workers; ++i) {
+        workers[i].matches = &matches[i*matches_per_worker];
+        workers[i].num_matches = matches_per_worker;
+    }
+
+    const u64 start = time_current();
+    for (u32 i = 0; i < num_workers; ++i)
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    for (u32 i = 0; i < num_workers; ++i)
+        pthread_join(workers[i].thread, NULL);
+    const u64 elapsed = time_current() - start;
+
+    for (u32 i = 0; i < num_matches; ++i)
+        bench_match_destroy(matches[i]);
+
+    const f64 match_ticks_per_second = (f64) num_matches*NUM_TICKS / ((f64) elapsed / NANOSECONDS(1));
+    const f64 matches_per_core = match_ticks_per_second / FPS / num_workers;
+    printf("%2u players | %2u workers x %2u matches | %8.1f us per match tick | %6.1f matches per core at %u Hz\n",
+           num_players, num_workers, matches_per_worker,
+           (f64) elapsed / 1000.0 / ((f64) num_matches*NUM_TICKS / num_workers),
+           matches_per_core, FPS);
+    return matches_per_core;
+}
+
+int main() {
+    time_init();
+    if (enet_initialize() != 0)
+        return 1;
+
+    u32 num_cores = (u32) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cores > MAX_WORKERS)
+        num_cores = MAX_WORKERS;
+
+    const u32 player_counts[] = {8, MAX_PLAYERS_PER_MATCH};
+    for (u32 i = 0; i < ARRLEN(player_counts); ++i) {
+        for (u32 workers = 1; workers <= num_cores; workers *= 2)
+            bench(workers, 8, player_counts[i]);
+        if ((num_cores & (num_cores - 1)) != 0)
+            bench(num_cores, 8, player_counts[i]);
+    }
+
+    enet_deinitialize();
+    time_deinit();
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include "game.h"
+#include "random.h"
+#include <stdio.h>
+#include <math.h>
+
+//
+// Times removing tagged items from a full list of MAX_STEPS steps, with
+// the previous per-item memmove against the single pass ordered and
+// swap-remove compactions in common.h, and update_projectiles on full
+// projectile lists where a good part of them expire every tick.
+//
+
+#define NUM_ITERATIONS 100000
+#define NUM_RUNS 5
+#define NUM_TICKS 100000
+
+//
+// The previous implementation
+//
+
+#define OldList(type, size)      \
+    struct {                     \
+        type items[size];        \
+        bool occupied[size];     \
+        u32 num_items;           \
+    }
+
+#define OldListRemoveTaggedItems(list)                                                                          \
+    do {                                                                                                        \
+        for (u32 i = 0; i < list.num_items;) {                                                                  \
+            if (!list.occupied[i]) {                                                                            \
+                if (i+1 < list.num_items) {                                                                     \
+                    memmove(&list.items[i], &list.items[i+1], sizeof(list.items[0])*(list.num_items - (i+1)));  \
+                    memmove(&list.occupied[i], &list.occupied[i+1], sizeof(bool)*(list.num_items - (i+1)));     \
+                }                                                                                               \
+                --list.num_items;                                                                               \
+            } else {                                                                                            \
+                ++i;                                                                                            \
+            }                                                                                                   \
+        }                                                                                                       \
+    } while (0)
+
+//
+// Compaction
+//
+
+// Times removing the tagged items from a copy of template, minus the time
+// of just copying it, best of NUM_RUNS
+#define BENCH_COMPACT(list, template, remove, result)                           \
+    do {                                                                        \
+        f64 best = INFINITY;                                                    \
+        for (u32 run = 0; run < NUM_RUNS; ++run) {                              \
+            u64 start = time_current();                                         \
+            for (u32 n = 0; n < NUM_ITERATIONS; ++n) {                          \
+                list = template;                                                \
+                result.sum += list.items[n % MAX_STEPS].player_id_from;         \
+            }                                                                   \
+            const u64 copy = time_current() - start;                            \
+                                                                                \
+            start = time_current();                                             \
+            for (u32 n = 0; n < NUM_ITERATIONS; ++n) {                          \
+                list = template;                                                \
+                remove(list);                                                   \
+                result.sum += list.num_items;                                   \
+            }                                                                   \
+            const u64 total = time_current() - start;                           \
+            const f64 ns = (total > copy) ? (f64) (total - copy) / NUM_ITERATIONS : 0.0; \
+            best = (ns < best) ? ns : best;                                     \
+        }                                                                       \
+        result.ns = best;                                                       \
+    } while (0)
+
+struct compact_result {
+    f64 ns;
+    u64 sum;
+};
+
+// Removes a random one in one_in items, or none if 0. If oldest is set
+// the same number of items are removed from the front instead, like when
+// things with the same lifetime expire.
+static void bench_compact(const char *name, u32 one_in, bool oldest) {
+    struct random_series_pcg random = random_seed_pcg(0x9053, one_in);
+    bool keep[MAX_STEPS];
+    u32 num_removed = 0;
+    for (u32 i = 0; i < MAX_STEPS; ++i) {
+        keep[i] = (one_in == 0) || random_next_u32(&random) % one_in != 0;
+        num_removed += !keep[i];
+    }
+    if (oldest) {
+        for (u32 i = 0; i < MAX_STEPS; ++i)
+            keep[i] = i >= num_removed;
+    }
+
+    static OldList(struct step, MAX_STEPS) old_template, old_list;
+    static List(struct step, MAX_STEPS) template, list;
+    ListClear(template);
+    for (u32 i = 0; i < MAX_STEPS; ++i) {
+        const struct step s = {.player_id_from = i};
+        old_template.items[i] = s;
+        old_template.occupied[i] = keep[i];
+        ListInsert(template, s);
+        if (!keep[i])
+            ListTagRemoveIndex(template, i);
+    }
+    old_template.num_items = MAX_STEPS;
+
+    struct compact_result old_result = {0};
+    BENCH_COMPACT(old_list, old_template, OldListRemoveTaggedItems, old_result);
+
+    struct compact_result ordered_result = {0};
+    BENCH_COMPACT(list, template, ListRemoveTaggedItems, ordered_result);
+    bool ordered_ok = list.num_items == old_list.num_items;
+    for (u32 i = 0; i < list.num_items; ++i)
+        ordered_ok &= list.items[i].player_id_from == old_list.items[i].player_id_from;
+
+    struct compact_result swap_result = {0};
+    BENCH_COMPACT(list, template, ListSwapRemoveTaggedItems, swap_result);
+    bool swap_ok = list.num_items == old_list.num_items;
+    for (u32 i = 0; i < list.num_items; ++i)
+        swap_ok &= keep[list.items[i].player_id_from];
+
+    printf("remove %-13s of %u | memmove: %7.1f ns | ordered: %6.1f ns%s | swap: %6.1f ns%s\n",
+           name, MAX_STEPS, old_result.ns,
+           ordered_result.ns, ordered_ok ? "" : " (wrong!)",
+           swap_result.ns, swap_ok ? "" : " (wrong!)");
+}
+
+//
+// update_projectiles
+//
+
+// Each list is topped up to full after every tick, with items that live
+// for 1 to 8 ticks. Nades insert up to two sounds and one explosion when
+// they expire, so they and the explosions that are already there only
+// take up half their lists.
+static void refill(struct game *game, struct random_series_pcg *random, f32 dt) {
+    const f32 map_center = 0.5f*(f32) game->map.width*game->map.tile_size;
+    const v2 pos = {map_center, map_center};
+
+    while (game->hitscan_list.num_items < MAX_HITSCAN_PROJECTILES) {
+        struct hitscan_projectile hitscan = {
+            .player_id_from = 1,
+            .pos = pos,
+            .impact = pos,
+            // Not sniper_trail_time, so no sound is emitted
+            .time_left = dt*(f32) (1 + random_next_u32(random) % 8),
+        };
+        ListInsert(game->hitscan_list, hitscan);
+    }
+
+    while (game->nade_list.num_items < MAX_HITSCAN_PROJECTILES/2) {
+        const f32 angle = 2.0f*M_PI*random_next_unilateral(random);
+        struct nade_projectile nade = {
+            .player_id_from = 1,
+            .dir = {cosf(angle), sinf(angle)},
+            .start_pos = pos,
+            .pos = pos,
+            .vel = 1.0f,
+            .impact = pos,
+            // Never reached, nades don't bounce
+            .impact_distance = 1000.0f,
+            .time_left = dt*(f32) (1 + random_next_u32(random) % 8),
+        };
+        ListInsert(game->nade_list, nade);
+    }
+
+    while (game->explosion_list.num_items < MAX_HITSCAN_PROJECTILES/2) {
+        struct explosion e = {
+            .player_id_from = 1,
+            .pos = pos,
+            .radius = 2.0f,
+            .time_left = dt*(f32) (1 + random_next_u32(random) % 8),
+        };
+        ListInsert(game->explosion_list, e);
+    }
+
+    while (game->step_list.num_items < MAX_STEPS) {
+        struct step s = {
+            .player_id_from = 1,
+            .pos = pos,
+            .time_left = dt*(f32) (1 + random_next_u32(random) % 8),
+        };
+        ListInsert(game->step_list, s);
+    }
+}
+
+static void bench_update_projectiles() {
+    static struct game game;
+    game.map = map;
+    const f32 dt = 1.0f / (f32) FPS;
+    struct random_series_pcg random = random_seed_pcg(0x9053, 0x9005);
+
+    u64 total = 0;
+    u64 removed = 0;
+    for (u32 n = 0; n < NUM_TICKS; ++n) {
+        refill(&game, &random, dt);
+        const u32 before = game.hitscan_list.num_items + game.nade_list.num_items + game.step_list.num_items;
+
+        const u64 start = time_current();
+        update_projectiles(&game, dt);
+        total += time_current() - start;
+
+        removed += before - (game.hitscan_list.num_items + game.nade_list.num_items + game.step_list.num_items);
+        ListClear(game.sound_list);
+        ListClear(game.damage_list);
+        // Explosions from nades are removed with the rest next tick
+        while (game.explosion_list.num_items > MAX_HITSCAN_PROJECTILES/2)
+            --game.explosion_list.num_items;
+    }
+
+    printf("update_projectiles, full lists | %6.1f ns per tick | %.1f items removed per tick\n",
+           (f64) total / NUM_TICKS, (f64) removed / NUM_TICKS);
+}
+
+int main() {
+    time_init();
+
+    bench_compact("none", 0, false);
+    bench_compact("1 in 8", 8, false);
+    bench_compact("1 in 2", 2, false);
+    bench_compact("all", 1, false);
+    bench_compact("oldest 1 in 8", 8, true);
+    bench_compact("oldest 1 in 2", 2, true);
+
+    printf("\n");
+    bench_update_projectiles();
+
+    time_deinit();
+    return 0;
+}
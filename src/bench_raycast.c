@@ -0,0 +1,217 @@
+#include "game.h"
+#include "random.h"
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+
+//
+// Compares the grid traversal raycast_map against the brute force
+// version testing every stone tile, on each of the maps in game.h.
+//
+// collide_ray_aabb picks the box edges closest to the ray origin, and
+// misses some tiles when the ray starts close to them. Results are
+// therefore also checked against an exact slab test, which is what the
+// grid traversal should agree with.
+//
+// Also times hitscan against players, at the current positions and
+// rewound through the lag compensation history.
+//
+
+#define NUM_RAYS 100000
+
+struct ray {
+    v2 pos;
+    v2 dir;
+};
+
+static struct ray rays[NUM_RAYS];
+static struct raycast_result results_brute_force[NUM_RAYS];
+static struct raycast_result results_grid[NUM_RAYS];
+
+static bool results_agree(struct raycast_result *a, struct raycast_result *b) {
+    return a->hit == b->hit &&
+           fabsf(a->distance - b->distance) <= 1e-3f &&
+           v2equal(a->normal, b->normal);
+}
+
+static struct raycast_result raycast_map_slab(struct game *game, v2 pos, v2 dir) {
+    struct raycast_result res = {
+        .distance = FLT_MAX,
+    };
+
+    const struct map *m = &game->map;
+    for (i32 j = 0; j < m->height; ++j) {
+        for (i32 i = 0; i < m->width; ++i) {
+            if (m->data[j*m->width + i] != TILE_STONE)
+                continue;
+
+            const f32 x0 = m->origin.x + i*m->tile_size;
+            const f32 y0 = m->origin.y + j*m->tile_size;
+            const f32 x1 = x0 + m->tile_size;
+            const f32 y1 = y0 + m->tile_size;
+
+            f32 t_near_x = -FLT_MAX, t_far_x = FLT_MAX;
+            f32 t_near_y = -FLT_MAX, t_far_y = FLT_MAX;
+            if (dir.x != 0.0f) {
+                t_near_x = f32_min((x0 - pos.x)/dir.x, (x1 - pos.x)/dir.x);
+                t_far_x  = f32_max((x0 - pos.x)/dir.x, (x1 - pos.x)/dir.x);
+            } else if (pos.x < x0 || pos.x > x1) {
+                continue;
+            }
+            if (dir.y != 0.0f) {
+                t_near_y = f32_min((y0 - pos.y)/dir.y, (y1 - pos.y)/dir.y);
+                t_far_y  = f32_max((y0 - pos.y)/dir.y, (y1 - pos.y)/dir.y);
+            } else if (pos.y < y0 || pos.y > y1) {
+                continue;
+            }
+
+            const f32 t = f32_max(t_near_x, t_near_y);
+            if (t < 0.0f || t > f32_min(t_far_x, t_far_y) || t >= res.distance)
+                continue;
+
+            res.hit = true;
+            res.distance = t;
+            res.impact = v2add(pos, v2scale(t, dir));
+            res.normal = (t_near_x > t_near_y) ? (v2) {(dir.x > 0.0f) ? -1.0f : 1.0f, 0.0f} :
+                                                 (v2) {0.0f, (dir.y > 0.0f) ? -1.0f : 1.0f};
+        }
+    }
+
+    return res;
+}
+
+static void generate_rays(struct random_series_pcg *random, const struct map *m) {
+    for (u32 i = 0; i < NUM_RAYS; ++i) {
+        v2 pos;
+        do {
+            pos.x = m->origin.x + m->width  * m->tile_size * random_next_unilateral(random);
+            pos.y = m->origin.y + m->height * m->tile_size * random_next_unilateral(random);
+        } while (map_at(m, pos) == TILE_STONE);
+
+        const f32 angle = 2.0f * M_PI * random_next_unilateral(random);
+        rays[i] = (struct ray) {
+            .pos = pos,
+            .dir = {cosf(angle), sinf(angle)},
+        };
+    }
+}
+
+static u64 run(struct game *game, struct raycast_result *results,
+               struct raycast_result (*raycast)(struct game *, v2, v2)) {
+    const u64 start = time_current();
+    for (u32 i = 0; i < NUM_RAYS; ++i) {
+        results[i] = raycast(game, rays[i].pos, rays[i].dir);
+    }
+    return time_current() - start;
+}
+
+static void bench_map(const char *name, struct map m) {
+    static struct game game;
+    memset(&game, 0, sizeof(game));
+    game.map = m;
+
+    struct random_series_pcg random = random_seed_pcg(0x9053, 0x9005);
+    generate_rays(&random, &m);
+
+    const u64 brute_force_time = run(&game, results_brute_force, raycast_map_brute_force);
+    const u64 grid_time = run(&game, results_grid, raycast_map);
+
+    u32 brute_force_mismatches = 0;
+    u32 slab_mismatches = 0;
+    for (u32 i = 0; i < NUM_RAYS; ++i) {
+        struct raycast_result slab = raycast_map_slab(&game, rays[i].pos, rays[i].dir);
+        if (!results_agree(&results_brute_force[i], &results_grid[i]))
+            ++brute_force_mismatches;
+        if (!results_agree(&slab, &results_grid[i]))
+            ++slab_mismatches;
+    }
+
+    printf("%-8s %2ux%-2u | brute force: %8.1f ns/ray | grid: %8.1f ns/ray | speedup: %5.1fx | differs from brute force: %u/%u | differs from slab test: %u/%u\n",
+           name, m.width, m.height,
+           (f64) brute_force_time / NUM_RAYS,
+           (f64) grid_time / NUM_RAYS,
+           (f64) brute_force_time / (f64) grid_time,
+           brute_force_mismatches, NUM_RAYS,
+           slab_mismatches, NUM_RAYS);
+}
+
+static void bench_players(struct map m) {
+    static struct game game;
+    memset(&game, 0, sizeof(game));
+    game.map = m;
+
+    struct random_series_pcg random = random_seed_pcg(0x9053, 0x9005);
+    generate_rays(&random, &m);
+
+    const u32 num_players = MAX_PLAYERS_PER_MATCH;
+    for (u32 i = 0; i < num_players; ++i) {
+        struct player *p = NULL;
+        HashMapInsert(game.player_map, (PlayerId) i + 1, p);
+        p->pos = rays[NUM_RAYS - 1 - i].pos;
+        p->velocity = v2scale(2.0f, rays[NUM_RAYS - 1 - i].dir);
+    }
+
+    // Fill the history with players moving around
+    const u64 latest_tick = 1000;
+    for (u64 tick = latest_tick - LAG_COMPENSATION_TICKS + 1; tick <= latest_tick; ++tick) {
+        HashMapForEach(game.player_map, struct player, p)
+            p->pos = v2add(p->pos, v2scale(1.0f / FPS, p->velocity));
+        player_history_record(&game, tick);
+    }
+
+    static PlayerId hits_current[NUM_RAYS];
+    static PlayerId hits_rewound[NUM_RAYS];
+
+    u64 start = time_current();
+    for (u32 i = 0; i < NUM_RAYS; ++i) {
+        struct player *hit = NULL;
+        struct raycast_result res = raycast_players(&game, rays[i].pos, rays[i].dir, &hit);
+        hits_current[i] = res.hit ? hit->id : HASH_MAP_INVALID_HASH;
+    }
+    const u64 current_time = time_current() - start;
+
+    // Rewinding to the latest tick sees the current positions, so results
+    // should agree
+    u32 mismatches = 0;
+    start = time_current();
+    for (u32 i = 0; i < NUM_RAYS; ++i) {
+        const struct player_history_tick *h = player_history_at(&game, latest_tick);
+        PlayerId hit = HASH_MAP_INVALID_HASH;
+        struct raycast_result res = raycast_player_history(h, rays[i].pos, rays[i].dir, HASH_MAP_INVALID_HASH, &hit);
+        hits_rewound[i] = res.hit ? hit : HASH_MAP_INVALID_HASH;
+    }
+    const u64 rewound_time = time_current() - start;
+    for (u32 i = 0; i < NUM_RAYS; ++i) {
+        if (hits_current[i] != hits_rewound[i])
+            ++mismatches;
+    }
+
+    // Rewinding across the whole window
+    start = time_current();
+    u32 hits = 0;
+    for (u32 i = 0; i < NUM_RAYS; ++i) {
+        const struct player_history_tick *h = player_history_at(&game, latest_tick - i % LAG_COMPENSATION_MAX_TICKS);
+        PlayerId hit = HASH_MAP_INVALID_HASH;
+        hits += raycast_player_history(h, rays[i].pos, rays[i].dir, HASH_MAP_INVALID_HASH, &hit).hit;
+    }
+    const u64 window_time = time_current() - start;
+
+    printf("players  %2u    | current: %8.1f ns/ray | rewound: %8.1f ns/ray | rewound across window: %8.1f ns/ray (%u hits) | differs from current: %u/%u\n",
+           num_players,
+           (f64) current_time / NUM_RAYS,
+           (f64) rewound_time / NUM_RAYS,
+           (f64) window_time / NUM_RAYS, hits,
+           mismatches, NUM_RAYS);
+}
+
+int main() {
+    time_init();
+
+    bench_map("small",  (struct map) MAP_INIT(map_data_small,  16, 16));
+    bench_map("medium", (struct map) MAP_INIT(map_data_medium, 30, 30));
+    bench_map("large",  (struct map) MAP_INIT(map_data_large,  36, 36));
+    bench_players((struct map) MAP_INIT(map_data_medium, 30, 30));
+
+    time_deinit();
+    return 0;
+}
@@ -0,0 +1,187 @@
+#define ENET_IMPLEMENTATION
+#include "enet.h"
+#include "transport.h"
+#include "net.h"
+#include "match.h"
+#include "packet.h"
+#include "random.h"
+#include <stdio.h>
+#include <math.h>
+
+//
+// Soak test of the server with virtual peers on the loopback transport,
+// built with TRANSPORT_LOOPBACK. Peers fill as many matches as needed and
+// go through the same network I/O code as real clients, but everything
+// runs on a single thread as fast as possible so there is no kernel
+// networking or scheduling noise in the results.
+//
+// Reports the time per tick spent routing packets through the transport
+// and in each phase of match_tick, summed over all matches. An optional
+// per-peer budget in bytes per second shows what the bandwidth budget holds
+// back.
+//
+
+#define NUM_TICKS (10*FPS)
+#define DEFAULT_NUM_PEERS 1000
+
+struct virtual_peer {
+    struct input input;
+};
+
+static void send_inputs(struct transport *t, struct virtual_peer *peers, struct random_series_pcg *random, u64 sim_tick) {
+    for (u32 i = 0; i < t->num_peers; ++i) {
+        struct virtual_peer *p = &peers[i];
+
+        // Wander around, changing direction every second or so and
+        // shooting now and then
+        if (random_next_u32(random) % FPS == 0) {
+            memset(p->input.active, 0, sizeof(p->input.active));
+            p->input.active[INPUT_MOVE_LEFT + random_next_u32(random) % 4] = true;
+            const f32 angle = 2.0f*M_PI*random_next_unilateral(random);
+            p->input.look = (v2) {cosf(angle), sinf(angle)};
+        }
+        p->input.active[INPUT_SHOOT_PRESSED] = random_next_u32(random) % (2*FPS) == 0;
+        p->input.active[INPUT_MOVE_DODGE] = random_next_u32(random) % (2*FPS) == 0;
+
+        // Acknowledge the latest batch like a client would, so player
+        // states are delta encoded
+        const u64 ack_net_tick = t->peers[i].last_net_tick;
+
+        u8 data[256];
+        struct byte_buffer buffer = byte_buffer_init(data, sizeof(data));
+        struct client_batch_header batch = {
+            .codec_version = CODEC_VERSION,
+            .net_tick = sim_tick / NET_PER_SIM_TICKS,
+            .num_packets = NET_PER_SIM_TICKS,
+            .ack_net_tick = ack_net_tick,
+            .ack_bits = (ack_net_tick > 0) ? 1 : 0,
+        };
+        APPEND(&buffer, &batch);
+        for (u32 j = 0; j < NET_PER_SIM_TICKS; ++j) {
+            struct client_header header = {
+                .type = CLIENT_PACKET_UPDATE,
+                .sim_tick = sim_tick + 2 + j,
+            };
+            struct client_packet_update update = {
+                .input = input_encode(&p->input),
+            };
+            APPEND(&buffer, &header);
+            APPEND(&buffer, &update);
+        }
+
+        transport_loopback_receive(t, i, data, buffer.top - buffer.base);
+    }
+}
+
+int main(int argc, char **argv) {
+    const u32 num_peers = (argc > 1) ? (u32) atoi(argv[1]) : DEFAULT_NUM_PEERS;
+    const u32 budget = (argc > 2) ? (u32) atoi(argv[2]) : 0;
+    const u32 num_matches = (num_peers + MAX_PLAYERS_PER_MATCH - 1) / MAX_PLAYERS_PER_MATCH;
+    if (num_peers == 0 || num_matches > MAX_MATCHES) {
+        printf("usage: %s [peers] [budget bytes/s], at most %u peers\n", argv[0], MAX_MATCHES*MAX_PLAYERS_PER_MATCH);
+        return 1;
+    }
+
+    time_init();
+    if (enet_initialize() != 0)
+        return 1;
+
+    struct transport transport = transport_loopback_init(num_peers);
+
+    static struct net_io net = {0};
+    net.transport = &transport;
+    net.num_matches = num_matches;
+    net.matches = calloc(num_matches, sizeof(struct match_net));
+    assert(net.matches);
+
+    struct match **matches = calloc(num_matches, sizeof(struct match *));
+    assert(matches);
+    for (u32 i = 0; i < num_matches; ++i) {
+        matches[i] = match_create(i, &net.matches[i], 0x9053 + i, false);
+        match_set_budget(matches[i], budget);
+    }
+
+    struct virtual_peer *peers = calloc(num_peers, sizeof(struct virtual_peer));
+    assert(peers);
+    struct random_series_pcg random = random_seed_pcg(0x9053, 0x9005);
+
+    for (u32 i = 0; i < num_peers; ++i)
+        transport_loopback_connect(&transport, i, i / MAX_PLAYERS_PER_MATCH);
+
+    u64 transport_time = 0;
+    u64 input_time = 0;
+    const u64 start = time_current();
+    for (u64 tick = 0; tick < NUM_TICKS; ++tick) {
+        u64 t0 = time_current();
+        if (tick % NET_PER_SIM_TICKS == 0)
+            send_inputs(&transport, peers, &random, tick);
+        u64 t1 = time_current();
+        net_service(&net, 0);
+        u64 t2 = time_current();
+        for (u32 i = 0; i < num_matches; ++i)
+            match_tick(matches[i]);
+        u64 t3 = time_current();
+        net_service(&net, 0);
+        u64 t4 = time_current();
+
+        input_time += t1 - t0;
+        transport_time += (t2 - t1) + (t4 - t3);
+    }
+    const u64 elapsed = time_current() - start - input_time;
+
+    u64 phase_times[MATCH_PHASE_LAST] = {0};
+    for (u32 i = 0; i < num_matches; ++i) {
+        const u64 *times = match_phase_times(matches[i]);
+        for (u32 j = 0; j < MATCH_PHASE_LAST; ++j)
+            phase_times[j] += times[j];
+    }
+
+    struct match_bandwidth bandwidth = {0};
+    for (u32 i = 0; i < num_matches; ++i) {
+        const struct match_bandwidth *b = match_bandwidth(matches[i]);
+        bandwidth.bytes_sent += b->bytes_sent;
+        bandwidth.bytes_mandatory += b->bytes_mandatory;
+        bandwidth.states_deferred += b->states_deferred;
+        bandwidth.events_dropped += b->events_dropped;
+    }
+
+    u64 bytes_received = 0;
+    for (u32 i = 0; i < num_peers; ++i)
+        bytes_received += transport.peers[i].bytes_received;
+
+    const f64 seconds = (f64) NUM_TICKS / FPS;
+    printf("%u peers in %u matches, %u ticks | %8.1f us per tick | %5.2fx realtime at %u Hz | down: %7.0f bytes/s per peer\n",
+           num_peers, num_matches, NUM_TICKS,
+           (f64) elapsed / 1000.0 / NUM_TICKS,
+           seconds / ((f64) elapsed / NANOSECONDS(1)), FPS,
+           (f64) bytes_received / num_peers / seconds);
+
+    printf("  budget: %u bytes/s per peer, %.0f always sent | states deferred: %7.1f /s per peer | events dropped: %7.1f /s per peer\n",
+           budget,
+           (f64) bandwidth.bytes_mandatory / num_peers / seconds,
+           (f64) bandwidth.states_deferred / num_peers / seconds,
+           (f64) bandwidth.events_dropped / num_peers / seconds);
+
+    printf("  %-11s | %8.1f us per tick | %6.1f ns per peer | %5.1f%%\n", "transport",
+           (f64) transport_time / 1000.0 / NUM_TICKS,
+           (f64) transport_time / NUM_TICKS / num_peers,
+           100.0 * (f64) transport_time / (f64) elapsed);
+    for (u32 i = 0; i < MATCH_PHASE_LAST; ++i) {
+        printf("  %-11s | %8.1f us per tick | %6.1f ns per peer | %5.1f%%\n", match_phase_names[i],
+               (f64) phase_times[i] / 1000.0 / NUM_TICKS,
+               (f64) phase_times[i] / NUM_TICKS / num_peers,
+               100.0 * (f64) phase_times[i] / (f64) elapsed);
+    }
+
+    net_free(&net);
+    for (u32 i = 0; i < num_matches; ++i)
+        match_destroy(matches[i]);
+    free(matches);
+    free(net.matches);
+    free(peers);
+    transport_loopback_free(&transport);
+
+    enet_deinitialize();
+    time_deinit();
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include "common.h"
+#include <stdio.h>
+#include <math.h>
+
+//
+// Runs ticks at FPS with a fake workload, once with the old busy-wait
+// relative to the frame start and once with the tick scheduler, and
+// reports CPU time used, tick jitter and how far the tick count drifts
+// from wall clock time.
+//
+
+#define NUM_TICKS (3*FPS)
+#define WORK_NS 1000000ull
+
+static u64 cpu_time() {
+    struct timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec * NANOSECONDS(1) + t.tv_nsec;
+}
+
+static void report(const char *name, u64 wall, u64 cpu, const struct tick_stats *stats) {
+    const u64 period = NANOSECONDS(1) / FPS;
+    printf("%-10s | cpu: %5.1f%% | drift: %+8.1f us | jitter: %6.1f us mean, %6.1f us stddev, %7.1f us max | overruns: %lu\n",
+           name,
+           100.0 * (f64) cpu / (f64) wall,
+           ((f64) wall - (f64) NUM_TICKS*period)/1000.0,
+           tick_stats_jitter_mean(stats)/1000.0,
+           sqrt(tick_stats_jitter_variance(stats))/1000.0,
+           stats->jitter_max/1000.0,
+           stats->num_overruns);
+}
+
+static void busy_wait() {
+    const u64 desired_delta = NANOSECONDS(1) / FPS;
+    struct tick_stats stats;
+    tick_stats_reset(&stats);
+
+    const u64 cpu_start = time_current();
+    const u64 cpu_time_start = cpu_time();
+    u64 deadline = cpu_start + desired_delta;
+    for (u32 i = 0; i < NUM_TICKS; ++i) {
+        const u64 frame_start = time_current();
+        time_spin_until(frame_start + WORK_NS);
+
+        const u64 delta = time_current() - frame_start;
+        if (delta < desired_delta) {
+            const u64 start = time_current();
+            while (time_current() - start < desired_delta - delta) {}
+        }
+
+        // Lateness compared to where the tick should have started
+        const u64 now = time_current();
+        tick_stats_record(&stats, (now > deadline) ? now - deadline : 0);
+        deadline += desired_delta;
+    }
+    report("busy-wait", time_current() - cpu_start, cpu_time() - cpu_time_start, &stats);
+}
+
+static void scheduler() {
+    struct tick_scheduler s = tick_scheduler_init(NANOSECONDS(1) / FPS);
+
+    const u64 start = time_current();
+    const u64 cpu_time_start = cpu_time();
+    for (u32 i = 0; i < NUM_TICKS; ++i) {
+        time_spin_until(time_current() + WORK_NS);
+        tick_scheduler_wait(&s);
+    }
+    report("scheduler", time_current() - start, cpu_time() - cpu_time_start, &s.stats);
+}
+
+int main() {
+    time_init();
+    busy_wait();
+    scheduler();
+    time_deinit();
+    return 0;
+}
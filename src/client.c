@@ -12,6 +12,10 @@
 #include "game.h"
 #include "audio.h"
 #include "draw.h"
+#include "trace.h"
+#include "clock.h"
+#include "interp.h"
+#include "client_net.h"
 
 // stdlib
 #include <stdio.h>
@@ -21,15 +25,12 @@
 
 #define PACKET_LOG_SIZE 2048
 #define OUTPUT_BUFFER_SIZE 2048
-#define INPUT_BUFFER_LENGTH 512
-#define UPDATE_LOG_BUFFER_SIZE 512
 
 //
 // Client state
 //
 
 bool running = true;
-bool connected = false;
 
 typedef enum MenuState {
     START,
@@ -44,24 +45,9 @@ struct camera camera = {0};
 // Network
 //
 
-const u64 initial_server_net_tick_offset = 5;
-
-struct peer_auth_buffer {
-    struct server_packet_peer_auth data[UPDATE_LOG_BUFFER_SIZE];
-    u64 bottom;
-    u64 used;
-};
-
-struct client_peer {
-    PlayerId id;
-    struct peer_auth_buffer auth_buffer;
-};
-
-static inline void new_packet(struct byte_buffer *output_buffer) {
-    struct client_batch_header *batch = (void *) output_buffer->base;
-    assert(batch->num_packets < UINT16_MAX);
-    ++batch->num_packets;
-}
+// Ticks behind the server remote players are rendered at, set with
+// --interp-delay
+static u32 interp_delay = INTERP_DEFAULT_DELAY;
 
 //
 // Game
@@ -106,6 +92,13 @@ void client_handle_input(struct player *p, struct input *input) {
 
 static Vector2 old_window_size = {0};
 
+static int host_service(ENetHost *host, ENetEvent *event, u32 timeout) {
+    trace_begin("enet_host_service");
+    const int result = enet_host_service(host, event, timeout);
+    trace_end("enet_host_service");
+    return result;
+}
+
 static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buffer) {
     struct graph graph = graph_new(2*FPS);
 
@@ -116,25 +109,21 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
 
     f32 t = 0.0f;
 
-    u8 input_count = 0;
-    struct input input_buffer[INPUT_BUFFER_LENGTH] = {0};
-
     struct game game = {
         .map = map,
     };
 
-    HashMap(struct client_peer, MAX_CLIENTS) peer_map = {0};
-    PlayerId main_player_id;
-
-    i8 adjustment = 0;
-    u8 adjustment_iteration = 0;
-    i32 total_adjustment = 0;
-
     struct frame frame = {
         .desired_delta = NANOSECONDS(1) / (f32) FPS,
         .dt = 1.0f / (f32) FPS,
     };
 
+    static struct client_net net;
+    client_net_init(&net, &game, &frame);
+
+    // Server tick remote players are currently rendered at
+    f64 render_tick = 0.0;
+
     ENetEvent event = {0};
 
     bool mute = false;
@@ -144,9 +133,9 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
     while (running) {
         // Begin frame
         const u64 frame_start = time_current();
+        trace_begin_at("frame", frame_start);
 
         bool run_network_tick = frame.simulation_tick % NET_PER_SIM_TICKS == 0;
-        bool sleep_this_frame = true;
 
         // Collect frame debug data
         if (frame.simulation_tick % FPS == 0) {
@@ -158,172 +147,73 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
             frame_debug.outgoing_data_total_start = peer->outgoingDataTotal;
         }
 
-        if (adjustment > 0) {
-            // If we still have a positive adjustment, don't sleep this
-            // frame.
-            sleep_this_frame = false;
-            --adjustment;
-        }
         if (run_network_tick) {
+            trace_begin("network");
 
             // Fetch network data
-            while (enet_host_service(client, &event, 0) > 0) {
+            while (host_service(client, &event, 0) > 0) {
                 switch (event.type) {
                 case ENET_EVENT_TYPE_RECEIVE: {
-                    // Packet batch header
-                    struct byte_buffer net_input_buffer = byte_buffer_init(event.packet->data, event.packet->dataLength);
-                    struct server_batch_header *batch;
-                    POP(&net_input_buffer, &batch);
-
-                    if (batch->adjustment != 0 && adjustment_iteration == batch->adjustment_iteration) {
-                        printf("We have %d adjustment (%u)\n", batch->adjustment, adjustment_iteration);
-                        adjustment = batch->adjustment;
-                        total_adjustment += adjustment;
-
-                        ++adjustment_iteration;
-
-                        if (adjustment < 0) {
-                            // If we have a negative adjustment, we're ahead of the server and can deal
-                            // with this immediately by just sleeping for the amount we're ahead.
-                            time_nanosleep((-adjustment)*frame.desired_delta);
-                            adjustment = 0;
-                        } else if (adjustment > 0) {
-                            // If we have a positive adjustment we're behind, so
-                            // disable sleeping for this frame
-                            sleep_this_frame = false;
-                            --adjustment;
-                        }
-                    }
-
-                    for (u16 packet = 0; packet < batch->num_packets; ++packet) {
-                        struct server_header *header;
-                        POP(&net_input_buffer, &header);
+                    struct client_batch_reader reader = client_batch_begin(&net, event.packet->data, event.packet->dataLength);
+                    struct server_header *header;
+                    while ((header = client_batch_next(&reader, &net)) != NULL) {
+                        const char *packet_name = (header->type < ARRLEN(server_packet_names)) ? server_packet_names[header->type] : "unknown";
+                        trace_begin(packet_name);
 
                         // Packet payload
                         switch (header->type) {
                         case SERVER_PACKET_GREETING: {
-                            struct server_packet_greeting *greeting;
-                            POP(&net_input_buffer, &greeting);
-
-                            frame.network_tick = greeting->initial_net_tick + initial_server_net_tick_offset;
-                            frame.simulation_tick = frame.network_tick * NET_PER_SIM_TICKS;
-
-                            struct player *player = NULL;
-                            HashMapInsert(game.player_map, greeting->id, player);
-                            main_player_id = player->id;
-
-                            struct client_peer* peer = NULL;
-                            HashMapInsert(peer_map, greeting->id, peer);
-                            peer->id = player->id;
-
-                            connected = true;
+                            const struct server_packet_greeting *greeting = client_receive_greeting(&net, &reader);
+                            if (greeting->codec_version != CODEC_VERSION) {
+                                printf("Server uses codec version %u, expected %u\n", greeting->codec_version, CODEC_VERSION);
+                                running = false;
+                            }
                         } break;
 
                         case SERVER_PACKET_PEER_GREETING: {
-                            struct server_packet_peer_greeting *greeting;
-                            POP(&net_input_buffer, &greeting);
-
-                            struct player *player = NULL;
-                            HashMapInsert(game.player_map, greeting->id, player);
-
-                            struct client_peer *peer = NULL;
-                            HashMapInsert(peer_map, player->id, peer);
-                            peer->id = player->id;
+                            client_receive_peer_greeting(&net, &reader);
                         } break;
 
                         case SERVER_PACKET_PLAYER_SPAWN: {
-                            struct server_packet_player_spawn *spawn;
-                            POP(&net_input_buffer, &spawn);
-
-                            struct player *player = NULL;
-                            HashMapLookup(game.player_map, spawn->player.id, player);
-                            *player = spawn->player;
-                        } break;
-
-                        case SERVER_PACKET_NADE: {
-                            struct server_packet_nade *nade_packet;
-                            POP(&net_input_buffer, &nade_packet);
-                            // Skip nades we've already taken care of locally
-                            if (nade_packet->nade.player_id_from != main_player_id) {
-                                ListInsert(game.nade_list, nade_packet->nade);
-                            }
+                            client_receive_spawn(&net, &reader);
                         } break;
 
-                        case SERVER_PACKET_SOUND: {
-                            struct server_packet_sound *sound_packet;
-                            POP(&net_input_buffer, &sound_packet);
-                            // Skip nades we've already taken care of locally
-                            if (sound_packet->sound.player_id_from != main_player_id) {
-                                ListInsert(game.sound_list, sound_packet->sound);
-                            }
-                        } break;
-
-                        case SERVER_PACKET_STEP: {
-                            struct server_packet_step *step_packet;
-                            POP(&net_input_buffer, &step_packet);
-                            // Skip nades we've already taken care of locally
-                            if (step_packet->step.player_id_from != main_player_id) {
-                                ListInsert(game.step_list, step_packet->step);
-                            }
-                        } break;
-
-
+                        case SERVER_PACKET_NADE:
+                        case SERVER_PACKET_SOUND:
+                        case SERVER_PACKET_STEP:
                         case SERVER_PACKET_HITSCAN: {
-                            struct server_packet_hitscan *hitscan_packet;
-                            POP(&net_input_buffer, &hitscan_packet);
-                            // Skip hitscans we've already taken care of locally
-                            if (hitscan_packet->hitscan.player_id_from != main_player_id) {
-                                ListInsert(game.hitscan_list, hitscan_packet->hitscan);
-                            }
+                            client_receive_events(&net, &reader, header->type);
                         } break;
 
                         case SERVER_PACKET_AUTH: {
-                            struct server_packet_auth *auth;
-                            POP(&net_input_buffer, &auth);
-
-                            assert(auth->sim_tick <= frame.simulation_tick);
-                            u64 diff = frame.simulation_tick - auth->sim_tick - 1;
-                            assert(diff < INPUT_BUFFER_LENGTH);
-
-                            struct player *player = NULL;
-                            HashMapLookup(game.player_map, main_player_id, player);
-
-                            // Gets the input for the sim_tick after the sim_tick we recieved auth data for
-                            // NOTE(anjo): We might have to actually use older game states here, this could
-                            // cause WEIRD problems.
-                            struct game old_game = game;
-                            struct player old_player = auth->player;
-                            u8 old_index = (input_count + INPUT_BUFFER_LENGTH - diff) % INPUT_BUFFER_LENGTH;
-                            for (; old_index != input_count; old_index = (old_index + 1) % INPUT_BUFFER_LENGTH) {
-                                struct input *old_input = &input_buffer[old_index];
-                                update_player(&old_game, &old_player, old_input, frame.dt);
-                                collect_and_resolve_static_collisions_for_player(&old_game, &old_player);
-                            }
-
-                            if (!v2equal(player->pos, old_player.pos)) {
-                                printf("  Server disagreed! {%f, %f} vs {%f, %f}\n", player->pos.x, player->pos.y, old_player.pos.x, old_player.pos.y);
-                                *player = auth->player;
-                            }
+                            const struct client_auth auth = client_receive_auth(&net, &reader);
+                            if (auth.result == CLIENT_AUTH_REPLAYED && !v2equal(auth.old_pos, auth.new_pos))
+                                printf("  Server disagreed! {%f, %f} vs {%f, %f}\n", auth.old_pos.x, auth.old_pos.y, auth.new_pos.x, auth.new_pos.y);
                         } break;
 
                         case SERVER_PACKET_PEER_AUTH: {
-                            struct server_packet_peer_auth *peer_auth;
-                            POP(&net_input_buffer, &peer_auth);
-
-                            struct client_peer *peer = NULL;
-                            HashMapLookup(peer_map, peer_auth->player.id, peer);
+                            const struct client_peer_auth peer_auth = client_receive_peer_auth(&net, &reader);
+                            switch (peer_auth.result) {
+                            case CLIENT_PEER_AUTH_OK:
+                                interp_push(&peer_auth.peer->interp, &peer_auth.state, peer_auth.sim_tick);
+                                break;
+                            case CLIENT_PEER_AUTH_UNKNOWN_PLAYER:
+                                printf("PEER_AUTH for unknown player %lu\n", (u64) peer_auth.player_id);
+                                break;
+                            case CLIENT_PEER_AUTH_MISSING_BASELINE:
+                                printf("Missing baseline %lu for player %lu\n", peer_auth.baseline_tick, (u64) peer_auth.player_id);
+                                break;
+                            }
+                        } break;
 
-                            CIRCULAR_BUFFER_APPEND(&peer->auth_buffer, *peer_auth);
+                        case SERVER_PACKET_PEER_LEAVE: {
+                            client_receive_peer_leave(&net, &reader);
                         } break;
 
                         case SERVER_PACKET_PLAYER_KILL: {
-                            struct server_packet_player_kill *kill;
-                            POP(&net_input_buffer, &kill);
-
-                            struct player *p = NULL;
-                            HashMapLookup(game.player_map, kill->player_id, p);
-                            p->health = 0.0f;
-                            ListInsert(game.sound_list, ((struct spatial_sound){kill->player_id, SOUND_PLAYER_KILL, p->pos}));
+                            struct player *p = client_receive_kill(&net, &reader);
+                            if (p != NULL)
+                                CLIENT_EVENT_INSERT(&net, game.sound_list, ((struct spatial_sound){p->id, SOUND_PLAYER_KILL, p->pos}));
                         } break;
 
                         case SERVER_PACKET_DROPPED: {
@@ -331,18 +221,16 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
                         } break;
 
                         case SERVER_PACKET_PEER_DISCONNECTED: {
-                            struct server_packet_peer_disconnected *disc;
-                            POP(&net_input_buffer, &disc);
-
-                            printf("%d disconnected!\n", disc->player_id);
-                            HashMapRemove(game.player_map, disc->player_id);
-                            HashMapRemove(peer_map, disc->player_id);
+                            printf("%lu disconnected!\n", (u64) client_receive_peer_disconnected(&net, &reader));
                         } break;
 
                         default:
                             printf("Received unknown packet type %d\n", header->type);
                         }
+
+                        trace_end(packet_name);
                     }
+                    client_batch_end(&reader, &net);
                 } break;
 
                 case ENET_EVENT_TYPE_DISCONNECT:
@@ -362,47 +250,55 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
 
                 enet_packet_destroy(event.packet);
             }
+
+            trace_end("network");
         }
 
         //
-        // Loop over all peers, and apply auth data
+        // Loop over all peers, and apply interpolated auth data
         //
 
-        // active_tick is the tick we're applying peer data from,
-        // this is always less than the current simulation tick.
-        //u64 active_tick = frame.simulation_tick + 2*total_adjustment;
-        HashMapForEach(peer_map, struct client_peer, peer) {
-            if (!HashMapExists(peer_map, peer) || peer->id == main_player_id || peer->auth_buffer.used == 0)
+        trace_begin("interpolate");
+        {
+            // Only moves forward, so small corrections of the clock estimate
+            // don't make remote players jump back
+            const f64 target_tick = clock_server_tick(&net.clock, time_current(), frame.desired_delta) - interp_delay;
+            if (target_tick > render_tick)
+                render_tick = target_tick;
+        }
+        HashMapForEach(net.peer_map, struct client_peer, peer) {
+            if (peer->id == net.main_player_id || peer->interp.used == 0)
                 continue;
 
-            struct server_packet_peer_auth *entry = &peer->auth_buffer.data[peer->auth_buffer.bottom];
-            //printf("we should get here: %u %u\n", active_tick, entry->sim_tick);
-            //if (active_tick < entry->sim_tick)
-            //    continue;
+            // Without a clock estimate show the newest state
+            const f64 tick = (net.clock.num_samples > 0) ? render_tick : (f64) interp_at(&peer->interp, peer->interp.used - 1)->sim_tick;
 
             struct player *player = NULL;
             HashMapLookup(game.player_map, peer->id, player);
-            *player = entry->player;
-
-            CIRCULAR_BUFFER_POP(&peer->auth_buffer);
+            interp_sample(&peer->interp, tick, frame.dt, player);
         }
+        trace_end("interpolate");
 
         struct player *player = NULL;
-        if (main_player_id != HASH_MAP_INVALID_HASH)
-            HashMapLookup(game.player_map, main_player_id, player);
+        if (net.main_player_id != HASH_MAP_INVALID_HASH)
+            HashMapLookup(game.player_map, net.main_player_id, player);
 
         //
         // Handle input + append to circular buffer
         //
-        if (connected) {
+        trace_begin("predict");
+        if (net.connected) {
             assert(player != NULL);
 
-            struct input *input = &input_buffer[input_count];
-            input_count = (input_count + 1) % INPUT_BUFFER_LENGTH;
-            memset(input->active, INPUT_NULL, sizeof(input->active));
+            struct prediction_entry *prediction = client_prediction_begin(&net);
+            struct input *input = &prediction->input;
 
             client_handle_input(player, input);
 
+            // Predict using the same quantized input the server will see
+            struct packed_input packed_input = input_encode(input);
+            *input = input_decode(&packed_input);
+
             if (input->active[INPUT_MUTE])
                 mute = !mute;
 
@@ -424,23 +320,27 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
                 };
 
                 struct client_packet_update update = {
-                    .input = *input,
+                    .input = packed_input,
+                    .view_delay = (net.clock.num_samples > 0) ? interp_view_delay(frame.simulation_tick, render_tick) : 0,
                 };
 
-                new_packet(&output_buffer);
+                client_new_packet(&output_buffer);
                 APPEND(&output_buffer, &header);
                 APPEND(&output_buffer, &update);
 
                 // Predictive move
                 update_player(&game, player, input, frame.dt);
                 collect_and_resolve_static_collisions(&game);
+
+                client_prediction_end(prediction, player);
             }
         }
 
         update_projectiles(&game, frame.dt);
+        trace_end("predict");
 
         // Play queued sounds
-        if (connected) {
+        if (net.connected) {
             assert(player != NULL);
             if (!mute) {
                 ForEachList(game.sound_list, struct spatial_sound, spatial_sound) {
@@ -451,31 +351,24 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
         }
 
         if (run_network_tick) {
-            const size_t size = (intptr_t) output_buffer.top - (intptr_t) output_buffer.base;
-            if (size > sizeof(struct client_batch_header)) {
-                struct client_batch_header *batch = (void *) output_buffer.base;
-                batch->net_tick = frame.network_tick;
-                batch->adjustment_iteration = adjustment_iteration;
+            const size_t size = client_batch_finish(&net, &output_buffer);
+            if (size > 0) {
                 ENetPacket *packet = enet_packet_create(output_buffer.base, size, ENET_PACKET_FLAG_UNSEQUENCED);
                 enet_peer_send(peer, 0, packet);
-                output_buffer.top = output_buffer.base;
-
-                {
-                    struct client_batch_header batch = {0};
-                    APPEND(&output_buffer, &batch);
-                }
+                client_batch_reset(&output_buffer);
             }
         }
 
         // Render
+        trace_begin("render");
         BeginDrawing();
         ClearBackground(BLACK);
-        if (connected) {
+        if (net.connected) {
             assert(player != NULL);
 
             camera.offset = (v2) {GetRenderWidth()/2, GetRenderHeight()/2};
             camera.target = player->pos;
-            draw_game(camera, &game, main_player_id, frame.dt, t);
+            draw_game(camera, &game, net.main_player_id, frame.dt, t);
 
             DrawText("client", 10, 10, 20, BLACK);
 
@@ -484,7 +377,9 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
             DrawText(TextFormat("ping: %u", peer->roundTripTime), 10, y, 20, GRAY); y += 20;
             DrawText(TextFormat("in  bandwidth: %u bytes/s", frame_debug.incoming_bandwidth), 10, y, 20, GRAY); y += 20;
             DrawText(TextFormat("out bandwidth: %u bytes/s", frame_debug.outgoing_bandwidth), 10, y, 20, GRAY); y += 20;
-            DrawText(TextFormat("total adjustment: %d", total_adjustment), 10, y, 20, GRAY); y += 20;
+            DrawText(TextFormat("clock offset: %.2f ms", net.clock.offset/1e6), 10, y, 20, GRAY); y += 20;
+            DrawText(TextFormat("clock rtt: %.2f ms, jitter: %.2f ms", net.clock.rtt/1e6, net.clock.jitter/1e6), 10, y, 20, GRAY); y += 20;
+            DrawText(TextFormat("lead error: %.2f ticks", clock_lead_error(&net.clock, time_current(), frame.simulation_tick, frame.desired_delta)), 10, y, 20, GRAY); y += 20;
 
             //graph_append(&graph, v2len(player->velocity));
             draw_all_debug_v2s(camera);
@@ -494,14 +389,19 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
             //           (v2) {10, 10});
         }
         EndDrawing();
+        trace_end("render");
 
-        // End frame
-        if (sleep_this_frame) {
-            // Only sleep remaining frame time if we aren't fast forwarding
+        // End frame, paced to stay the target lead ahead of the server.
+        // When far behind this is 0 and we fast forward.
+        {
+            const f64 lead_error = clock_lead_error(&net.clock, time_current(), frame.simulation_tick, frame.desired_delta);
+            const u64 frame_delta = clock_frame_delta(lead_error, frame.desired_delta);
             const u64 frame_end = time_current();
             frame.delta = frame_end - frame_start;
-            if (frame.delta < frame.desired_delta) {
-                time_nanosleep(frame.desired_delta - frame.delta);
+            if (frame.delta < frame_delta) {
+                trace_begin("sleep");
+                time_nanosleep(frame_delta - frame.delta);
+                trace_end("sleep");
             }
 
             // Collect frame debug data
@@ -513,12 +413,16 @@ static void game(ENetHost *client, ENetPeer *peer, struct byte_buffer output_buf
             }
         }
 
+        trace_end("frame");
+
         if (run_network_tick)
             ++frame.network_tick;
         ++frame.simulation_tick;
         t += frame.dt;
     }
 
+    HashMapFree(game.player_map);
+    client_net_free(&net);
     graph_free(&graph);
 }
 
@@ -550,12 +454,31 @@ int main(int argc, char **argv) {
 
     // If we have a first argument, assume it's an ip
     // and connect to it, skipping the intial input
-    // menu state.
+    // menu state. The optional second argument is the
+    // match to join on servers running multiple matches.
+    // --trace PATH and --interp-delay TICKS can be
+    // given anywhere.
+    u32 match = 0;
 #if !defined(_WIN32)
-    if (argc > 1) {
-        strncpy(input, argv[1], ARRLEN(input));
+    const char *args[2] = {0};
+    u32 num_args = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            if (!trace_open(argv[++i]))
+                fprintf(stderr, "Failed to open %s for tracing.\n", argv[i]);
+        } else if (strcmp(argv[i], "--interp-delay") == 0 && i+1 < argc) {
+            interp_delay = (u32) atoi(argv[++i]);
+        } else if (num_args < ARRLEN(args)) {
+            args[num_args++] = argv[i];
+        }
+    }
+    if (num_args > 0) {
+        strncpy(input, args[0], ARRLEN(input));
         menu_state = CONNECTING;
     }
+    if (num_args > 1)
+        match = (u32) atoi(args[1]);
+    trace_thread_name("main");
 #endif
 
     // Net stuff
@@ -634,7 +557,7 @@ int main(int argc, char **argv) {
             EndDrawing();
 
             enet_address_set_host(&address, input);
-            peer = enet_host_connect(client, &address, 2, 0);
+            peer = enet_host_connect(client, &address, 2, match);
             if (peer == NULL) {
                 fprintf(stderr, "No available peers for initiating an ENet connection.\n");
                 exit(EXIT_FAILURE);
@@ -695,6 +618,7 @@ int main(int argc, char **argv) {
 
     enet_host_destroy(client);
     enet_deinitialize();
+    trace_close();
 
     audio_deinit();
     draw_deinit();
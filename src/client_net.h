@@ -0,0 +1,533 @@
+#pragma once
+
+#include "common.h"
+#include "game.h"
+#include "packet.h"
+#include "clock.h"
+#include "interp.h"
+
+//
+// Client side of the protocol
+//
+// Shared by the client and the stress bots, so the bots load the server
+// exactly like real clients do. Covers decoding server batches, keeping
+// track of the main player and the other peers, acknowledgements, clock
+// sync, and reconciling predictions with AUTH packets. What to do with
+// the decoded state (rendering, sounds, stats) is up to the caller.
+//
+// A batch is decoded with
+//
+//   struct client_batch_reader r = client_batch_begin(c, data, size);
+//   struct server_header *header;
+//   while ((header = client_batch_next(&r, c)) != NULL) {
+//       switch (header->type) {
+//       ... client_receive_* for each packet type ...
+//       }
+//   }
+//   client_batch_end(&r, c);
+//
+
+#define INPUT_BUFFER_LENGTH 512
+#define SNAPSHOT_HISTORY 64
+
+// Net ticks we start ahead of the server's initial tick, before clock sync
+// takes over
+#define INITIAL_SERVER_NET_TICK_OFFSET 5
+
+// Player states received per server net_tick, used as baselines for
+// delta encoded PEER_AUTH packets.
+struct client_snapshot {
+    u64 net_tick;
+    bool valid;
+    struct player_fields fields;
+};
+
+struct client_peer {
+    PlayerId id;
+    struct interp_buffer interp;
+    struct client_snapshot snapshots[SNAPSHOT_HISTORY];
+};
+
+// What we predicted for the main player on a given sim tick, along with
+// the input that produced it and when. Only the fields needed to decide
+// whether the server agreed with us are kept, the full player state is
+// only rebuilt (from AUTH data) when we need to resimulate.
+struct prediction_entry {
+    u64 sim_tick;
+    bool predicted;
+    u64 time;
+    struct input input;
+    v2 pos;
+    v2 velocity;
+    enum player_state state;
+};
+
+struct client_net {
+    struct game *game;
+    struct frame *frame;
+
+    HashMap(struct client_peer) peer_map;
+    PlayerId main_player_id;
+    // Set once the server has greeted us
+    bool connected;
+
+    // Server net ticks we've received batches for, sent back to the server
+    // so it knows which baselines it can delta encode against.
+    struct batch_acks acks;
+
+    // Estimate of the server clock, used to pace frames so our input
+    // arrives just ahead of the server tick it's for.
+    struct clock_sync clock;
+
+    // Indexed by sim_tick % INPUT_BUFFER_LENGTH
+    struct prediction_entry predictions[INPUT_BUFFER_LENGTH];
+
+    // Events received while their list in game was full
+    u64 num_events_dropped;
+
+    // Scratch game used when replaying inputs during reconciliation. Only
+    // the map is used, lists are cleared before every replayed tick so any
+    // projectiles, sounds or steps produced by the replay are thrown away.
+    struct game rollback_game;
+};
+
+static inline void client_net_init(struct client_net *c, struct game *game, struct frame *frame) {
+    memset(c, 0, sizeof(*c));
+    c->game = game;
+    c->frame = frame;
+    c->main_player_id = HASH_MAP_INVALID_HASH;
+    c->rollback_game.map = game->map;
+}
+
+static inline void client_net_free(struct client_net *c) {
+    HashMapFree(c->peer_map);
+}
+
+//
+// Outgoing batches
+//
+
+static inline void client_new_packet(struct byte_buffer *output_buffer) {
+    struct client_batch_header *batch = (void *) output_buffer->base;
+    assert(batch->num_packets < UINT16_MAX);
+    ++batch->num_packets;
+}
+
+// Fills in the batch header, returns the size of the batch or 0 if there
+// is nothing to send. The buffer is reset with client_batch_reset once
+// it's sent.
+static inline size_t client_batch_finish(struct client_net *c, struct byte_buffer *output_buffer) {
+    const size_t size = (intptr_t) output_buffer->top - (intptr_t) output_buffer->base;
+    if (size <= sizeof(struct client_batch_header))
+        return 0;
+
+    struct client_batch_header *batch = (void *) output_buffer->base;
+    batch->codec_version = CODEC_VERSION;
+    batch->net_tick = c->frame->network_tick;
+    batch->ack_net_tick = c->acks.ack_net_tick;
+    batch->ack_bits = c->acks.ack_bits;
+    batch->client_time = time_current();
+    return size;
+}
+
+static inline void client_batch_reset(struct byte_buffer *output_buffer) {
+    output_buffer->top = output_buffer->base;
+    APPEND(output_buffer, &(struct client_batch_header){0});
+}
+
+//
+// Prediction
+//
+
+static inline void prediction_store(struct prediction_entry *entry, struct player *p) {
+    entry->pos = p->pos;
+    entry->velocity = p->velocity;
+    entry->state = p->state;
+}
+
+static inline bool prediction_matches(struct prediction_entry *entry, struct player *p) {
+    return v2equal(entry->pos, p->pos) &&
+           v2equal(entry->velocity, p->velocity) &&
+           entry->state == p->state;
+}
+
+static inline void rollback_game_clear(struct game *g) {
+    ListClear(g->hitscan_list);
+    ListClear(g->nade_list);
+    ListClear(g->damage_list);
+    ListClear(g->explosion_list);
+    ListClear(g->sound_list);
+    ListClear(g->step_list);
+    ListClear(g->new_hitscan_list);
+    ListClear(g->new_nade_list);
+}
+
+// Entry for the current tick, with input cleared and not yet predicted
+static inline struct prediction_entry *client_prediction_begin(struct client_net *c) {
+    struct prediction_entry *prediction = &c->predictions[c->frame->simulation_tick % INPUT_BUFFER_LENGTH];
+    prediction->sim_tick = c->frame->simulation_tick;
+    prediction->predicted = false;
+    memset(prediction->input.active, INPUT_NULL, sizeof(prediction->input.active));
+    return prediction;
+}
+
+// Call after the main player has been moved with prediction->input
+static inline void client_prediction_end(struct prediction_entry *prediction, struct player *p) {
+    prediction->predicted = true;
+    prediction->time = time_current();
+    prediction_store(prediction, p);
+}
+
+//
+// Incoming batches
+//
+
+struct client_batch_reader {
+    struct byte_buffer buffer;
+    struct server_batch_header *batch;
+    // Filters for broadcast batches are stored after the last packet
+    struct server_broadcast_filter *filters;
+    u16 filter_index;
+    u16 packet_index;
+    // Only acknowledge batches where we've been able to decode all player
+    // states, otherwise the server could use them as baselines.
+    bool ack;
+};
+
+static inline struct client_batch_reader client_batch_begin(struct client_net *c, u8 *data, size_t size) {
+    struct client_batch_reader r = {
+        .buffer = byte_buffer_init(data, size),
+    };
+    POP(&r.buffer, &r.batch);
+    r.ack = !(r.batch->flags & SERVER_BATCH_FLAG_BROADCAST);
+
+    if (r.ack)
+        clock_sync_sample(&c->clock, r.batch->client_time, r.batch->receive_time, r.batch->server_time, time_current(), r.batch->sim_tick);
+
+    const size_t filters_size = r.batch->num_filters*sizeof(struct server_broadcast_filter);
+    r.filters = (void *) (data + size - filters_size);
+    return r;
+}
+
+// Header of the next packet, skipping packets the server has filtered out
+// for us, or NULL after the last one. The payload is popped by the
+// client_receive_* functions, or by the caller.
+static inline struct server_header *client_batch_next(struct client_batch_reader *r, const struct client_net *c) {
+    while (r->packet_index < r->batch->num_packets) {
+        const u16 packet = r->packet_index++;
+        struct server_header *header;
+        POP(&r->buffer, &header);
+
+        if (r->filter_index < r->batch->num_filters && r->filters[r->filter_index].packet_index == packet) {
+            const bool filtered = r->filters[r->filter_index].player_id == c->main_player_id;
+            ++r->filter_index;
+            if (filtered) {
+                r->buffer.top += server_packet_payload_size[header->type];
+                continue;
+            }
+        }
+        return header;
+    }
+    return NULL;
+}
+
+static inline void client_batch_end(struct client_batch_reader *r, struct client_net *c) {
+    if (r->ack)
+        batch_acks_receive(&c->acks, r->batch);
+}
+
+// Peers connecting on the same server tick greet each other in the
+// broadcast batch, which can arrive before or after our own batch with
+// our GREETING. Until then it isn't filtered for us, so we may be greeted
+// about ourselves or about a player we already know.
+static inline void client_add_player(struct client_net *c, PlayerId id) {
+    struct player *player = NULL;
+    HashMapLookup(c->game->player_map, id, player);
+    if (player == NULL)
+        HashMapInsert(c->game->player_map, id, player);
+
+    struct client_peer *peer = NULL;
+    HashMapLookup(c->peer_map, id, peer);
+    if (peer == NULL) {
+        HashMapInsert(c->peer_map, id, peer);
+        peer->id = id;
+    }
+}
+
+// Nothing is set up if the server speaks a different codec, check
+// codec_version of the returned greeting
+static inline const struct server_packet_greeting *client_receive_greeting(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_greeting *greeting;
+    POP(&r->buffer, &greeting);
+
+    if (greeting->codec_version != CODEC_VERSION)
+        return greeting;
+
+    c->frame->network_tick = greeting->initial_net_tick + INITIAL_SERVER_NET_TICK_OFFSET;
+    c->frame->simulation_tick = c->frame->network_tick * NET_PER_SIM_TICKS;
+
+    client_add_player(c, greeting->id);
+    c->main_player_id = greeting->id;
+    c->connected = true;
+    return greeting;
+}
+
+static inline void client_receive_peer_greeting(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_peer_greeting *greeting;
+    POP(&r->buffer, &greeting);
+
+    client_add_player(c, greeting->id);
+}
+
+static inline void client_receive_spawn(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_player_spawn *spawn;
+    POP(&r->buffer, &spawn);
+
+    const struct player spawn_player = player_decode(&c->game->map, &spawn->player);
+
+    struct player *player = NULL;
+    HashMapLookup(c->game->player_map, spawn_player.id, player);
+    if (player != NULL)
+        *player = spawn_player;
+}
+
+// Inserts value unless list is full, in which case it's dropped and counted
+#define CLIENT_EVENT_INSERT(c, list, value)     \
+    do {                                        \
+        if (ListFull(list))                     \
+            ++(c)->num_events_dropped;          \
+        else                                    \
+            ListInsert(list, value);            \
+    } while (0)
+
+// Event batches, events caused by the main player were already predicted
+// locally and are skipped. Events that don't fit in the game's lists, say
+// steps of a full match over their lifetime, are dropped.
+static inline void client_receive_events(struct client_net *c, struct client_batch_reader *r, enum server_packet_type type) {
+    struct server_packet_events *events;
+    POP(&r->buffer, &events);
+
+    struct game *g = c->game;
+    const PlayerId self = c->main_player_id;
+    switch (type) {
+    case SERVER_PACKET_NADE: {
+        struct server_packet_nade *nades;
+        POP_ARRAY(&r->buffer, &nades, events->count);
+        for (u16 i = 0; i < events->count; ++i) {
+            if (nades[i].nade.player_id_from != self)
+                CLIENT_EVENT_INSERT(c, g->nade_list, nades[i].nade);
+        }
+    } break;
+
+    case SERVER_PACKET_HITSCAN: {
+        struct server_packet_hitscan *hitscans;
+        POP_ARRAY(&r->buffer, &hitscans, events->count);
+        for (u16 i = 0; i < events->count; ++i) {
+            if (hitscans[i].hitscan.player_id_from != self)
+                CLIENT_EVENT_INSERT(c, g->hitscan_list, hitscans[i].hitscan);
+        }
+    } break;
+
+    case SERVER_PACKET_SOUND: {
+        struct server_packet_sound *sounds;
+        POP_ARRAY(&r->buffer, &sounds, events->count);
+        for (u16 i = 0; i < events->count; ++i) {
+            if (sounds[i].sound.player_id_from != self)
+                CLIENT_EVENT_INSERT(c, g->sound_list, sounds[i].sound);
+        }
+    } break;
+
+    case SERVER_PACKET_STEP: {
+        struct server_packet_step *steps;
+        POP_ARRAY(&r->buffer, &steps, events->count);
+        for (u16 i = 0; i < events->count; ++i) {
+            if (steps[i].step.player_id_from != self)
+                CLIENT_EVENT_INSERT(c, g->step_list, steps[i].step);
+        }
+    } break;
+
+    default:
+        assert(false);
+    }
+}
+
+enum client_auth_result {
+    // Too old or from the future, nothing to compare it with
+    CLIENT_AUTH_IGNORED = 0,
+    // The server ended up where we predicted
+    CLIENT_AUTH_MATCHED,
+    // Inputs since the AUTH tick were replayed on top of the server state
+    CLIENT_AUTH_REPLAYED,
+};
+
+struct client_auth {
+    enum client_auth_result result;
+    // Set if we had predicted the AUTH tick, along with when we did it
+    bool predicted;
+    u64 predicted_time;
+    // Main player before and after replaying, only set if replayed
+    v2 old_pos;
+    v2 new_pos;
+};
+
+static inline struct client_auth client_receive_auth(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_auth *auth;
+    POP(&r->buffer, &auth);
+
+    struct client_auth res = {0};
+    const u64 sim_tick = c->frame->simulation_tick;
+    if (auth->sim_tick > sim_tick || sim_tick - auth->sim_tick >= INPUT_BUFFER_LENGTH)
+        return res;
+
+    struct player *player = NULL;
+    HashMapLookup(c->game->player_map, c->main_player_id, player);
+    if (player == NULL)
+        return res;
+
+    const struct player auth_player = player_decode(&c->game->map, &auth->player);
+
+    // If the server ended up where we predicted for this tick, there is
+    // nothing to correct.
+    struct prediction_entry *auth_entry = &c->predictions[auth->sim_tick % INPUT_BUFFER_LENGTH];
+    res.predicted = auth_entry->predicted && auth_entry->sim_tick == auth->sim_tick;
+    res.predicted_time = auth_entry->time;
+    if (res.predicted && prediction_matches(auth_entry, (struct player *) &auth_player)) {
+        res.result = CLIENT_AUTH_MATCHED;
+        return res;
+    }
+
+    // Otherwise replay the inputs we've predicted since the AUTH tick on
+    // top of the server state.
+    struct player replayed_player = auth_player;
+    prediction_store(auth_entry, &replayed_player);
+    for (u64 tick = auth->sim_tick + 1; tick < sim_tick; ++tick) {
+        struct prediction_entry *entry = &c->predictions[tick % INPUT_BUFFER_LENGTH];
+        if (!entry->predicted || entry->sim_tick != tick)
+            continue;
+        rollback_game_clear(&c->rollback_game);
+        update_player(&c->rollback_game, &replayed_player, &entry->input, c->frame->dt);
+        collect_and_resolve_static_collisions_for_player(&c->rollback_game, &replayed_player);
+        prediction_store(entry, &replayed_player);
+    }
+
+    res.result = CLIENT_AUTH_REPLAYED;
+    res.old_pos = player->pos;
+    res.new_pos = replayed_player.pos;
+    if (!v2equal(player->pos, replayed_player.pos))
+        *player = replayed_player;
+    return res;
+}
+
+enum client_peer_auth_result {
+    CLIENT_PEER_AUTH_OK = 0,
+    CLIENT_PEER_AUTH_UNKNOWN_PLAYER,
+    CLIENT_PEER_AUTH_MISSING_BASELINE,
+};
+
+struct client_peer_auth {
+    enum client_peer_auth_result result;
+    PlayerId player_id;
+    // Server sim_tick the state is from, only set if OK
+    u64 sim_tick;
+    // Server net_tick of the baseline we didn't have, only set if
+    // MISSING_BASELINE
+    u64 baseline_tick;
+    struct client_peer *peer;
+    struct player state;
+};
+
+// Decodes a delta encoded player state against its baseline and stores it
+// as a baseline for later states, the caller decides whether to
+// interpolate or apply it. Failures keep the batch from being acknowledged.
+static inline struct client_peer_auth client_receive_peer_auth(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_peer_auth *peer_auth;
+    POP(&r->buffer, &peer_auth);
+
+    u8 *delta = r->buffer.top;
+    r->buffer.top += peer_auth->size;
+
+    const u64 net_tick = r->batch->net_tick;
+    struct client_peer_auth res = {
+        .player_id = peer_auth->player_id,
+    };
+
+    struct client_peer *peer = NULL;
+    HashMapLookup(c->peer_map, peer_auth->player_id, peer);
+    if (peer == NULL) {
+        r->ack = false;
+        res.result = CLIENT_PEER_AUTH_UNKNOWN_PLAYER;
+        return res;
+    }
+
+    const struct player_fields *baseline = NULL;
+    if (peer_auth->baseline_age > 0) {
+        const u64 baseline_tick = net_tick - peer_auth->baseline_age;
+        struct client_snapshot *snapshot = &peer->snapshots[baseline_tick % SNAPSHOT_HISTORY];
+        if (!snapshot->valid || snapshot->net_tick != baseline_tick) {
+            r->ack = false;
+            res.result = CLIENT_PEER_AUTH_MISSING_BASELINE;
+            res.baseline_tick = baseline_tick;
+            return res;
+        }
+        baseline = &snapshot->fields;
+    }
+
+    struct client_snapshot *snapshot = &peer->snapshots[net_tick % SNAPSHOT_HISTORY];
+    snapshot->fields = player_read_delta(delta, peer_auth->size, baseline, peer_auth->player_id);
+    snapshot->net_tick = net_tick;
+    snapshot->valid = true;
+
+    res.result = CLIENT_PEER_AUTH_OK;
+    res.sim_tick = peer_auth->sim_tick;
+    res.peer = peer;
+    res.state = player_dequantize(&c->game->map, &snapshot->fields);
+    return res;
+}
+
+// Hides the player until it's back in our area of interest and we get a
+// new PEER_AUTH
+static inline void client_receive_peer_leave(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_peer_leave *leave;
+    POP(&r->buffer, &leave);
+
+    struct client_peer *peer = NULL;
+    HashMapLookup(c->peer_map, leave->player_id, peer);
+    if (peer != NULL)
+        interp_clear(&peer->interp);
+
+    struct player *p = NULL;
+    HashMapLookup(c->game->player_map, leave->player_id, p);
+    if (p != NULL)
+        p->health = 0.0f;
+}
+
+// Returns the killed player, or NULL if we don't know it
+static inline struct player *client_receive_kill(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_player_kill *kill;
+    POP(&r->buffer, &kill);
+
+    struct player *p = NULL;
+    HashMapLookup(c->game->player_map, kill->player_id, p);
+    if (p != NULL)
+        p->health = 0.0f;
+    return p;
+}
+
+// Returns the id of the player that disconnected
+static inline PlayerId client_receive_peer_disconnected(struct client_net *c, struct client_batch_reader *r) {
+    struct server_packet_peer_disconnected *disc;
+    POP(&r->buffer, &disc);
+
+    // Players that disconnect on the server tick we connect are never
+    // greeted to us
+    struct player *p = NULL;
+    HashMapLookup(c->game->player_map, disc->player_id, p);
+    if (p != NULL)
+        HashMapRemove(c->game->player_map, disc->player_id);
+
+    struct client_peer *peer = NULL;
+    HashMapLookup(c->peer_map, disc->player_id, peer);
+    if (peer != NULL)
+        HashMapRemove(c->peer_map, disc->player_id);
+    return disc->player_id;
+}
@@ -0,0 +1,548 @@
+#define ENET_IMPLEMENTATION
+#include "enet.h"
+
+#include "packet.h"
+#include "common.h"
+#include "random.h"
+#include "game.h"
+#include "clock.h"
+#include "interp.h"
+#include "client_net.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <math.h>
+#include <signal.h>
+
+//
+// Headless bot client used to load test a server, see stress.sh.
+//
+// Decodes server batches and predicts/reconciles the main player with the
+// same code as the real client (client_net.h), but replaces keyboard and
+// mouse with a scripted behavior picked from the bot index: wandering,
+// dodging, sniping or nade spam. Once per second a row of metrics is
+// appended to a CSV file, one file per bot.
+//
+
+#define OUTPUT_BUFFER_SIZE 2048
+#define DEFAULT_DURATION 60
+
+static volatile sig_atomic_t running = true;
+
+static void handle_signal(int sig) {
+    (void) sig;
+    running = false;
+}
+
+//
+// Metrics
+//
+
+// Counters for the current one second interval, reset after each CSV row
+struct bot_stats {
+    u64 num_auths;
+    u64 num_mispredictions;
+    u64 num_dropped;
+    u64 num_missing_baselines;
+    // Frames where the lead error was large enough to step the clock
+    u64 num_clock_steps;
+
+    // Time from predicting a tick to receiving the AUTH for it
+    u64 auth_latency_sum;
+    u64 auth_latency_max;
+
+    u32 incoming_data_total_start;
+    u32 outgoing_data_total_start;
+    u64 events_dropped_start;
+};
+
+static void csv_write_header(FILE *csv) {
+    fprintf(csv, "time,bot,behavior,rtt_ms,auth_latency_mean_ms,auth_latency_max_ms,auths,mispredictions,"
+                 "dropped,missing_baselines,events_dropped,clock_steps,clock_rtt_ms,clock_jitter_ms,lead_error_ticks,"
+                 "in_bytes,out_bytes,visible_peers\n");
+}
+
+//
+// Bot behaviors
+//
+
+enum bot_behavior {
+    BOT_WANDER = 0,
+    BOT_DODGE,
+    BOT_SNIPE,
+    BOT_NADE_SPAM,
+    BOT_LAST,
+};
+
+static const char *bot_behavior_names[BOT_LAST] = {
+    [BOT_WANDER]    = "wander",
+    [BOT_DODGE]     = "dodge",
+    [BOT_SNIPE]     = "snipe",
+    [BOT_NADE_SPAM] = "nade_spam",
+};
+
+struct bot {
+    u32 index;
+    enum bot_behavior behavior;
+    struct random_series_pcg random;
+
+    // Movement direction in {-1,0,1}, picked again when time_to_turn
+    // runs out
+    i32 dx;
+    i32 dy;
+    f32 time_to_turn;
+
+    // Time until the next dodge or untargeted shot
+    f32 time_to_act;
+
+    // Nade spam holds the trigger to charge the throw
+    bool holding;
+    f32 time_left_holding;
+};
+
+static inline f32 random_range(struct random_series_pcg *random, f32 min, f32 max) {
+    return min + (max - min)*random_next_unilateral(random);
+}
+
+static void bot_turn(struct bot *bot) {
+    // Snipers stand still half of the time
+    if (bot->behavior == BOT_SNIPE && random_next_u32(&bot->random) % 2 == 0) {
+        bot->dx = 0;
+        bot->dy = 0;
+        bot->time_to_turn = random_range(&bot->random, 1.0f, 3.0f);
+        return;
+    }
+
+    do {
+        bot->dx = (i32) (random_next_u32(&bot->random) % 3) - 1;
+        bot->dy = (i32) (random_next_u32(&bot->random) % 3) - 1;
+    } while (bot->dx == 0 && bot->dy == 0);
+
+    bot->time_to_turn = (bot->behavior == BOT_DODGE) ? random_range(&bot->random, 0.2f, 0.8f)
+                                                     : random_range(&bot->random, 0.5f, 2.0f);
+}
+
+// Closest other player we've got a state for, or NULL
+static struct player *bot_find_target(struct game *game, struct player *self) {
+    struct player *target = NULL;
+    f32 target_dist2 = INFINITY;
+    HashMapForEach(game->player_map, struct player, p) {
+        if (p->id == self->id || p->health <= 0.0f)
+            continue;
+        const f32 dist2 = v2len2(v2sub(p->pos, self->pos));
+        if (dist2 < target_dist2) {
+            target = p;
+            target_dist2 = dist2;
+        }
+    }
+    return target;
+}
+
+static inline void bot_select_weapon(struct player *p, struct input *input, enum player_weapon weapon) {
+    if (p->weapons[p->current_weapon] != weapon)
+        input->active[INPUT_SWITCH_WEAPON] = true;
+}
+
+static void bot_handle_input(struct bot *bot, struct game *game, struct player *p, struct input *input, f32 dt) {
+    bot->time_to_turn -= dt;
+    if (bot->time_to_turn <= 0.0f)
+        bot_turn(bot);
+
+    if (bot->dx < 0) input->active[INPUT_MOVE_LEFT]  = true;
+    if (bot->dx > 0) input->active[INPUT_MOVE_RIGHT] = true;
+    if (bot->dy < 0) input->active[INPUT_MOVE_UP]    = true;
+    if (bot->dy > 0) input->active[INPUT_MOVE_DOWN]  = true;
+
+    struct player *target = bot_find_target(game, p);
+    if (target != NULL)
+        input->look = v2sub(target->pos, p->pos);
+    else
+        input->look = (v2) {(f32) bot->dx, (f32) bot->dy};
+
+    bot->time_to_act -= dt;
+
+    switch (bot->behavior) {
+    case BOT_WANDER:
+        break;
+
+    case BOT_DODGE:
+        // Dodge in the direction we're looking as soon as we're allowed to
+        if (bot->time_to_act <= 0.0f && p->time_left_in_dodge_delay <= 0.0f) {
+            input->active[INPUT_MOVE_DODGE] = true;
+            bot->time_to_act = random_range(&bot->random, 0.2f, 1.0f);
+        }
+        break;
+
+    case BOT_SNIPE: {
+        bot_select_weapon(p, input, PLAYER_WEAPON_SNIPER);
+        const bool can_fire = p->time_left_in_weapon_cooldown[p->current_weapon] <= 0.0f;
+        if (target != NULL) {
+            input->active[INPUT_ZOOM] = true;
+            if (can_fire)
+                input->active[INPUT_SHOOT_PRESSED] = true;
+        } else if (can_fire && bot->time_to_act <= 0.0f) {
+            input->active[INPUT_SHOOT_PRESSED] = true;
+            bot->time_to_act = random_range(&bot->random, 1.0f, 3.0f);
+        }
+    } break;
+
+    case BOT_NADE_SPAM: {
+        bot_select_weapon(p, input, PLAYER_WEAPON_NADE);
+        const bool can_fire = p->time_left_in_weapon_cooldown[p->current_weapon] <= 0.0f;
+        if (bot->holding) {
+            bot->time_left_holding -= dt;
+            if (bot->time_left_holding <= 0.0f) {
+                input->active[INPUT_SHOOT_RELEASED] = true;
+                bot->holding = false;
+            } else {
+                input->active[INPUT_SHOOT_HELD] = true;
+            }
+        } else if (can_fire && p->weapons[p->current_weapon] == PLAYER_WEAPON_NADE) {
+            input->active[INPUT_SHOOT_PRESSED] = true;
+            input->active[INPUT_SHOOT_HELD] = true;
+            bot->holding = true;
+            bot->time_left_holding = random_range(&bot->random, 0.1f, 0.5f);
+        }
+    } break;
+
+    default:
+        assert(0);
+    }
+
+    if (v2iszero(input->look)) {
+        input->look.x = 1;
+        input->look.y = 0;
+    }
+}
+
+//
+// Game
+//
+
+static void game(ENetHost *client, ENetPeer *peer, struct bot *bot, FILE *csv, u64 duration) {
+    struct game game = {
+        .map = map,
+    };
+
+    struct frame frame = {
+        .desired_delta = NANOSECONDS(1) / (f32) FPS,
+        .dt = 1.0f / (f32) FPS,
+    };
+
+    static struct client_net net;
+    client_net_init(&net, &game, &frame);
+
+    struct byte_buffer output_buffer = byte_buffer_alloc(OUTPUT_BUFFER_SIZE);
+    APPEND(&output_buffer, &(struct client_batch_header){0});
+
+    struct bot_stats stats = {0};
+    const u64 start = time_current();
+    u64 next_report = start + NANOSECONDS(1);
+
+    ENetEvent event = {0};
+
+    while (running && time_current() - start < duration) {
+        const u64 frame_start = time_current();
+
+        bool run_network_tick = frame.simulation_tick % NET_PER_SIM_TICKS == 0;
+
+        if (run_network_tick) {
+            while (enet_host_service(client, &event, 0) > 0) {
+                switch (event.type) {
+                case ENET_EVENT_TYPE_RECEIVE: {
+                    struct client_batch_reader reader = client_batch_begin(&net, event.packet->data, event.packet->dataLength);
+                    struct server_header *header;
+                    while ((header = client_batch_next(&reader, &net)) != NULL) {
+                        switch (header->type) {
+                        case SERVER_PACKET_GREETING: {
+                            const struct server_packet_greeting *greeting = client_receive_greeting(&net, &reader);
+                            if (greeting->codec_version != CODEC_VERSION) {
+                                printf("bot %u: server uses codec version %u, expected %u\n", bot->index, greeting->codec_version, CODEC_VERSION);
+                                running = false;
+                            }
+                        } break;
+
+                        case SERVER_PACKET_PEER_GREETING: {
+                            client_receive_peer_greeting(&net, &reader);
+                        } break;
+
+                        case SERVER_PACKET_PLAYER_SPAWN: {
+                            client_receive_spawn(&net, &reader);
+                        } break;
+
+                        case SERVER_PACKET_NADE:
+                        case SERVER_PACKET_SOUND:
+                        case SERVER_PACKET_STEP:
+                        case SERVER_PACKET_HITSCAN: {
+                            client_receive_events(&net, &reader, header->type);
+                        } break;
+
+                        case SERVER_PACKET_AUTH: {
+                            const struct client_auth auth = client_receive_auth(&net, &reader);
+                            if (auth.result == CLIENT_AUTH_IGNORED || !auth.predicted)
+                                break;
+
+                            const u64 latency = time_current() - auth.predicted_time;
+                            stats.auth_latency_sum += latency;
+                            if (latency > stats.auth_latency_max)
+                                stats.auth_latency_max = latency;
+                            ++stats.num_auths;
+                            if (auth.result == CLIENT_AUTH_REPLAYED)
+                                ++stats.num_mispredictions;
+                        } break;
+
+                        case SERVER_PACKET_PEER_AUTH: {
+                            const struct client_peer_auth peer_auth = client_receive_peer_auth(&net, &reader);
+                            if (peer_auth.result == CLIENT_PEER_AUTH_MISSING_BASELINE)
+                                ++stats.num_missing_baselines;
+
+                            // No interpolation, peers are only used as targets
+                            if (peer_auth.result != CLIENT_PEER_AUTH_OK || peer_auth.player_id == net.main_player_id)
+                                break;
+                            struct player *player = NULL;
+                            HashMapLookup(game.player_map, peer_auth.player_id, player);
+                            *player = peer_auth.state;
+                        } break;
+
+                        case SERVER_PACKET_PEER_LEAVE: {
+                            client_receive_peer_leave(&net, &reader);
+                        } break;
+
+                        case SERVER_PACKET_PLAYER_KILL: {
+                            client_receive_kill(&net, &reader);
+                        } break;
+
+                        case SERVER_PACKET_DROPPED: {
+                            ++stats.num_dropped;
+                        } break;
+
+                        case SERVER_PACKET_PEER_DISCONNECTED: {
+                            client_receive_peer_disconnected(&net, &reader);
+                        } break;
+
+                        default:
+                            printf("bot %u: received unknown packet type %d\n", bot->index, header->type);
+                        }
+                    }
+                    client_batch_end(&reader, &net);
+                } break;
+
+                case ENET_EVENT_TYPE_DISCONNECT:
+                case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+                    printf("bot %u: server %s\n", bot->index, (event.type == ENET_EVENT_TYPE_DISCONNECT) ? "disconnected" : "timeout");
+                    running = false;
+                    break;
+
+                case ENET_EVENT_TYPE_CONNECT:
+                case ENET_EVENT_TYPE_NONE:
+                    break;
+                }
+
+                enet_packet_destroy(event.packet);
+            }
+        }
+
+        struct player *player = NULL;
+        if (net.main_player_id != HASH_MAP_INVALID_HASH)
+            HashMapLookup(game.player_map, net.main_player_id, player);
+
+        if (net.connected) {
+            assert(player != NULL);
+
+            struct prediction_entry *prediction = client_prediction_begin(&net);
+            struct input *input = &prediction->input;
+
+            bot_handle_input(bot, &game, player, input, frame.dt);
+
+            struct packed_input packed_input = input_encode(input);
+            *input = input_decode(&packed_input);
+
+            if (player->health > 0.0f) {
+                struct client_header header = {
+                    .type = CLIENT_PACKET_UPDATE,
+                    .sim_tick = frame.simulation_tick,
+                };
+
+                // Peer states are applied as soon as they arrive, so we see
+                // other players half a round trip behind the server
+                const f64 view_tick = clock_server_tick(&net.clock, time_current(), frame.desired_delta) - net.clock.rtt/2.0 / (f64) frame.desired_delta;
+                struct client_packet_update update = {
+                    .input = packed_input,
+                    .view_delay = (net.clock.num_samples > 0) ? interp_view_delay(frame.simulation_tick, view_tick) : 0,
+                };
+
+                client_new_packet(&output_buffer);
+                APPEND(&output_buffer, &header);
+                APPEND(&output_buffer, &update);
+
+                update_player(&game, player, input, frame.dt);
+                collect_and_resolve_static_collisions(&game);
+
+                client_prediction_end(prediction, player);
+            }
+        }
+
+        update_projectiles(&game, frame.dt);
+        // Nothing plays sounds or draws steps, and steps live long
+        // enough to fill their list in a full match
+        ListClear(game.sound_list);
+        ListClear(game.damage_list);
+        ListClear(game.step_list);
+
+        if (run_network_tick) {
+            const size_t size = client_batch_finish(&net, &output_buffer);
+            if (size > 0) {
+                ENetPacket *packet = enet_packet_create(output_buffer.base, size, ENET_PACKET_FLAG_UNSEQUENCED);
+                enet_peer_send(peer, 0, packet);
+                client_batch_reset(&output_buffer);
+            }
+        }
+
+        const f64 lead_error = clock_lead_error(&net.clock, time_current(), frame.simulation_tick, frame.desired_delta);
+        if (lead_error > CLOCK_STEP_TICKS || lead_error < -CLOCK_STEP_TICKS)
+            ++stats.num_clock_steps;
+
+        // Report metrics
+        const u64 now = time_current();
+        if (now >= next_report) {
+            u32 visible_peers = 0;
+            HashMapForEach(game.player_map, struct player, p) {
+                if (p->id != net.main_player_id && p->health > 0.0f)
+                    ++visible_peers;
+            }
+
+            const f64 latency_mean = (stats.num_auths > 0) ? (f64) stats.auth_latency_sum / (f64) stats.num_auths : 0.0;
+            fprintf(csv, "%.3f,%u,%s,%u,%.3f,%.3f,%lu,%lu,%lu,%lu,%lu,%lu,%.3f,%.3f,%.2f,%u,%u,%u\n",
+                    (f64) (now - start) / NANOSECONDS(1), bot->index, bot_behavior_names[bot->behavior],
+                    peer->roundTripTime,
+                    latency_mean / 1000000.0, (f64) stats.auth_latency_max / 1000000.0,
+                    stats.num_auths, stats.num_mispredictions, stats.num_dropped,
+                    stats.num_missing_baselines, net.num_events_dropped - stats.events_dropped_start,
+                    stats.num_clock_steps,
+                    net.clock.rtt / 1000000.0, net.clock.jitter / 1000000.0, lead_error,
+                    peer->incomingDataTotal - stats.incoming_data_total_start,
+                    peer->outgoingDataTotal - stats.outgoing_data_total_start,
+                    visible_peers);
+            fflush(csv);
+
+            stats = (struct bot_stats) {
+                .incoming_data_total_start = peer->incomingDataTotal,
+                .outgoing_data_total_start = peer->outgoingDataTotal,
+                .events_dropped_start = net.num_events_dropped,
+            };
+            next_report += NANOSECONDS(1);
+        }
+
+        const u64 frame_delta = clock_frame_delta(lead_error, frame.desired_delta);
+        frame.delta = time_current() - frame_start;
+        if (frame.delta < frame_delta)
+            time_nanosleep(frame_delta - frame.delta);
+
+        if (run_network_tick)
+            ++frame.network_tick;
+        ++frame.simulation_tick;
+    }
+
+    HashMapFree(game.player_map);
+    client_net_free(&net);
+    byte_buffer_free(&output_buffer);
+}
+
+static void usage(const char *name) {
+    printf("usage: %s <ip> <bot> [--match N] [--port N] [--seconds N] [--csv PATH]\n", name);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *ip = argv[1];
+    const u32 index = (u32) atoi(argv[2]);
+    u32 match = 0;
+    u16 port = 9053;
+    u64 seconds = DEFAULT_DURATION;
+    char csv_path[256];
+    snprintf(csv_path, sizeof(csv_path), "client-stress-%u.csv", index);
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--match") == 0 && i+1 < argc) {
+            match = (u32) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--port") == 0 && i+1 < argc) {
+            port = (u16) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i+1 < argc) {
+            seconds = (u64) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--csv") == 0 && i+1 < argc) {
+            snprintf(csv_path, sizeof(csv_path), "%s", argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    struct bot bot = {
+        .index = index,
+        .behavior = index % BOT_LAST,
+        .random = random_seed_pcg(0x9053 + index, 0x9005),
+    };
+
+    FILE *csv = fopen(csv_path, "w");
+    if (csv == NULL) {
+        printf("bot %u: failed to open %s\n", index, csv_path);
+        return 1;
+    }
+    csv_write_header(csv);
+
+    if (enet_initialize() != 0) {
+        printf("An error occurred while initializing ENet.\n");
+        return 1;
+    }
+
+    time_init();
+
+    ENetHost *client = enet_host_create(NULL, 1, 1, 0, 0);
+    if (client == NULL) {
+        printf("An error occurred while trying to create an ENet client host.\n");
+        return 1;
+    }
+
+    ENetAddress address = {0};
+    enet_address_set_host(&address, ip);
+    address.port = port;
+
+    ENetPeer *peer = enet_host_connect(client, &address, 2, match);
+    if (peer == NULL) {
+        printf("No available peers for initiating an ENet connection.\n");
+        return 1;
+    }
+
+    ENetEvent event = {0};
+    if (enet_host_service(client, &event, 5000) > 0 && event.type == ENET_EVENT_TYPE_CONNECT) {
+        printf("bot %u: connected to %s:%u match %u as %s\n", index, ip, port, match, bot_behavior_names[bot.behavior]);
+        game(client, peer, &bot, csv, seconds*NANOSECONDS(1));
+
+        enet_peer_disconnect(peer, 0);
+        bool disconnected = false;
+        while (!disconnected && enet_host_service(client, &event, 100) > 0) {
+            if (event.type == ENET_EVENT_TYPE_RECEIVE)
+                enet_packet_destroy(event.packet);
+            else if (event.type == ENET_EVENT_TYPE_DISCONNECT)
+                disconnected = true;
+        }
+        if (!disconnected)
+            enet_peer_reset(peer);
+    } else {
+        printf("bot %u: failed to connect to %s:%u\n", index, ip, port);
+        enet_peer_reset(peer);
+    }
+
+    fclose(csv);
+    enet_host_destroy(client);
+    enet_deinitialize();
+    time_deinit();
+    return 0;
+}
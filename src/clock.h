@@ -0,0 +1,173 @@
+#pragma once
+
+#include "common.h"
+#include <math.h>
+
+//
+// Clock synchronization
+//
+// Every client batch carries the client time it was sent at (t0). Per-peer
+// server batches echo the latest t0 the server has received along with the
+// server time it was received at (t1), and the server time (t2) and
+// simulation tick of the tick the batch was sent in. When the client
+// receives one at t3 it gives an NTP sample of
+//
+//   rtt    = (t3 - t0) - (t2 - t1)
+//   offset = ((t1 - t0) + (t2 - t3)) / 2, server clock - client clock
+//
+// Samples are filtered like NTP does, of the last CLOCK_FILTER_SAMPLES the
+// one with the lowest rtt has spent the least time in queues and gives the
+// best offset. Jitter is the smoothed deviation of sample rtts from that
+// minimum, and drift the smoothed rate of change of the filtered offset,
+// which is used to extrapolate the offset between samples.
+//
+// The client uses the estimate to find the (fractional) server tick its
+// input will arrive at, and runs its simulation lead ticks ahead of it. The
+// lead is CLOCK_PIPELINE_TICKS plus a margin for the measured jitter, so
+// the less jitter there is the less input waits on the server.
+//
+
+#define CLOCK_FILTER_SAMPLES 8
+// Smoothing factors for jitter and drift
+#define CLOCK_JITTER_GAIN 0.1
+#define CLOCK_DRIFT_GAIN 0.1
+// Drift is only measured over at least this long, offset noise dominates
+// over shorter intervals
+#define CLOCK_DRIFT_INTERVAL NANOSECONDS(1)
+
+// A batch holds NET_PER_SIM_TICKS ticks of input and the server only reads
+// input on network ticks, so the last tick of a batch has to be this far
+// ahead of the server tick it arrives at for the first one to still be on
+// time.
+#define CLOCK_PIPELINE_TICKS (NET_PER_SIM_TICKS + 1)
+// Margin on top of that, in multiples of the jitter and at least
+// CLOCK_MIN_MARGIN
+#define CLOCK_JITTER_MARGIN 3.0
+#define CLOCK_MIN_MARGIN (NANOSECONDS(1)/1000)
+
+struct clock_sample {
+    f64 rtt;
+    f64 offset;
+    u64 time;
+};
+
+struct clock_sync {
+    struct clock_sample samples[CLOCK_FILTER_SAMPLES];
+    u32 num_samples;
+    u32 next_sample;
+
+    // Filtered estimate, in nanoseconds, valid once num_samples > 0
+    f64 rtt;
+    f64 offset;
+    u64 offset_time;
+    f64 jitter;
+    // Nanoseconds the offset changes per nanosecond
+    f64 drift;
+
+    f64 drift_offset;
+    u64 drift_time;
+
+    // Server time and tick of the latest batch
+    u64 server_time;
+    u64 server_tick;
+};
+
+static inline f64 clock_offset_at(const struct clock_sync *c, u64 time) {
+    return c->offset + c->drift*((f64) time - (f64) c->offset_time);
+}
+
+// Call for every per-peer batch with the times from its header and the
+// time it was received. Batches without an echoed client time are skipped.
+static inline void clock_sync_sample(struct clock_sync *c, u64 t0, u64 t1, u64 t2, u64 t3, u64 server_tick) {
+    if (t0 == 0 || t3 < t0)
+        return;
+
+    c->server_time = t2;
+    c->server_tick = server_tick;
+
+    const f64 rtt = ((f64) t3 - (f64) t0) - ((f64) t2 - (f64) t1);
+    const f64 offset = (((f64) t1 - (f64) t0) + ((f64) t2 - (f64) t3)) / 2.0;
+    c->samples[c->next_sample] = (struct clock_sample) {
+        .rtt = (rtt > 0.0) ? rtt : 0.0,
+        .offset = offset,
+        .time = t3,
+    };
+    c->next_sample = (c->next_sample + 1) % CLOCK_FILTER_SAMPLES;
+    if (c->num_samples < CLOCK_FILTER_SAMPLES)
+        ++c->num_samples;
+
+    const struct clock_sample *best = &c->samples[0];
+    for (u32 i = 1; i < c->num_samples; ++i) {
+        if (c->samples[i].rtt < best->rtt)
+            best = &c->samples[i];
+    }
+
+    const bool first = c->num_samples == 1;
+    c->rtt = best->rtt;
+    c->offset = best->offset;
+    c->offset_time = best->time;
+
+    const f64 deviation = (rtt > best->rtt) ? rtt - best->rtt : 0.0;
+    c->jitter = first ? deviation : c->jitter + CLOCK_JITTER_GAIN*(deviation - c->jitter);
+
+    if (first) {
+        c->drift_offset = c->offset;
+        c->drift_time = c->offset_time;
+    } else if (c->offset_time >= c->drift_time + CLOCK_DRIFT_INTERVAL) {
+        const f64 drift = (c->offset - c->drift_offset) / ((f64) c->offset_time - (f64) c->drift_time);
+        c->drift += CLOCK_DRIFT_GAIN*(drift - c->drift);
+        c->drift_offset = c->offset;
+        c->drift_time = c->offset_time;
+    }
+}
+
+// Server tick, with fraction, the server is at at client time now
+static inline f64 clock_server_tick(const struct clock_sync *c, u64 now, u64 tick_delta) {
+    const f64 server_now = (f64) now + clock_offset_at(c, now);
+    return (f64) c->server_tick + (server_now - (f64) c->server_time) / (f64) tick_delta;
+}
+
+// Server tick, with fraction, that input sent at client time now arrives at
+static inline f64 clock_arrival_tick(const struct clock_sync *c, u64 now, u64 tick_delta) {
+    return clock_server_tick(c, now, tick_delta) + c->rtt/2.0 / (f64) tick_delta;
+}
+
+// Ticks the client should run ahead of the server tick its input arrives at
+static inline f64 clock_target_lead(const struct clock_sync *c, u64 tick_delta) {
+    f64 margin = CLOCK_JITTER_MARGIN*c->jitter;
+    if (margin < CLOCK_MIN_MARGIN)
+        margin = CLOCK_MIN_MARGIN;
+    return CLOCK_PIPELINE_TICKS + margin / (f64) tick_delta;
+}
+
+// How many ticks the client at sim_tick is ahead of where it should be,
+// negative if it's behind. 0 until there is an estimate.
+static inline f64 clock_lead_error(const struct clock_sync *c, u64 now, u64 sim_tick, u64 tick_delta) {
+    if (c->num_samples == 0)
+        return 0.0;
+    const f64 lead = (f64) sim_tick - clock_arrival_tick(c, now, tick_delta);
+    return lead - clock_target_lead(c, tick_delta);
+}
+
+// Errors of more than CLOCK_STEP_TICKS are corrected at once by sleeping
+// or running frames back to back, smaller ones by stretching or shrinking
+// frames by up to CLOCK_MAX_SLEW.
+#define CLOCK_STEP_TICKS 3.0
+#define CLOCK_SLEW_PER_TICK 0.05
+#define CLOCK_MAX_SLEW 0.1
+
+// Time the current frame should take given the lead error, 0 if the
+// client is far behind and shouldn't sleep at all
+static inline u64 clock_frame_delta(f64 error, u64 desired_delta) {
+    if (error < -CLOCK_STEP_TICKS)
+        return 0;
+    if (error > CLOCK_STEP_TICKS)
+        return (u64) ((1.0 + error)*(f64) desired_delta);
+
+    f64 slew = CLOCK_SLEW_PER_TICK*error;
+    if (slew > CLOCK_MAX_SLEW)
+        slew = CLOCK_MAX_SLEW;
+    if (slew < -CLOCK_MAX_SLEW)
+        slew = -CLOCK_MAX_SLEW;
+    return (u64) ((1.0 + slew)*(f64) desired_delta);
+}
@@ -3,9 +3,12 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <errno.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <stdalign.h>
 
 typedef int8_t   i8;
 typedef uint8_t  u8;
@@ -72,21 +75,26 @@ static inline f32 f32_clamp(f32 x, f32 a, f32 b) {
 static u64 win32_frequency = 0;
 #endif
 
-//#define TIME_USE_SLEEP
+// The OS sleep overshoots by some tens of microseconds on linux, and by
+// 1-2 ms on windows even with timeBeginPeriod(1), so sleeps are ended
+// early by this much and the rest of the way is spun.
+#if defined(_WIN32)
+#define TIME_SPIN_NS 2000000ull
+#else
+#define TIME_SPIN_NS 200000ull
+#endif
+#define TIME_SPIN_MIN_NS 20000ull
 
 static inline void time_init() {
 #if defined(_WIN32)
     QueryPerformanceFrequency((LARGE_INTEGER*) &win32_frequency);
-#endif
-
-#if defined(_WIN32) && defined(TIME_USE_SLEEP)
     // Setup high-resolution timer to 1ms (granularity of 1-2 ms)
     timeBeginPeriod(1);
 #endif
 }
 
 static inline void time_deinit() {
-#if defined(_WIN32) && defined(TIME_USE_SLEEP)
+#if defined(_WIN32)
     timeEndPeriod(1);
 #endif
 }
@@ -103,22 +111,150 @@ static inline u64 time_current() {
 #endif
 }
 
-static inline void time_nanosleep(u64 ns) {
-#if !defined(TIME_USE_SLEEP)
-    u64 start = time_current();
-    while (time_current() - start < ns) {}
-#elif defined(__linux__)
+// Sleeps until roughly the absolute time t (as returned by time_current()),
+// may wake up late.
+static inline void time_sleep_until(u64 t) {
+#if defined(__linux__)
     struct timespec ts = {
-        .tv_nsec = ns,
+        .tv_sec  = t / NANOSECONDS(1),
+        .tv_nsec = t % NANOSECONDS(1),
     };
-    while(nanosleep(&ts, &ts) == -1) {}
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
 #elif defined(_WIN32)
-    Sleep(ns / 1000000);
+    const u64 now = time_current();
+    if (t > now)
+        Sleep((t - now) / 1000000);
 #else
     assert(false);
 #endif
 }
 
+static inline void time_spin_until(u64 t) {
+    while (time_current() < t) {}
+}
+
+static inline void time_nanosleep(u64 ns) {
+    const u64 deadline = time_current() + ns;
+    if (ns > TIME_SPIN_NS)
+        time_sleep_until(deadline - TIME_SPIN_NS);
+    time_spin_until(deadline);
+}
+
+//
+// Tick scheduler
+//
+// Waits for ticks at absolute deadlines, start + n*period, so time spent in
+// a frame or oversleeping never accumulates. Most of the wait is spent
+// asleep, the last stretch is spun. The spin length is calibrated from how
+// late the OS sleep has woken us up recently.
+//
+// When a frame runs past its deadline the next tick starts immediately to
+// catch up. If we fall more than TICK_SCHEDULER_MAX_CATCH_UP ticks behind
+// the missed ticks are dropped and the deadlines restart from now.
+//
+
+#define TICK_SCHEDULER_MAX_CATCH_UP 4
+
+struct tick_stats {
+    u64 num_ticks;
+    u64 num_overruns;
+    u64 num_catch_up_ticks;
+    u64 num_dropped_ticks;
+
+    // Lateness of tick starts compared to their deadline in nanoseconds
+    u64 jitter_min;
+    u64 jitter_max;
+    f64 jitter_sum;
+    f64 jitter_sum_squares;
+};
+
+struct tick_scheduler {
+    u64 period;
+    u64 deadline;
+    u64 spin;
+    u64 max_oversleep;
+    struct tick_stats stats;
+};
+
+static inline void tick_stats_reset(struct tick_stats *stats) {
+    *stats = (struct tick_stats) {
+        .jitter_min = UINT64_MAX,
+    };
+}
+
+static inline f64 tick_stats_jitter_mean(const struct tick_stats *stats) {
+    return (stats->num_ticks > 0) ? stats->jitter_sum / (f64) stats->num_ticks : 0.0;
+}
+
+static inline f64 tick_stats_jitter_variance(const struct tick_stats *stats) {
+    if (stats->num_ticks == 0)
+        return 0.0;
+    const f64 mean = tick_stats_jitter_mean(stats);
+    return stats->jitter_sum_squares / (f64) stats->num_ticks - mean*mean;
+}
+
+static inline struct tick_scheduler tick_scheduler_init(u64 period) {
+    struct tick_scheduler s = {
+        .period = period,
+        .deadline = time_current() + period,
+        .spin = TIME_SPIN_NS,
+    };
+    tick_stats_reset(&s.stats);
+    return s;
+}
+
+static inline void tick_stats_record(struct tick_stats *stats, u64 jitter) {
+    ++stats->num_ticks;
+    stats->jitter_min = (jitter < stats->jitter_min) ? jitter : stats->jitter_min;
+    stats->jitter_max = (jitter > stats->jitter_max) ? jitter : stats->jitter_max;
+    stats->jitter_sum += (f64) jitter;
+    stats->jitter_sum_squares += (f64) jitter * (f64) jitter;
+}
+
+// Waits for the start of the next tick. Returns false if this tick is
+// started late to catch up after an overrun. When so far behind that the
+// missed ticks are dropped, the deadlines restart from now and this tick
+// counts as on time, returning true.
+static inline bool tick_scheduler_wait(struct tick_scheduler *s) {
+    const u64 now = time_current();
+
+    if (now >= s->deadline) {
+        ++s->stats.num_overruns;
+        const u64 behind = now - s->deadline;
+        if (behind > TICK_SCHEDULER_MAX_CATCH_UP*s->period) {
+            s->stats.num_dropped_ticks += behind / s->period;
+            s->deadline = now + s->period;
+            tick_stats_record(&s->stats, 0);
+            return true;
+        }
+        ++s->stats.num_catch_up_ticks;
+        s->deadline += s->period;
+        tick_stats_record(&s->stats, behind);
+        return false;
+    }
+
+    if (s->deadline - now > s->spin) {
+        const u64 wake = s->deadline - s->spin;
+        time_sleep_until(wake);
+
+        // Spin for twice the worst recent oversleep, slowly forgetting
+        // old outliers
+        const u64 woke = time_current();
+        const u64 oversleep = (woke > wake) ? woke - wake : 0;
+        const u64 decayed = s->max_oversleep - s->max_oversleep/64;
+        s->max_oversleep = (oversleep > decayed) ? oversleep : decayed;
+
+        const u64 max_spin = s->period/2;
+        const u64 spin = 2*s->max_oversleep;
+        s->spin = (spin < TIME_SPIN_MIN_NS) ? TIME_SPIN_MIN_NS : (spin > max_spin) ? max_spin : spin;
+    }
+    time_spin_until(s->deadline);
+
+    tick_stats_record(&s->stats, time_current() - s->deadline);
+    s->deadline += s->period;
+    return true;
+}
+
 //
 // Ciruclar buffer
 //
@@ -138,6 +274,43 @@ static inline void time_nanosleep(u64 ns) {
         --(buf)->used;                                                          \
     } while (0)
 
+//
+// Single producer single consumer ring
+//
+// Lock-free ring for handing items from one thread to another. head is
+// only written by the consumer and tail only by the producer, ok is set to
+// false if the ring is full on push or empty on pop.
+//
+
+#define SpscRing(type, size)                    \
+    struct {                                    \
+        type data[size];                        \
+        alignas(64) _Atomic u64 head;           \
+        alignas(64) _Atomic u64 tail;           \
+    }
+
+#define SPSC_RING_PUSH(ring, element, ok)                                               \
+    do {                                                                                \
+        const u64 _tail = atomic_load_explicit(&(ring)->tail, memory_order_relaxed);    \
+        const u64 _head = atomic_load_explicit(&(ring)->head, memory_order_acquire);    \
+        ok = _tail - _head < ARRLEN((ring)->data);                                      \
+        if (ok) {                                                                       \
+            (ring)->data[_tail % ARRLEN((ring)->data)] = element;                       \
+            atomic_store_explicit(&(ring)->tail, _tail + 1, memory_order_release);      \
+        }                                                                               \
+    } while (0)
+
+#define SPSC_RING_POP(ring, output, ok)                                                 \
+    do {                                                                                \
+        const u64 _head = atomic_load_explicit(&(ring)->head, memory_order_relaxed);    \
+        const u64 _tail = atomic_load_explicit(&(ring)->tail, memory_order_acquire);    \
+        ok = _head != _tail;                                                            \
+        if (ok) {                                                                       \
+            output = (ring)->data[_head % ARRLEN((ring)->data)];                        \
+            atomic_store_explicit(&(ring)->head, _head + 1, memory_order_release);      \
+        }                                                                               \
+    } while (0)
+
 //
 // ByteBuffer
 //
@@ -180,6 +353,10 @@ static inline void append(struct byte_buffer *buffer, void *data, size_t size) {
 #define POP(buffer, data) \
     pop(buffer, (void **) data, sizeof(**data))
 
+// Pops count consecutive elements, e.g. the payloads of an event batch
+#define POP_ARRAY(buffer, data, count) \
+    pop(buffer, (void **) data, (count)*sizeof(**data))
+
 static inline void pop(struct byte_buffer *buffer, void **data, size_t size) {
     assert(buffer->top + size <= buffer->base + buffer->size);
     *data = buffer->top;
@@ -189,45 +366,137 @@ static inline void pop(struct byte_buffer *buffer, void **data, size_t size) {
 //
 // Static unsorted list
 //
+// Items are removed by tagging them while iterating and then removing all
+// tagged items at once, which takes a single pass either way:
+//
+//   ListRemoveTaggedItems      keeps the order of the remaining items
+//   ListSwapRemoveTaggedItems  fills holes with items from the end, for
+//                              lists where order doesn't matter
+//
+// occupied is a bitset over items, a cleared bit below num_items is a
+// tagged item. Bits at or above num_items are garbage.
+//
+
+#define List(type, size)                        \
+    struct {                                    \
+        type items[size];                       \
+        u64 occupied[((size) + 63)/64];         \
+        u32 num_items;                          \
+    }
+
+// Index of the first cleared bit in [from, end), or end
+static inline u32 list_next_clear(const u64 *bits, u32 from, u32 end) {
+    for (u32 w = from / 64; w*64 < end; ++w) {
+        u64 clear = ~bits[w];
+        if (w == from / 64)
+            clear &= ~0ull << (from % 64);
+        if (clear) {
+            const u32 i = w*64 + (u32) __builtin_ctzll(clear);
+            return (i < end) ? i : end;
+        }
+    }
+    return end;
+}
+
+// One past the last set bit in [from, end), or from
+static inline u32 list_end_of_set(const u64 *bits, u32 from, u32 end) {
+    while (end > from) {
+        const u32 w = (end - 1) / 64;
+        u64 set = bits[w];
+        if (end - w*64 < 64)
+            set &= (1ull << (end - w*64)) - 1;
+        if (w == from / 64)
+            set &= ~0ull << (from % 64);
+        if (set)
+            return w*64 + 64 - (u32) __builtin_clzll(set);
+        end = w*64;
+    }
+    return from;
+}
 
-#define List(type, size) \
-    struct {                \
-        type items[size];   \
-        bool occupied[size]; \
-        u32 num_items;      \
+// Sets bits [0, end) and returns end
+static inline u32 list_fill(u64 *bits, u32 end) {
+    for (u32 w = 0; w < end / 64; ++w)
+        bits[w] = ~0ull;
+    if (end % 64)
+        bits[end / 64] = (1ull << (end % 64)) - 1;
+    return end;
+}
+
+// Moves every occupied item down over the tagged ones before it, returns
+// the new number of items
+static inline u32 list_compact(void *items, size_t size, u64 *bits, u32 num_items) {
+    u8 *data = items;
+    u32 top = list_next_clear(bits, 0, num_items);
+    if (top == num_items)
+        return num_items;
+
+    for (u32 w = top / 64; w*64 < num_items; ++w) {
+        u64 set = bits[w];
+        if (w == top / 64)
+            set &= ~0ull << (top % 64);
+        if (num_items - w*64 < 64)
+            set &= (1ull << (num_items - w*64)) - 1;
+        while (set) {
+            const u32 i = w*64 + (u32) __builtin_ctzll(set);
+            set &= set - 1;
+            memcpy(data + top*size, data + i*size, size);
+            ++top;
+        }
     }
+    return list_fill(bits, top);
+}
 
-#define ListInsert(list, value)                         \
-    do {                                                \
-        assert(list.num_items < ARRLEN(list.items));    \
-        list.items[list.num_items] = value;             \
-        list.occupied[list.num_items] = true;           \
-        ++list.num_items;                               \
+// Moves occupied items from the end into the holes left by tagged ones,
+// returns the new number of items
+static inline u32 list_swap_compact(void *items, size_t size, u64 *bits, u32 num_items) {
+    u8 *data = items;
+    u32 end = num_items;
+    for (u32 w = 0; w*64 < end; ++w) {
+        u64 clear = ~bits[w];
+        while (clear) {
+            const u32 hole = w*64 + (u32) __builtin_ctzll(clear);
+            clear &= clear - 1;
+            if (hole >= end)
+                return list_fill(bits, end);
+
+            // Drop tagged items at the end, the hole itself is tagged so
+            // there is nothing left to move if this reaches it
+            end = list_end_of_set(bits, hole, end);
+            if (end == hole)
+                return list_fill(bits, end);
+            --end;
+            memcpy(data + hole*size, data + end*size, size);
+        }
+    }
+    return (end == num_items) ? num_items : list_fill(bits, end);
+}
+
+#define ListFull(list) \
+    (list.num_items == ARRLEN(list.items))
+
+#define ListInsert(list, value)                                         \
+    do {                                                                \
+        assert(list.num_items < ARRLEN(list.items));                    \
+        list.items[list.num_items] = value;                             \
+        list.occupied[list.num_items / 64] |= 1ull << (list.num_items % 64); \
+        ++list.num_items;                                               \
     } while(0)
 
-#define ListTagRemoveIndex(list, index)         \
-    do {                                        \
-        assert(index < list.num_items);         \
-        list.occupied[index] = false;           \
+#define ListTagRemoveIndex(list, index)                                 \
+    do {                                                                \
+        assert(index < list.num_items);                                 \
+        list.occupied[(index) / 64] &= ~(1ull << ((index) % 64));       \
     } while (0)
 
 #define ListTagRemovePtr(list, ptr) \
     ListTagRemoveIndex(list, ArrayPtrToIndex(list.items, ptr))
 
-#define ListRemoveTaggedItems(list)                                                                                      \
-    do {                                                                                                        \
-        for (u32 i = 0; i < list.num_items;) {                                                                  \
-            if (!list.occupied[i]) {                                                                            \
-                if (i+1 < list.num_items) {                                                                     \
-                    memmove(&list.items[i], &list.items[i+1], sizeof(list.items[0])*(list.num_items - (i+1)));  \
-                    memmove(&list.occupied[i], &list.occupied[i+1], sizeof(bool)*(list.num_items - (i+1)));     \
-                }                                                                                               \
-                --list.num_items;                                                                               \
-            } else {                                                                                            \
-                ++i;                                                                                            \
-            }                                                                                                   \
-        }                                                                                                       \
-    } while (0)
+#define ListRemoveTaggedItems(list) \
+    list.num_items = list_compact(list.items, sizeof(list.items[0]), list.occupied, list.num_items)
+
+#define ListSwapRemoveTaggedItems(list) \
+    list.num_items = list_swap_compact(list.items, sizeof(list.items[0]), list.occupied, list.num_items)
 
 #define ListClear(list) \
     list.num_items = 0
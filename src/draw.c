@@ -2,6 +2,7 @@
 #include "random.h"
 #include "color.h"
 #include "game.h"
+#include "trace.h"
 
 #include <rlgl.h>
 
@@ -62,6 +63,13 @@ static inline f32 world_to_screen_length(struct camera c, f32 len) {
     return fminf(v.x, v.y);
 }
 
+// Hue of the player something came from, who may have left since
+static inline f32 player_hue(struct game *game, PlayerId id) {
+    struct player *p = NULL;
+    HashMapLookup(game->player_map, id, p);
+    return (p != NULL) ? p->hue : 0.0f;
+}
+
 static inline void set_light_resolution() {
     light_resolution = (int) world_to_screen_length((struct camera){0}, 32.0f);
 }
@@ -236,7 +244,7 @@ void draw_map(struct camera c, const struct map *map) {
 }
 
 void draw_player(struct camera c, struct player *p) {
-    const f32 radius = 0.25f;
+    const f32 radius = PLAYER_HIT_RADIUS;
     const f32 dodge_radius = 0.7f * radius;
 
     Color light;
@@ -373,6 +381,9 @@ void draw_dynamic_light(struct game *game, enum light_mode mode, v2 pos, f32 con
 }
 
 void draw_game(struct camera c, struct game *game, PlayerId main_player_id, const f32 dt, const f32 t) {
+    trace_begin("draw_game");
+    trace_begin("shadows");
+
     if (IsWindowResized()) {
         set_light_resolution();
 
@@ -431,8 +442,11 @@ void draw_game(struct camera c, struct game *game, PlayerId main_player_id, cons
     //    draw_dynamic_light(game, LIGHT_MODE_CONE, player->pos, cone_angle, M_PI/2.0f);
     //}
 
+    trace_end("shadows");
+
     Vector2 resolution = {GetRenderWidth(), GetRenderHeight()};
 
+    trace_begin("lightmap");
     BeginTextureMode(lightmap);
     ClearBackground(BLANK);
     for (u32 i = 0; i < num_lights; ++i) {
@@ -462,7 +476,9 @@ void draw_game(struct camera c, struct game *game, PlayerId main_player_id, cons
         EndShaderMode();
     }
     EndTextureMode();
+    trace_end("lightmap");
 
+    trace_begin("map");
     draw_map(c, &game->map);
 
     DrawRectangle(0,0,resolution.x,resolution.y,(Color){10,10,10,150});
@@ -470,34 +486,33 @@ void draw_game(struct camera c, struct game *game, PlayerId main_player_id, cons
     DrawTextureRec(lightmap.texture, (Rectangle){0,0,lightmap.texture.width,-lightmap.texture.height}, (Vector2){0,0}, WHITE);
     EndBlendMode();
 
+    trace_end("map");
+
+    trace_begin("entities");
     BeginShaderMode(final);
     SetShaderValueTexture(final, GetShaderLocation(final, "lightmap"), lightmap.texture);
     SetShaderValue(final, GetShaderLocation(final, "resolution"), &resolution, SHADER_UNIFORM_VEC2);
 
     ForEachList(game->step_list, struct step, s) {
-        struct player *p;
-        HashMapLookup(game->player_map, s->player_id_from, p);
+        const f32 hue = player_hue(game, s->player_id_from);
 
-        const Color dark   = Fade(hsl_to_rgb(HSL(p->hue, 0.5f, 0.2f)), s->time_left/2.0f);
-        const Color darker = Fade(hsl_to_rgb(HSL(p->hue, 0.5f, 0.1f)), s->time_left/2.0f);
+        const Color dark   = Fade(hsl_to_rgb(HSL(hue, 0.5f, 0.2f)), s->time_left/2.0f);
+        const Color darker = Fade(hsl_to_rgb(HSL(hue, 0.5f, 0.1f)), s->time_left/2.0f);
         DrawCircleV(world_to_screen(c, s->pos), world_to_screen_length(c, 0.2f), darker);
         DrawCircleV(world_to_screen(c, s->pos), world_to_screen_length(c, 0.7f*0.2f), dark);
     }
 
     HashMapForEach(game->player_map, struct player, p) {
-        if (!HashMapExists(game->player_map, p))
-            continue;
         if (p->id == main_player_id || p->health == 0.0f)
             continue;
         draw_player(c, p);
     }
 
     ForEachList(game->nade_list, struct nade_projectile, nade) {
-        struct player *p;
-        HashMapLookup(game->player_map, nade->player_id_from, p);
+        const f32 hue = player_hue(game, nade->player_id_from);
 
-        const Color light = hsl_to_rgb(HSL(p->hue, 0.5f, 0.5f));
-        const Color dark  = hsl_to_rgb(HSL(p->hue, 0.5f, 0.3f));
+        const Color light = hsl_to_rgb(HSL(hue, 0.5f, 0.5f));
+        const Color dark  = hsl_to_rgb(HSL(hue, 0.5f, 0.3f));
 
         Vector2 nade_pos = world_to_screen(c, nade->pos);
         DrawCircle(nade_pos.x, nade_pos.y, world_to_screen_length(c, 0.125f), light);
@@ -505,10 +520,9 @@ void draw_game(struct camera c, struct game *game, PlayerId main_player_id, cons
     }
 
     ForEachList(game->explosion_list, struct explosion, e) {
-        struct player *p;
-        HashMapLookup(game->player_map, e->player_id_from, p);
+        const f32 hue = player_hue(game, e->player_id_from);
 
-        const Color dark = Fade(hsl_to_rgb(HSL(p->hue, 0.5f, 0.3f)), e->time_left);
+        const Color dark = Fade(hsl_to_rgb(HSL(hue, 0.5f, 0.3f)), e->time_left);
 
         f32 radius = world_to_screen_length(c, e->radius);
         Vector2 explosion_pos = world_to_screen(c, e->pos);
@@ -516,10 +530,9 @@ void draw_game(struct camera c, struct game *game, PlayerId main_player_id, cons
     }
 
     ForEachList(game->hitscan_list, struct hitscan_projectile, hitscan) {
-        struct player *p;
-        HashMapLookup(game->player_map, hitscan->player_id_from, p);
+        const f32 hue = player_hue(game, hitscan->player_id_from);
 
-        const Color dark = Fade(hsl_to_rgb(HSL(p->hue, 0.5f, 0.3f)), hitscan->time_left);
+        const Color dark = Fade(hsl_to_rgb(HSL(hue, 0.5f, 0.3f)), hitscan->time_left);
 
         Vector2 start = world_to_screen(c, hitscan->pos);
         Vector2 end = world_to_screen(c, hitscan->impact);
@@ -543,6 +556,9 @@ void draw_game(struct camera c, struct game *game, PlayerId main_player_id, cons
         DrawRectangle(x - size/2,      y - thickness/2, size, thickness, WHITE);
         DrawRectangle(x - thickness/2, y - size/2,      thickness, size, WHITE);
     }
+    trace_end("entities");
+
+    trace_end("draw_game");
 }
 
 void draw_graph(struct graph *g, v2 pos, v2 size, v2 margin) {
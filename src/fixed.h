@@ -0,0 +1,158 @@
+#pragma once
+
+#include "common.h"
+#include <math.h>
+
+//
+// Fixed-point
+//
+// Building with FIXED_POINT runs the simulation math in v2.h and game.c
+// on 32.32 fixed-point integers instead of floats. State is still stored
+// as f32 so nothing outside the simulation has to change, but every
+// multiply, divide, square root and normalize goes through integers, and
+// the only float operations left are adds, subtracts and compares.
+// Those are exactly rounded, can't be fused into an FMA and don't depend
+// on libm, so the simulation is bit-identical across compilers, flags
+// and architectures as long as client and server are both built with
+// FIXED_POINT.
+//
+// Values saturate at +-2^30, which is far outside both the map and the
+// screen.
+//
+
+#define FIXED_FRAC_BITS 32
+#define FIXED_ONE (1ll << FIXED_FRAC_BITS)
+#define FIXED_MAX ((1ll << (30 + FIXED_FRAC_BITS)) - 1)
+
+typedef i64 fixed;
+
+static inline fixed fixed_saturate(__int128 x) {
+    if (x > FIXED_MAX)
+        return FIXED_MAX;
+    if (x < -FIXED_MAX)
+        return -FIXED_MAX;
+    return (fixed) x;
+}
+
+// Rounds towards zero, NaN maps to 0
+static inline fixed fixed_from_f32(f32 f) {
+    if (f != f)
+        return 0;
+    if (f >= (f32) (1 << 30))
+        return FIXED_MAX;
+    if (f <= -(f32) (1 << 30))
+        return -FIXED_MAX;
+    return (fixed) (f * (f32) FIXED_ONE);
+}
+
+static inline f32 fixed_to_f32(fixed x) {
+    return (f32) x * (1.0f / (f32) FIXED_ONE);
+}
+
+static inline fixed fixed_mul(fixed a, fixed b) {
+    return fixed_saturate(((__int128) a * b) >> FIXED_FRAC_BITS);
+}
+
+// Division by zero saturates like the float version goes to infinity
+static inline fixed fixed_div(fixed a, fixed b) {
+    if (b == 0)
+        return (a >= 0) ? FIXED_MAX : -FIXED_MAX;
+    return fixed_saturate(((__int128) a << FIXED_FRAC_BITS) / b);
+}
+
+// Exact floor(sqrt(x)). The float estimate is off by at most one and only
+// used as a starting point, so the result doesn't depend on it.
+static inline u64 u128_sqrt(unsigned __int128 x) {
+    u64 r = (u64) sqrt((f64) x);
+    while ((unsigned __int128) r*r > x)
+        --r;
+    while ((unsigned __int128) (r + 1)*(r + 1) <= x)
+        ++r;
+    return r;
+}
+
+static inline fixed fixed_sqrt(fixed x) {
+    if (x <= 0)
+        return 0;
+    return (fixed) u128_sqrt((unsigned __int128) x << FIXED_FRAC_BITS);
+}
+
+// CORDIC, angle is in units of 2^32 per turn. Accurate to around 1e-9.
+static inline void fixed_sincos(u32 angle, fixed *s, fixed *c) {
+    // atan(2^-i) in units of 2^32 per turn
+    static const i32 atan_table[] = {
+        536870912, 316933406, 167458907, 85004756, 42667331, 21354465,
+        10679838,  5340245,   2670163,   1335087,  667544,   333772,
+        166886,    83443,     41722,     20861,    10430,    5215,
+        2608,      1304,      652,       326,      163,      81,
+        41,        20,        10,        5,        3,        1,
+    };
+    // Product of the CORDIC gains, 0.607253 in 2.30
+    const i64 gain = 652032874;
+
+    // Rotate by the nearest multiple of 90 degrees last, so CORDIC only
+    // has to cover [-45,45]
+    const u32 quadrant = ((angle + (1u << 29)) >> 30) & 3;
+    i64 z = (i32) (angle - (quadrant << 30));
+
+    i64 x = gain;
+    i64 y = 0;
+    for (u32 i = 0; i < ARRLEN(atan_table); ++i) {
+        const i64 dx = y >> i;
+        const i64 dy = x >> i;
+        if (z >= 0) {
+            x -= dx;
+            y += dy;
+            z -= atan_table[i];
+        } else {
+            x += dx;
+            y -= dy;
+            z += atan_table[i];
+        }
+    }
+
+    // 2.30 to fixed
+    x <<= FIXED_FRAC_BITS - 30;
+    y <<= FIXED_FRAC_BITS - 30;
+    switch (quadrant) {
+    case 0: *c =  x; *s =  y; break;
+    case 1: *c = -y; *s =  x; break;
+    case 2: *c = -x; *s = -y; break;
+    case 3: *c =  y; *s = -x; break;
+    }
+}
+
+//
+// Scalar simulation math, multiplies, divides and square roots in game.c
+// go through these so they're fixed-point with FIXED_POINT.
+//
+
+#if defined(FIXED_POINT)
+
+static inline f32 f32_mul(f32 a, f32 b) {
+    return fixed_to_f32(fixed_mul(fixed_from_f32(a), fixed_from_f32(b)));
+}
+
+static inline f32 f32_div(f32 a, f32 b) {
+    return fixed_to_f32(fixed_div(fixed_from_f32(a), fixed_from_f32(b)));
+}
+
+static inline f32 f32_sqrt(f32 f) {
+    return fixed_to_f32(fixed_sqrt(fixed_from_f32(f)));
+}
+
+#else
+
+static inline f32 f32_mul(f32 a, f32 b) {
+    return a*b;
+}
+
+static inline f32 f32_div(f32 a, f32 b) {
+    return a/b;
+}
+
+static inline f32 f32_sqrt(f32 f) {
+    return sqrtf(f);
+}
+
+#endif
@@ -15,7 +15,7 @@ static inline void fire_nade_projectile(struct game *game, struct player *shoote
         .dir = shooter->look,
         .start_pos = shooter->pos,
         .pos = shooter->pos,
-        .vel = 4.0f*shooter->nade_distance,
+        .vel = f32_mul(4.0f, shooter->nade_distance),
         .impact = res.impact,
         .impact_distance = res.distance,
         .impact_normal = res.normal,
@@ -31,7 +31,25 @@ static inline void fire_nade_projectile(struct game *game, struct player *shoote
 static inline void fire_hitscan_projectile(struct game *game, struct player *shooter) {
     struct player *hit_player = NULL;
     struct raycast_result map_res = raycast_map(game, shooter->pos, shooter->look);
-    struct raycast_result player_res = raycast_players(game, shooter->pos, shooter->look, &hit_player);
+    struct raycast_result player_res;
+
+#if !defined(CLIENT)
+    // Test against the players where the shooter saw them, if they are
+    // still around
+    const struct player_history_tick *history = (game->view_tick != 0) ? player_history_at(game, game->view_tick) : NULL;
+    if (history != NULL) {
+        PlayerId hit_id = HASH_MAP_INVALID_HASH;
+        player_res = raycast_player_history(history, shooter->pos, shooter->look, shooter->id, &hit_id);
+        if (player_res.hit) {
+            HashMapLookup(game->player_map, hit_id, hit_player);
+            if (hit_player == NULL)
+                player_res.hit = false;
+        }
+    } else
+#endif
+    {
+        player_res = raycast_players(game, shooter->pos, shooter->look, &hit_player);
+    }
 
     struct hitscan_projectile hitscan = {
         .player_id_from = shooter->id,
@@ -67,7 +85,7 @@ static inline void fire_hitscan_projectile(struct game *game, struct player *sho
 void update_player(struct game *game, struct player *p, struct input *input, const f32 dt) {
     f32 active_max_move_speed = max_move_speed;
     if (p->sniper_zoom > 0.0f) {
-        active_max_move_speed -= 2.5f * p->sniper_zoom;
+        active_max_move_speed -= f32_mul(2.5f, p->sniper_zoom);
     }
 
     p->look = v2normalize(input->look);
@@ -151,7 +169,7 @@ void update_player(struct game *game, struct player *p, struct input *input, con
     // Slide movement
     if (p->state == PLAYER_STATE_SLIDING) {
         if (p->time_left_in_dodge > 0.0f) {
-            p->velocity = v2add(p->velocity, v2scale(dt*dodge_acceleration, p->dodge));
+            p->velocity = v2add(p->velocity, v2scale(f32_mul(dt, dodge_acceleration), p->dodge));
             const f32 speed = v2len(p->velocity);
             if (speed > max_dodge_speed) {
                 p->velocity = v2scale(max_dodge_speed, v2normalize(p->velocity));
@@ -167,8 +185,8 @@ void update_player(struct game *game, struct player *p, struct input *input, con
 
             // Allow movement at the end of the dodge
             if (len2 > 0.0f) {
-                const f32 len = sqrtf(len2);
-                p->velocity = v2add(p->velocity, v2scale(dt*move_acceleration/len, dv));
+                const f32 len = f32_sqrt(len2);
+                p->velocity = v2add(p->velocity, v2scale(f32_div(f32_mul(dt, move_acceleration), len), dv));
             }
             const f32 new_speed = v2len(p->velocity);
             if (new_speed > speed) {
@@ -176,8 +194,9 @@ void update_player(struct game *game, struct player *p, struct input *input, con
             }
 
             if (speed > 0.0f) {
-                const f32 slowdown = fminf(speed, dt*dodge_deceleration);
-                if (speed < dt*dodge_deceleration) {
+                const f32 deceleration = f32_mul(dt, dodge_deceleration);
+                const f32 slowdown = f32_min(speed, deceleration);
+                if (speed < deceleration) {
                     p->state = PLAYER_STATE_DEFAULT;
                     p->time_left_in_dodge_delay = dodge_delay_time;
                 }
@@ -198,16 +217,16 @@ void update_player(struct game *game, struct player *p, struct input *input, con
     // Player movement
     if (p->state != PLAYER_STATE_SLIDING) {
         if (len2 > 0.0f) {
-            const f32 len = sqrtf(len2);
+            const f32 len = f32_sqrt(len2);
 
-            p->velocity = v2add(p->velocity, v2scale(dt*move_acceleration/len, dv));
+            p->velocity = v2add(p->velocity, v2scale(f32_div(f32_mul(dt, move_acceleration), len), dv));
             const f32 speed = v2len(p->velocity);
             if (speed > active_max_move_speed) {
                 p->velocity = v2scale(active_max_move_speed, v2normalize(p->velocity));
             }
 
             p->step_delay -= dt;
-            f32 new_step_delay = f32_min(step_delay / speed, step_delay);
+            f32 new_step_delay = f32_min(f32_div(step_delay, speed), step_delay);
             if (new_step_delay < p->step_delay)
                 p->step_delay = new_step_delay;
             if (p->step_delay < 0.0f) {
@@ -224,7 +243,7 @@ void update_player(struct game *game, struct player *p, struct input *input, con
             const v2 slowdown_dir = v2neg(v2normalize(p->velocity));
             const f32 speed = v2len(p->velocity);
             if (speed > 0.0f) {
-                const f32 slowdown = fminf(speed, dt*move_acceleration);
+                const f32 slowdown = f32_min(speed, f32_mul(dt, move_acceleration));
                 p->velocity = v2add(p->velocity, v2scale(slowdown, slowdown_dir));
             } else {
                 p->step_delay = 0.0f;
@@ -238,6 +257,8 @@ void update_player(struct game *game, struct player *p, struct input *input, con
     }
 }
 
+// The order of projectiles, explosions and steps doesn't matter, so expired
+// ones are replaced by the last in their list instead of shifting the rest
 void update_projectiles(struct game *game, const f32 dt) {
     ForEachList(game->hitscan_list, struct hitscan_projectile, hitscan) {
         // Emit sounds if the projectile is new
@@ -254,7 +275,7 @@ void update_projectiles(struct game *game, const f32 dt) {
         if (hitscan->time_left <= 0.0f)
             ListTagRemovePtr(game->hitscan_list, hitscan);
     }
-    ListRemoveTaggedItems(game->hitscan_list);
+    ListSwapRemoveTaggedItems(game->hitscan_list);
 
     ForEachList(game->nade_list, struct nade_projectile, nade) {
 
@@ -265,7 +286,7 @@ void update_projectiles(struct game *game, const f32 dt) {
         const v2 slowdown_dir = v2neg(v2normalize(vel));
         const f32 speed = nade->vel;
         if (speed > 0.0f) {
-            const f32 slowdown = fminf(speed, dt*nade_deceleration);
+            const f32 slowdown = f32_min(speed, f32_mul(dt, nade_deceleration));
             vel = v2add(vel, v2scale(slowdown, slowdown_dir));
             nade->vel = v2len(vel);
         }
@@ -273,7 +294,7 @@ void update_projectiles(struct game *game, const f32 dt) {
         nade->pos = v2add(nade->pos, v2scale(dt, vel));
 
         f32 dist = v2len2(v2sub(nade->pos, nade->start_pos));
-        if (dist > nade->impact_distance*nade->impact_distance) {
+        if (dist > f32_mul(nade->impact_distance, nade->impact_distance)) {
             // We've hit a wall, reflect the nade
             nade->dir = v2reflect(nade->dir, nade->impact_normal);
             nade->start_pos = v2add(nade->impact, v2scale(0.1f, nade->impact_normal));
@@ -287,7 +308,7 @@ void update_projectiles(struct game *game, const f32 dt) {
         }
 
         nade->time_left -= dt;
-        if ((u32)(nade->time_left / dt) % 64 == 0)
+        if ((u32) f32_div(nade->time_left, dt) % 64 == 0)
             ListInsert(game->sound_list, ((struct spatial_sound){nade->player_id_from, SOUND_NADE_BEEP, nade->pos}));
 
         if (nade->time_left < 0.0f) {
@@ -305,11 +326,9 @@ void update_projectiles(struct game *game, const f32 dt) {
             ListInsert(game->explosion_list, e);
 
             HashMapForEach(game->player_map, struct player, p) {
-                if (!HashMapExists(game->player_map, p))
-                    continue;
                 struct collision_result result = collide_circle_circle((struct circle) {
                                                                             .pos = p->pos,
-                                                                            .radius = 0.25f,
+                                                                            .radius = PLAYER_HIT_RADIUS,
                                                                        },
                                                                        (struct circle) {
                                                                             .pos = e.pos,
@@ -335,7 +354,7 @@ void update_projectiles(struct game *game, const f32 dt) {
             ListTagRemovePtr(game->nade_list, nade);
         }
     }
-    ListRemoveTaggedItems(game->nade_list);
+    ListSwapRemoveTaggedItems(game->nade_list);
 
     ForEachList(game->explosion_list, struct explosion, e) {
         e->time_left -= dt;
@@ -344,7 +363,7 @@ void update_projectiles(struct game *game, const f32 dt) {
             ListTagRemovePtr(game->explosion_list, e);
         }
     }
-    ListRemoveTaggedItems(game->explosion_list);
+    ListSwapRemoveTaggedItems(game->explosion_list);
 
     // I guess this is not a "projectile", but neither is an
     // explosion
@@ -355,7 +374,7 @@ void update_projectiles(struct game *game, const f32 dt) {
             ListTagRemovePtr(game->step_list, s);
         }
     }
-    ListRemoveTaggedItems(game->step_list);
+    ListSwapRemoveTaggedItems(game->step_list);
 }
 
 //
@@ -371,14 +390,14 @@ struct collision_result collide_circle_circle(struct circle c0, struct circle c1
         .colliding = false,
     };
 
-    if (center_diff_len2 > radius_sum*radius_sum)
+    if (center_diff_len2 > f32_mul(radius_sum, radius_sum))
         return result;
 
-    const f32 center_diff_len = sqrtf(center_diff_len2);
+    const f32 center_diff_len = f32_sqrt(center_diff_len2);
     const f32 overlap = radius_sum - center_diff_len;
 
     result.colliding = true;
-    result.resolve = v2scale(overlap/center_diff_len, center_diff);
+    result.resolve = v2scale(f32_div(overlap, center_diff_len), center_diff);
 
     return result;
 }
@@ -395,12 +414,12 @@ struct collision_result collide_aabb_circle(struct aabb aabb, struct circle circ
     struct collision_result result = {
         .colliding = false,
     };
-    if (circle.radius*circle.radius < dist2)
+    if (f32_mul(circle.radius, circle.radius) < dist2)
         return result;
 
-    const f32 dist = sqrtf(dist2);
+    const f32 dist = f32_sqrt(dist2);
     result.colliding = true;
-    result.resolve = v2scale(-(circle.radius-dist)/dist, nearest);
+    result.resolve = v2scale(f32_div(-(circle.radius-dist), dist), nearest);
 
     return result;
 }
@@ -409,13 +428,13 @@ struct raycast_result collide_ray_circle(v2 pos, v2 dir, struct circle circle) {
     struct raycast_result res = {0};
 
     v2 m = v2sub(pos, circle.pos);
-    f32 c = v2len2(m) - circle.radius*circle.radius;
+    f32 c = v2len2(m) - f32_mul(circle.radius, circle.radius);
     f32 b = v2dot(m, dir);
-    f32 disc = b*b - c;
+    f32 disc = f32_mul(b, b) - c;
     if (disc < 0.0f)
         return res;
 
-    f32 t = -b - sqrtf(disc);
+    f32 t = -b - f32_sqrt(disc);
     if (t < 0)
         return res;
 
@@ -450,21 +469,21 @@ struct raycast_result collide_ray_aabb(v2 pos, v2 dir, struct aabb aabb) {
     // We can simplify this
     // @OPTIMIZE
     if        (dir.y < 0 && dir.x > 0) {
-        kx = -dir.x/dir.y;
-        ky =  dir.y/dir.x;
+        kx = f32_div(-dir.x, dir.y);
+        ky = f32_div( dir.y, dir.x);
     } else if (dir.y < 0 && dir.x < 0) {
-        kx = -dir.x/dir.y;
-        ky = -dir.y/dir.x;
+        kx = f32_div(-dir.x, dir.y);
+        ky = f32_div(-dir.y, dir.x);
     } else if (dir.y > 0 && dir.x < 0) {
-        kx =  dir.x/dir.y;
-        ky = -dir.y/dir.x;
+        kx = f32_div( dir.x, dir.y);
+        ky = f32_div(-dir.y, dir.x);
     } else if (dir.y > 0 && dir.x > 0) {
-        kx =  dir.x/dir.y;
-        ky =  dir.y/dir.x;
+        kx = f32_div( dir.x, dir.y);
+        ky = f32_div( dir.y, dir.x);
     }
 
-    const f32 hit_line_y = pos.y + ky*fabsf(x - pos.x);
-    const f32 hit_line_x = pos.x + kx*fabsf(y - pos.y);
+    const f32 hit_line_y = pos.y + f32_mul(ky, fabsf(x - pos.x));
+    const f32 hit_line_x = pos.x + f32_mul(kx, fabsf(y - pos.y));
 
     const i32 hit_x = !f32_equal(dir.y, 0.0f) && hit_line_x <= x1 && hit_line_x >= x0;
     const i32 hit_y = !f32_equal(dir.x, 0.0f) && hit_line_y <= y1 && hit_line_y >= y0;
@@ -513,9 +532,113 @@ struct raycast_result collide_ray_aabb(v2 pos, v2 dir, struct aabb aabb) {
     return res;
 }
 
+// Grid traversal (Amanatides-Woo), only visits the tiles actually crossed
+// by the ray instead of testing every stone tile in the map.
 struct raycast_result raycast_map(struct game *game, v2 pos, v2 dir) {
     assert(f32_equal(v2len2(dir), 1.0f));
 
+    const struct map *m = &game->map;
+
+    struct raycast_result res = {
+        .distance = FLT_MAX,
+    };
+
+    // Work in tile units relative to the map origin, t is then measured in
+    // tiles along the ray and scaled back to world units on impact.
+    const f32 x = f32_div(pos.x - m->origin.x, m->tile_size);
+    const f32 y = f32_div(pos.y - m->origin.y, m->tile_size);
+
+    const f32 t_delta_x = (dir.x != 0.0f) ? fabsf(f32_div(1.0f, dir.x)) : FLT_MAX;
+    const f32 t_delta_y = (dir.y != 0.0f) ? fabsf(f32_div(1.0f, dir.y)) : FLT_MAX;
+    const i32 step_x = (dir.x > 0.0f) ? 1 : -1;
+    const i32 step_y = (dir.y > 0.0f) ? 1 : -1;
+
+    // If we start outside of the map, clip the ray against the map bounds
+    // and start traversal from the tile we enter.
+    f32 t = 0.0f;
+    bool entered_x = false;
+    bool check_first_tile = false;
+    if (x < 0.0f || y < 0.0f || x >= (f32) m->width || y >= (f32) m->height) {
+        f32 t_near_x = -FLT_MAX, t_far_x = FLT_MAX;
+        f32 t_near_y = -FLT_MAX, t_far_y = FLT_MAX;
+        if (dir.x != 0.0f) {
+            const f32 t0 = f32_div(0.0f - x, dir.x);
+            const f32 t1 = f32_div((f32) m->width - x, dir.x);
+            t_near_x = f32_min(t0, t1);
+            t_far_x  = f32_max(t0, t1);
+        } else if (x < 0.0f || x >= (f32) m->width) {
+            return res;
+        }
+        if (dir.y != 0.0f) {
+            const f32 t0 = f32_div(0.0f - y, dir.y);
+            const f32 t1 = f32_div((f32) m->height - y, dir.y);
+            t_near_y = f32_min(t0, t1);
+            t_far_y  = f32_max(t0, t1);
+        } else if (y < 0.0f || y >= (f32) m->height) {
+            return res;
+        }
+
+        t = f32_max(t_near_x, t_near_y);
+        if (t < 0.0f || t > f32_min(t_far_x, t_far_y))
+            return res;
+
+        entered_x = t_near_x > t_near_y;
+        check_first_tile = true;
+    }
+
+    const f32 start_x = x + f32_mul(t, dir.x);
+    const f32 start_y = y + f32_mul(t, dir.y);
+    i32 i = (i32) f32_clamp(floorf(start_x), 0.0f, (f32) m->width  - 1.0f);
+    i32 j = (i32) f32_clamp(floorf(start_y), 0.0f, (f32) m->height - 1.0f);
+
+    // Distance along the ray to the next vertical/horizontal tile boundary
+    f32 t_max_x = FLT_MAX;
+    f32 t_max_y = FLT_MAX;
+    if (dir.x > 0.0f)
+        t_max_x = t + f32_mul((f32) (i + 1) - start_x, t_delta_x);
+    else if (dir.x < 0.0f)
+        t_max_x = t + f32_mul(start_x - (f32) i, t_delta_x);
+    if (dir.y > 0.0f)
+        t_max_y = t + f32_mul((f32) (j + 1) - start_y, t_delta_y);
+    else if (dir.y < 0.0f)
+        t_max_y = t + f32_mul(start_y - (f32) j, t_delta_y);
+
+    // A ray starting inside a stone tile is allowed to leave it, which
+    // matches how collide_ray_aabb ignores boxes containing the ray origin.
+    while (true) {
+        if (check_first_tile && m->data[j*m->width + i] == TILE_STONE) {
+            const f32 distance = f32_mul(t, m->tile_size);
+            res.hit = true;
+            res.distance = distance;
+            res.impact = v2add(pos, v2scale(distance, dir));
+            res.normal = (entered_x) ? (v2) {(f32) -step_x, 0.0f} :
+                                       (v2) {0.0f, (f32) -step_y};
+            return res;
+        }
+        check_first_tile = true;
+
+        if (t_max_x < t_max_y) {
+            i += step_x;
+            t = t_max_x;
+            t_max_x += t_delta_x;
+            entered_x = true;
+        } else {
+            j += step_y;
+            t = t_max_y;
+            t_max_y += t_delta_y;
+            entered_x = false;
+        }
+
+        if (i < 0 || i >= (i32) m->width || j < 0 || j >= (i32) m->height)
+            return res;
+    }
+}
+
+// Tests the ray against every stone tile in the map, kept around as a
+// reference for raycast_map.
+struct raycast_result raycast_map_brute_force(struct game *game, v2 pos, v2 dir) {
+    assert(f32_equal(v2len2(dir), 1.0f));
+
     struct raycast_result smallest_res = {
         .distance = FLT_MAX,
     };
@@ -527,8 +650,8 @@ struct raycast_result raycast_map(struct game *game, v2 pos, v2 dir) {
                 continue;
             struct aabb aabb = {
                 .pos = (v2) {
-                    .x = game->map.origin.x + i*game->map.tile_size,
-                    .y = game->map.origin.y + j*game->map.tile_size,
+                    .x = game->map.origin.x + f32_mul(i, game->map.tile_size),
+                    .y = game->map.origin.y + f32_mul(j, game->map.tile_size),
                 },
                 .width = game->map.tile_size,
                 .height = game->map.tile_size,
@@ -553,11 +676,9 @@ struct raycast_result raycast_players(struct game *game, v2 pos, v2 dir, struct
     };
 
     HashMapForEach(game->player_map, struct player, p) {
-        if (!HashMapExists(game->player_map, p))
-            continue;
         struct circle c = {
             .pos = p->pos,
-            .radius = 0.25f,
+            .radius = PLAYER_HIT_RADIUS,
         };
 
         struct raycast_result res = collide_ray_circle(pos, dir, c);
@@ -571,6 +692,60 @@ struct raycast_result raycast_players(struct game *game, v2 pos, v2 dir, struct
     return smallest_res;
 }
 
+#if !defined(CLIENT)
+
+// Call once per tick after all inputs have been applied
+void player_history_record(struct game *game, u64 sim_tick) {
+    struct player_history_tick *h = &game->history.ticks[sim_tick % LAG_COMPENSATION_TICKS];
+    h->sim_tick = sim_tick;
+    h->num_players = 0;
+
+    assert(game->player_map.num_items <= MAX_PLAYERS_PER_MATCH);
+    HashMapForEach(game->player_map, struct player, p) {
+        h->players[h->num_players++] = (struct player_history_entry) {
+            .id = p->id,
+            .pos = p->pos,
+            .radius = PLAYER_HIT_RADIUS,
+        };
+    }
+}
+
+// NULL if sim_tick has fallen out of the history or wasn't recorded
+const struct player_history_tick *player_history_at(const struct game *game, u64 sim_tick) {
+    const struct player_history_tick *h = &game->history.ticks[sim_tick % LAG_COMPENSATION_TICKS];
+    return (h->sim_tick == sim_tick) ? h : NULL;
+}
+
+// Same as raycast_players against the players of a history tick
+struct raycast_result raycast_player_history(const struct player_history_tick *h, v2 pos, v2 dir, PlayerId exclude, PlayerId *hit_id) {
+    assert(f32_equal(v2len2(dir), 1.0f));
+
+    struct raycast_result smallest_res = {
+        .distance = FLT_MAX,
+    };
+
+    for (u32 i = 0; i < h->num_players; ++i) {
+        const struct player_history_entry *e = &h->players[i];
+        if (e->id == exclude)
+            continue;
+        struct circle c = {
+            .pos = e->pos,
+            .radius = e->radius,
+        };
+
+        struct raycast_result res = collide_ray_circle(pos, dir, c);
+        if (res.hit && res.distance < smallest_res.distance) {
+            smallest_res = res;
+            *hit_id = e->id;
+        }
+    }
+
+    smallest_res.hit = smallest_res.distance != FLT_MAX;
+    return smallest_res;
+}
+
+#endif
+
 void collect_and_resolve_static_collisions_for_player(struct game *game, struct player *p) {
     const v2 tile_offsets[8] = {
         {+1,  0},
@@ -589,8 +764,6 @@ void collect_and_resolve_static_collisions_for_player(struct game *game, struct
         if (tile != TILE_STONE)
             continue;
 
-        // TODO(anjo): Get collision shape from player instead!
-        const f32 radius = 0.25f;
         struct collision_result result = collide_aabb_circle((struct aabb) {
                                                                  .pos = {floorf(at.x), floorf(at.y)},
                                                                  .width = game->map.tile_size,
@@ -598,7 +771,7 @@ void collect_and_resolve_static_collisions_for_player(struct game *game, struct
                                                              },
                                                              (struct circle) {
                                                                  .pos = p->pos,
-                                                                 .radius = radius,
+                                                                 .radius = PLAYER_HIT_RADIUS,
                                                              });
         if (!result.colliding)
             continue;
@@ -626,8 +799,6 @@ void collect_and_resolve_static_collisions_for_player(struct game *game, struct
 
 void collect_and_resolve_static_collisions(struct game *game) {
     HashMapForEach(game->player_map, struct player, p) {
-        if (!HashMapExists(game->player_map, p))
-            continue;
         collect_and_resolve_static_collisions_for_player(game, p);
     }
 }
@@ -637,8 +808,6 @@ void collect_dynamic_collisions(struct game *game, struct collision_result *resu
     //struct player *players[game->player_map.num_items];
     //size_t index = 0;
     //HashMapForEach(game->player_map, struct player, p) {
-    //    if (!HashMapExists(game->player_map, p))
-    //        continue;
     //    players[index++] = p;
     //}
 
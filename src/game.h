@@ -3,6 +3,7 @@
 #include "common.h"
 #include "audio.h"
 #include "v2.h"
+#include "hash_map.h"
 
 #include <string.h>
 #include <assert.h>
@@ -76,6 +77,10 @@ enum player_weapon {
 
 typedef u64 PlayerId;
 
+// Players are circles of this radius when colliding with the map,
+// explosions and hitscan
+#define PLAYER_HIT_RADIUS 0.25f
+
 Pack(struct player {
     PlayerId id;
 
@@ -124,28 +129,25 @@ struct map {
     v2 origin;
 };
 
-static struct map map = {
-#if 0
-    .data = (const u8 *) "################"
-                         "#              #"
-                         "#              #"
-                         "#  ###    ###  #"
-                         "#  #        #  #"
-                         "#  #        #  #"
-                         "#      ##      #"
-                         "#  #        #  #"
-                         "#  #        #  #"
-                         "#      ##      #"
-                         "#  #        #  #"
-                         "#  #        #  #"
-                         "#  ###    ###  #"
-                         "#              #"
-                         "#              #"
-                         "################",
-    .width = 16,
-    .height = 16,
-#elif 1
-     .data = (const u8 *)
+static const u8 map_data_small[] =
+"################"
+"#              #"
+"#              #"
+"#  ###    ###  #"
+"#  #        #  #"
+"#  #        #  #"
+"#      ##      #"
+"#  #        #  #"
+"#  #        #  #"
+"#      ##      #"
+"#  #        #  #"
+"#  #        #  #"
+"#  ###    ###  #"
+"#              #"
+"#              #"
+"################";
+
+static const u8 map_data_medium[] =
 "##############################"
 "#                            #"
 "#                            #"
@@ -175,11 +177,9 @@ static struct map map = {
 "#                            #"
 "#                            #"
 "#                            #"
-"##############################",
-    .width = 30,
-    .height = 30,
-#elif 0
-     .data = (const u8 *)
+"##############################";
+
+static const u8 map_data_large[] =
 "####################################"
 "#                           ##     #"
 "#                           ##     #"
@@ -215,13 +215,18 @@ static struct map map = {
 "#        #     #                   #"
 "#        #                  #      #"
 "#                                  #"
-"####################################",
-    .width = 36,
-    .height = 36,
-#endif
-    .tile_size = 1.0f,
-    .origin = {0, 0},
-};
+"####################################";
+
+#define MAP_INIT(map_data, map_width, map_height) \
+    {                                              \
+        .data = map_data,                          \
+        .width = map_width,                        \
+        .height = map_height,                      \
+        .tile_size = 1.0f,                         \
+        .origin = {0, 0},                          \
+    }
+
+static struct map map = MAP_INIT(map_data_medium, 30, 30);
 
 static inline bool map_coord_in_bounds(const struct map *map, i32 i, i32 j) {
     return i >= 0 && i <= map->width &&
@@ -229,8 +234,8 @@ static inline bool map_coord_in_bounds(const struct map *map, i32 i, i32 j) {
 }
 
 static inline void map_coord(const struct map *map, i32 *i, i32 *j, v2 at) {
-    *i = (at.x - map->origin.x)/map->tile_size;
-    *j = (at.y - map->origin.y)/map->tile_size;
+    *i = f32_div(at.x - map->origin.x, map->tile_size);
+    *j = f32_div(at.y - map->origin.y, map->tile_size);
 }
 
 static inline u8 map_at(const struct map *map, v2 at) {
@@ -281,77 +286,14 @@ struct damage_entry {
 };
 
 //
-// Hash map
+// Players
 //
 
-enum {
-    HASH_MAP_INVALID_HASH = 0,
-};
-
 static inline PlayerId player_id() {
     static PlayerId id = HASH_MAP_INVALID_HASH + 1;
     return id++;
 }
 
-#define HashMap(type, size)     \
-    struct {                    \
-        type data[size];        \
-        size_t occupied[size];  \
-        size_t num_items;       \
-    }
-
-#define HashMapForEach(map, type, iter) \
-    for (type *iter = &map.data[0], *_top = &map.data[ARRLEN(map.data)]; iter != _top; ++iter)
-
-#define HashMapExists(map, ptr) \
-    (map.occupied[ArrayPtrToIndex(map.data, ptr)] != HASH_MAP_INVALID_HASH)
-
-#define HashMapInsert(map, hash, output_value)                          \
-    do {                                                                \
-        assert(map.num_items < ARRLEN(map.data));                       \
-                                                                        \
-        /* Since num_items is less than the size of the data */         \
-        /* array, we will eventually find a slot */                     \
-        size_t index = hash % ARRLEN(map.data);                         \
-        while (map.occupied[index] != HASH_MAP_INVALID_HASH) {          \
-            index = (index + 1) % ARRLEN(map.data);                     \
-        }                                                               \
-                                                                        \
-        /* Store our player */                                          \
-        memset(&map.data[index], 0, sizeof(map.data[index]));           \
-        map.data[index].id = hash;                                      \
-        map.occupied[index] = hash;                                     \
-        ++map.num_items;                                                \
-                                                                        \
-        output_value = &map.data[index];                                \
-    } while (0)
-
-#define HashMapLookup(map, hash, output_value)                          \
-    do {                                                                \
-        assert(hash != HASH_MAP_INVALID_HASH);                          \
-        bool found = false;                                             \
-        size_t index = HASH_MAP_INVALID_HASH;                           \
-        for (size_t offset = 0; offset < ARRLEN(map.data); ++offset) {  \
-            index = (hash + offset) % ARRLEN(map.data);                 \
-            if (map.occupied[index] == hash) {                          \
-                found = true;                                           \
-                break;                                                  \
-            }                                                           \
-        }                                                               \
-                                                                        \
-        output_value =  &map.data[index];                               \
-    } while (0)
-
-#define HashMapRemove(map, hash)                                        \
-    do {                                                                \
-        void *_p = NULL;                                                \
-        HashMapLookup(map, hash, _p);                                   \
-        assert(_p != NULL);                                             \
-                                                                        \
-        size_t index = ArrayPtrToIndex(map.data, _p);                   \
-        map.occupied[index] = HASH_MAP_INVALID_HASH;                    \
-        --map.num_items;                                                \
-    } while (0)
 //
 // Frame stuff
 //
@@ -382,7 +324,9 @@ struct frame_debug_data {
 // Game
 //
 
-#define PLAYER_HASH_MAP_SIZE 16
+// The player map grows as needed, this only bounds arrays with an entry
+// per player such as the lag compensation history and server snapshots
+#define MAX_PLAYERS_PER_MATCH 16
 #define MAX_PROJECTILES 64
 #define MAX_HITSCAN_PROJECTILES 64
 #define MAX_SOUNDS_PER_FRAME 64
@@ -400,10 +344,54 @@ struct step {
     f32 time_left;
 };
 
+//
+// Lag compensation
+//
+// The server keeps the hit circle of every player for the last
+// LAG_COMPENSATION_TICKS ticks. While view_tick is set hitscan is tested
+// against the circles at that tick instead of the current positions, so
+// shooters hit what they saw instead of having to lead targets by their
+// own latency. Rewinding only reads one row of the history, the game
+// itself is never copied or modified.
+//
+
+#define LAG_COMPENSATION_TICKS 32
+// Furthest back a shot is rewound, 200 ms. Has to be less than
+// LAG_COMPENSATION_TICKS.
+#define LAG_COMPENSATION_MAX_TICKS (FPS/5)
+
+struct player_history_entry {
+    PlayerId id;
+    v2 pos;
+    f32 radius;
+};
+
+struct player_history_tick {
+    u64 sim_tick;
+    u32 num_players;
+    struct player_history_entry players[MAX_PLAYERS_PER_MATCH];
+};
+
+struct player_history {
+    struct player_history_tick ticks[LAG_COMPENSATION_TICKS];
+};
+
+// Tick to rewind an input for client_sim_tick to, given how many ticks
+// behind it the client saw other players. Clamped to the compensation
+// window, 0 if there is nothing to rewind.
+static inline u64 lag_compensation_view_tick(u64 sim_tick, u64 client_sim_tick, u16 view_delay) {
+    u64 view_tick = (client_sim_tick > view_delay) ? client_sim_tick - view_delay : 0;
+    if (view_tick + LAG_COMPENSATION_MAX_TICKS < sim_tick)
+        view_tick = sim_tick - LAG_COMPENSATION_MAX_TICKS;
+    if (view_tick >= sim_tick)
+        return 0;
+    return view_tick;
+}
+
 struct game {
     struct map map;
 
-    HashMap(struct player, PLAYER_HASH_MAP_SIZE) player_map;
+    HashMap(struct player) player_map;
 
     List(struct hitscan_projectile, MAX_HITSCAN_PROJECTILES) hitscan_list;
     List(struct nade_projectile,    MAX_HITSCAN_PROJECTILES) nade_list;
@@ -419,6 +407,13 @@ struct game {
     // and send to clients
     List(struct hitscan_projectile, MAX_HITSCAN_PROJECTILES) new_hitscan_list;
     List(struct nade_projectile,    MAX_HITSCAN_PROJECTILES) new_nade_list;
+
+#if !defined(CLIENT)
+    // Server only, see lag compensation. view_tick is set while applying
+    // an input and 0 otherwise.
+    struct player_history history;
+    u64 view_tick;
+#endif
 };
 
 //
@@ -462,8 +457,15 @@ struct collision_result collide_aabb_circle(struct aabb aabb, struct circle circ
 struct raycast_result   collide_ray_circle(v2 pos, v2 dir, struct circle circle);
 struct raycast_result   collide_ray_aabb(v2 pos, v2 dir, struct aabb aabb);
 struct raycast_result   raycast_map(struct game *game, v2 pos, v2 dir);
+struct raycast_result   raycast_map_brute_force(struct game *game, v2 pos, v2 dir);
 struct raycast_result   raycast_players(struct game *game, v2 pos, v2 dir, struct player **hit_player);
 
+#if !defined(CLIENT)
+void player_history_record(struct game *game, u64 sim_tick);
+const struct player_history_tick *player_history_at(const struct game *game, u64 sim_tick);
+struct raycast_result raycast_player_history(const struct player_history_tick *h, v2 pos, v2 dir, PlayerId exclude, PlayerId *hit_id);
+#endif
+
 void collect_and_resolve_static_collisions_for_player(struct game *game, struct player *p);
 void collect_and_resolve_static_collisions(struct game *game);
 void collect_dynamic_collisions(struct game *game, struct collision_result *results, u32 *num_results, u32 max_results);
@@ -0,0 +1,223 @@
+#pragma once
+
+#include "common.h"
+
+//
+// Hash map
+//
+// Growable map from non-zero u64 ids to values of any type with an id
+// field. Values are stored densely in data[0..num_items), so iterating is
+// a plain loop with no empty slots to skip. Removing a value moves the
+// last one into its place, so iteration order only depends on the order
+// of inserts and removes.
+//
+// Ids are found through a separate index of slots using Robin Hood
+// hashing. Every slot knows how far it is from its home slot, inserts
+// take the place of any slot closer to home than themselves, and a
+// lookup can stop as soon as it passes a slot closer to home than it
+// would be, so misses are as cheap as hits. Removes shift the following
+// slots back one step instead of leaving tombstones. The index is kept at
+// most 3/4 full and is grown if a probe ever gets longer than
+// HASH_MAP_MAX_PROBE.
+//
+// Inserts and removes move values, so pointers into the map are only
+// valid until the next one.
+//
+
+#define HASH_MAP_INITIAL_SIZE 16
+#define HASH_MAP_MAX_PROBE 16
+
+enum {
+    HASH_MAP_INVALID_HASH = 0,
+};
+
+struct hash_map_slot {
+    u64 key;
+    u32 index;
+    // Distance from the home slot, only valid if key is set
+    u32 dist;
+};
+
+struct hash_map_base {
+    void *data;
+    u32 num_items;
+    u32 capacity;
+    // Key of each value in data
+    u64 *keys;
+    struct hash_map_slot *slots;
+    // Power of two, 0 until the first insert
+    u32 num_slots;
+};
+
+#define HashMap(type)                   \
+    union {                             \
+        struct hash_map_base base;      \
+        struct {                        \
+            type *data;                 \
+            u32 num_items;              \
+        };                              \
+    }
+
+static inline u32 hash_map_home(const struct hash_map_base *m, u64 key) {
+    // Fibonacci hashing, ids are mostly sequential. Taking the top bits
+    // spreads consecutive ids evenly over the slots so they all land in
+    // their home slot, lower bits of the product collide a lot more and
+    // every probe past the home slot is a likely branch miss on lookup.
+    return (u32) ((key * 0x9e3779b97f4a7c15ull) >> (64 - (u32) __builtin_ctz(m->num_slots)));
+}
+
+// Returns the probe length
+static inline u32 hash_map_index_insert(struct hash_map_base *m, u64 key, u32 index) {
+    const u32 mask = m->num_slots - 1;
+    struct hash_map_slot slot = {
+        .key = key,
+        .index = index,
+        .dist = 0,
+    };
+
+    u32 i = hash_map_home(m, key);
+    u32 max_dist = 0;
+    while (m->slots[i].key != HASH_MAP_INVALID_HASH) {
+        assert(m->slots[i].key != slot.key);
+        if (m->slots[i].dist < slot.dist) {
+            const struct hash_map_slot tmp = m->slots[i];
+            m->slots[i] = slot;
+            slot = tmp;
+        }
+        i = (i + 1) & mask;
+        ++slot.dist;
+        if (slot.dist > max_dist)
+            max_dist = slot.dist;
+    }
+    m->slots[i] = slot;
+    return max_dist;
+}
+
+static inline void hash_map_rehash(struct hash_map_base *m, u32 num_slots) {
+    struct hash_map_slot *old_slots = m->slots;
+    const u32 old_num_slots = m->num_slots;
+
+    m->slots = calloc(num_slots, sizeof(struct hash_map_slot));
+    assert(m->slots);
+    m->num_slots = num_slots;
+
+    u32 max_dist = 0;
+    for (u32 i = 0; i < old_num_slots; ++i) {
+        if (old_slots[i].key == HASH_MAP_INVALID_HASH)
+            continue;
+        const u32 dist = hash_map_index_insert(m, old_slots[i].key, old_slots[i].index);
+        if (dist > max_dist)
+            max_dist = dist;
+    }
+    free(old_slots);
+
+    // Extremely unlikely with Fibonacci hashing, but keeps probes bounded
+    if (max_dist > HASH_MAP_MAX_PROBE)
+        hash_map_rehash(m, 2*num_slots);
+}
+
+// Slot of key, or -1
+static inline i64 hash_map_find_slot(const struct hash_map_base *m, u64 key) {
+    assert(key != HASH_MAP_INVALID_HASH);
+    if (m->num_slots == 0)
+        return -1;
+
+    const u32 mask = m->num_slots - 1;
+    u32 i = hash_map_home(m, key);
+    for (u32 dist = 0; ; ++dist) {
+        const struct hash_map_slot *s = &m->slots[i];
+        if (s->key == key)
+            return i;
+        // Empty, or key would have taken this slot
+        if (s->key == HASH_MAP_INVALID_HASH || s->dist < dist)
+            return -1;
+        i = (i + 1) & mask;
+    }
+}
+
+// Index into data of key, or -1
+static inline i64 hash_map_find(const struct hash_map_base *m, u64 key) {
+    const i64 slot = hash_map_find_slot(m, key);
+    return (slot >= 0) ? (i64) m->slots[slot].index : -1;
+}
+
+// Adds key and returns the index of its zeroed value, key must not
+// already be in the map
+static inline u32 hash_map_insert(struct hash_map_base *m, size_t size, u64 key) {
+    assert(key != HASH_MAP_INVALID_HASH);
+
+    if (m->num_items == m->capacity) {
+        m->capacity = (m->capacity == 0) ? HASH_MAP_INITIAL_SIZE : 2*m->capacity;
+        m->data = realloc(m->data, m->capacity*size);
+        m->keys = realloc(m->keys, m->capacity*sizeof(u64));
+        assert(m->data && m->keys);
+    }
+    if (4*(m->num_items + 1) > 3*m->num_slots)
+        hash_map_rehash(m, (m->num_slots == 0) ? 2*HASH_MAP_INITIAL_SIZE : 2*m->num_slots);
+
+    const u32 index = m->num_items++;
+    memset((u8 *) m->data + index*size, 0, size);
+    m->keys[index] = key;
+    if (hash_map_index_insert(m, key, index) > HASH_MAP_MAX_PROBE)
+        hash_map_rehash(m, 2*m->num_slots);
+    return index;
+}
+
+// Removes key, which must be in the map, and moves the last value into
+// its place
+static inline void hash_map_remove(struct hash_map_base *m, size_t size, u64 key) {
+    const i64 found = hash_map_find_slot(m, key);
+    assert(found >= 0);
+
+    const u32 mask = m->num_slots - 1;
+    const u32 index = m->slots[found].index;
+
+    // Backward shift the following slots that aren't in their home slot
+    u32 i = (u32) found;
+    u32 next = (i + 1) & mask;
+    while (m->slots[next].key != HASH_MAP_INVALID_HASH && m->slots[next].dist > 0) {
+        m->slots[i] = m->slots[next];
+        --m->slots[i].dist;
+        i = next;
+        next = (next + 1) & mask;
+    }
+    m->slots[i] = (struct hash_map_slot) {0};
+
+    const u32 last = --m->num_items;
+    if (index != last) {
+        u8 *data = m->data;
+        memcpy(data + index*size, data + last*size, size);
+        m->keys[index] = m->keys[last];
+        m->slots[hash_map_find_slot(m, m->keys[index])].index = index;
+    }
+}
+
+static inline void hash_map_free(struct hash_map_base *m) {
+    free(m->data);
+    free(m->keys);
+    free(m->slots);
+    *m = (struct hash_map_base) {0};
+}
+
+#define HashMapInsert(map, hash, output_value)                                  \
+    do {                                                                        \
+        const u32 _index = hash_map_insert(&(map).base, sizeof((map).data[0]), hash); \
+        output_value = &(map).data[_index];                                     \
+        output_value->id = hash;                                                \
+    } while (0)
+
+// output_value is NULL if hash isn't in the map
+#define HashMapLookup(map, hash, output_value)                                  \
+    do {                                                                        \
+        const i64 _index = hash_map_find(&(map).base, hash);                    \
+        output_value = (_index >= 0) ? &(map).data[_index] : NULL;              \
+    } while (0)
+
+#define HashMapRemove(map, hash) \
+    hash_map_remove(&(map).base, sizeof((map).data[0]), hash)
+
+#define HashMapFree(map) \
+    hash_map_free(&(map).base)
+
+#define HashMapForEach(map, type, iter) \
+    for (type *iter = (map).data, *_top = (map).data + (map).num_items; iter != _top; ++iter)
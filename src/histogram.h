@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common.h"
+
+//
+// Histogram
+//
+// Log-linear histogram in the style of HdrHistogram: values below
+// HISTOGRAM_SUB_BUCKETS get a bucket each, above that every power of two
+// is split into HISTOGRAM_SUB_BUCKETS linear buckets. Recording is a clz
+// and an increment, and percentiles are accurate to within 1/8 of the
+// value over the whole u64 range, which is plenty for timings in ns.
+//
+
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    u64 count;
+    u64 sum;
+    u64 max;
+    u32 buckets[HISTOGRAM_BUCKETS];
+};
+
+static inline u32 histogram_index(u64 value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (u32) value;
+    const u32 msb = 63 - __builtin_clzll(value);
+    const u32 shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+    const u32 sub = (u32) (value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (shift + 1)*HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Largest value that maps to bucket index
+static inline u64 histogram_bucket_max(u32 index) {
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+    const u32 shift = index/HISTOGRAM_SUB_BUCKETS - 1;
+    const u64 sub = index % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static inline void histogram_record(struct histogram *h, u64 value) {
+    ++h->buckets[histogram_index(value)];
+    ++h->count;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+static inline void histogram_reset(struct histogram *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+// p in [0,1]
+static inline u64 histogram_percentile(const struct histogram *h, f64 p) {
+    if (h->count == 0)
+        return 0;
+    u64 target = (u64) (p*h->count + 0.5);
+    if (target == 0)
+        target = 1;
+    u64 seen = 0;
+    for (u32 i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            const u64 value = histogram_bucket_max(i);
+            return (value < h->max) ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+static inline f64 histogram_mean(const struct histogram *h) {
+    return (h->count > 0) ? (f64) h->sum / (f64) h->count : 0.0;
+}
@@ -0,0 +1,334 @@
+#pragma once
+
+#include "common.h"
+#include "game.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+//
+// Area of interest
+//
+// The map is divided into square cells of INTEREST_CELL_SIZE tiles. Every
+// network tick the server rebuilds which players are in which cell, and
+// each peer keeps a set of cells it is interested in around its player.
+// Players and events outside of those cells are not sent to the peer.
+//
+// Cells enter the set when they are within radius cells of the player's
+// cell (Chebyshev distance), but are only dropped once they are further
+// away than radius + hysteresis, so players walking back and forth over a
+// cell boundary don't make others flicker in and out of view.
+//
+
+#define INTEREST_CELL_SIZE 8
+#define INTEREST_RADIUS 2
+#define INTEREST_HYSTERESIS 1
+#define INTEREST_INVALID_CELL UINT32_MAX
+
+struct interest_grid {
+    v2 origin;
+    f32 cell_size;
+    u32 width;
+    u32 height;
+    u32 num_cells;
+    u32 num_words;
+
+    u32 radius;
+    u32 hysteresis;
+
+    // Players added since the last interest_grid_build
+    PlayerId added_ids[MAX_CLIENTS];
+    u32 added_cells[MAX_CLIENTS];
+    u32 num_added;
+
+    // Players sorted by cell, players in cell c are stored in
+    // members[cell_start[c]] to members[cell_start[c+1]-1].
+    u32 *cell_start;
+    PlayerId members[MAX_CLIENTS];
+    u32 num_members;
+};
+
+struct interest {
+    // Bitset of num_cells bits
+    u64 *cells;
+    u32 center;
+
+    // Players sent to the peer last network tick, sorted by id
+    PlayerId visible[MAX_CLIENTS];
+    u32 num_visible;
+};
+
+static inline struct interest_grid interest_grid_init(const struct map *m, f32 cell_size_in_tiles, u32 radius, u32 hysteresis) {
+    struct interest_grid g = {
+        .origin = m->origin,
+        .cell_size = cell_size_in_tiles*m->tile_size,
+        .width  = (m->width  + (u32) cell_size_in_tiles - 1)/(u32) cell_size_in_tiles,
+        .height = (m->height + (u32) cell_size_in_tiles - 1)/(u32) cell_size_in_tiles,
+        .radius = radius,
+        .hysteresis = hysteresis,
+    };
+    g.num_cells = g.width*g.height;
+    g.num_words = (g.num_cells + 63)/64;
+    g.cell_start = calloc(g.num_cells + 1, sizeof(u32));
+    assert(g.cell_start);
+    return g;
+}
+
+static inline void interest_grid_free(struct interest_grid *g) {
+    free(g->cell_start);
+    g->cell_start = NULL;
+}
+
+static inline u32 interest_cell_at(const struct interest_grid *g, v2 pos) {
+    const i32 i = (i32) floorf((pos.x - g->origin.x)/g->cell_size);
+    const i32 j = (i32) floorf((pos.y - g->origin.y)/g->cell_size);
+    // Anything outside of the map is clamped to the closest cell
+    const u32 ci = (u32) ((i < 0) ? 0 : (i >= (i32) g->width)  ? (i32) g->width  - 1 : i);
+    const u32 cj = (u32) ((j < 0) ? 0 : (j >= (i32) g->height) ? (i32) g->height - 1 : j);
+    return cj*g->width + ci;
+}
+
+static inline u32 interest_cell_distance(const struct interest_grid *g, u32 a, u32 b) {
+    const i32 di = (i32) (a % g->width) - (i32) (b % g->width);
+    const i32 dj = (i32) (a / g->width) - (i32) (b / g->width);
+    const u32 adi = (u32) ((di < 0) ? -di : di);
+    const u32 adj = (u32) ((dj < 0) ? -dj : dj);
+    return (adi > adj) ? adi : adj;
+}
+
+static inline void interest_grid_begin(struct interest_grid *g) {
+    g->num_added = 0;
+}
+
+static inline void interest_grid_add(struct interest_grid *g, PlayerId id, v2 pos) {
+    assert(g->num_added < MAX_CLIENTS);
+    g->added_ids[g->num_added] = id;
+    g->added_cells[g->num_added] = interest_cell_at(g, pos);
+    ++g->num_added;
+}
+
+// Counting sort of the added players by cell
+static inline void interest_grid_build(struct interest_grid *g) {
+    memset(g->cell_start, 0, (g->num_cells + 1)*sizeof(u32));
+    for (u32 i = 0; i < g->num_added; ++i)
+        ++g->cell_start[g->added_cells[i] + 1];
+    for (u32 c = 0; c < g->num_cells; ++c)
+        g->cell_start[c + 1] += g->cell_start[c];
+
+    // cell_start[c] is used as the insertion point for cell c and ends up
+    // at the start of cell c+1, shift back afterwards.
+    for (u32 i = 0; i < g->num_added; ++i)
+        g->members[g->cell_start[g->added_cells[i]]++] = g->added_ids[i];
+    for (u32 c = g->num_cells; c > 0; --c)
+        g->cell_start[c] = g->cell_start[c - 1];
+    g->cell_start[0] = 0;
+
+    g->num_members = g->num_added;
+}
+
+static inline struct interest interest_alloc(const struct interest_grid *g) {
+    struct interest in = {
+        .cells = calloc(g->num_words, sizeof(u64)),
+        .center = INTEREST_INVALID_CELL,
+    };
+    assert(in.cells);
+    return in;
+}
+
+static inline void interest_free(struct interest *in) {
+    free(in->cells);
+    in->cells = NULL;
+}
+
+static inline bool interest_contains(const struct interest *in, u32 cell) {
+    return cell != INTEREST_INVALID_CELL && (in->cells[cell / 64] >> (cell % 64)) & 1;
+}
+
+// Updates the set of interesting cells around pos, returns true if the set
+// changed.
+static inline bool interest_update(const struct interest_grid *g, struct interest *in, v2 pos) {
+    const u32 center = interest_cell_at(g, pos);
+    if (center == in->center)
+        return false;
+    in->center = center;
+
+    // Drop cells that are now too far away
+    const u32 keep = g->radius + g->hysteresis;
+    for (u32 w = 0; w < g->num_words; ++w) {
+        u64 bits = in->cells[w];
+        while (bits) {
+            const u32 cell = w*64 + (u32) __builtin_ctzll(bits);
+            bits &= bits - 1;
+            if (interest_cell_distance(g, cell, center) > keep)
+                in->cells[w] &= ~(1ull << (cell % 64));
+        }
+    }
+
+    // Add the cells within radius
+    const i32 ci = (i32) (center % g->width);
+    const i32 cj = (i32) (center / g->width);
+    const i32 r = (i32) g->radius;
+    for (i32 j = cj - r; j <= cj + r; ++j) {
+        if (j < 0 || j >= (i32) g->height)
+            continue;
+        for (i32 i = ci - r; i <= ci + r; ++i) {
+            if (i < 0 || i >= (i32) g->width)
+                continue;
+            const u32 cell = (u32) j*g->width + (u32) i;
+            in->cells[cell / 64] |= 1ull << (cell % 64);
+        }
+    }
+
+    return true;
+}
+
+static inline int interest_compare_ids(const void *a, const void *b) {
+    const PlayerId x = *(const PlayerId *) a;
+    const PlayerId y = *(const PlayerId *) b;
+    return (x > y) - (x < y);
+}
+
+// Collects the players in the interesting cells of in, excluding self_id,
+// sorted by id. Players that weren't visible the last call are written to
+// entered, and players that were visible but aren't anymore to left.
+static inline u32 interest_collect(const struct interest_grid *g, struct interest *in, PlayerId self_id,
+                                   PlayerId *entered, u32 *num_entered,
+                                   PlayerId *left, u32 *num_left) {
+    PlayerId visible[MAX_CLIENTS];
+    u32 num_visible = 0;
+
+    for (u32 w = 0; w < g->num_words; ++w) {
+        u64 bits = in->cells[w];
+        while (bits) {
+            const u32 cell = w*64 + (u32) __builtin_ctzll(bits);
+            bits &= bits - 1;
+            for (u32 k = g->cell_start[cell]; k < g->cell_start[cell + 1]; ++k) {
+                if (g->members[k] != self_id)
+                    visible[num_visible++] = g->members[k];
+            }
+        }
+    }
+    qsort(visible, num_visible, sizeof(visible[0]), interest_compare_ids);
+
+    // Merge with the previous set to find players that entered or left
+    *num_entered = 0;
+    *num_left = 0;
+    u32 i = 0;
+    u32 j = 0;
+    while (i < in->num_visible || j < num_visible) {
+        if (j == num_visible || (i < in->num_visible && in->visible[i] < visible[j])) {
+            left[(*num_left)++] = in->visible[i++];
+        } else if (i == in->num_visible || visible[j] < in->visible[i]) {
+            entered[(*num_entered)++] = visible[j++];
+        } else {
+            ++i;
+            ++j;
+        }
+    }
+
+    memcpy(in->visible, visible, num_visible*sizeof(visible[0]));
+    in->num_visible = num_visible;
+    return num_visible;
+}
+
+// Removes a disconnected player from the visible set without reporting it
+// as having left
+static inline void interest_forget(struct interest *in, PlayerId id) {
+    for (u32 i = 0; i < in->num_visible; ++i) {
+        if (in->visible[i] == id) {
+            memmove(&in->visible[i], &in->visible[i + 1], (in->num_visible - (i + 1))*sizeof(in->visible[0]));
+            --in->num_visible;
+            return;
+        }
+    }
+}
+
+//
+// Events
+//
+// Spatial events (steps, sounds, projectiles) are serialized once into a
+// shared buffer along with up to two cells they touch, and copied into the
+// output buffer of each peer interested in any of those cells.
+//
+
+#define INTEREST_MAX_EVENTS 1024
+#define INTEREST_MAX_TYPES 16
+
+struct interest_event {
+    u32 cells[2];
+    PlayerId exclude_id;
+    // Events of the same type are sent together, see interest_events_batch
+    u8 type;
+    u32 offset;
+    u32 size;
+};
+
+struct interest_events {
+    struct byte_buffer buffer;
+    struct interest_event events[INTEREST_MAX_EVENTS];
+    u32 num_events;
+};
+
+static inline struct interest_event *interest_event_begin(struct interest_events *e, const struct interest_grid *g,
+                                                          u8 type, PlayerId exclude_id, v2 pos, v2 other_pos) {
+    assert(e->num_events < INTEREST_MAX_EVENTS);
+    assert(type < INTEREST_MAX_TYPES);
+    const u32 cell = interest_cell_at(g, pos);
+    const u32 other_cell = interest_cell_at(g, other_pos);
+    struct interest_event *event = &e->events[e->num_events++];
+    *event = (struct interest_event) {
+        .cells = {cell, (other_cell != cell) ? other_cell : INTEREST_INVALID_CELL},
+        .exclude_id = exclude_id,
+        .type = type,
+        .offset = (u32) (e->buffer.top - e->buffer.base),
+    };
+    return event;
+}
+
+static inline void interest_event_end(struct interest_events *e, struct interest_event *event) {
+    event->size = (u32) (e->buffer.top - e->buffer.base) - event->offset;
+}
+
+static inline bool interest_event_relevant(const struct interest *in, const struct interest_event *event, PlayerId id) {
+    return event->exclude_id != id &&
+           (interest_contains(in, event->cells[0]) || interest_contains(in, event->cells[1]));
+}
+
+// Indices of the events relevant to a single peer grouped by type, the
+// events of type t are indices[starts[t]] to indices[starts[t] + counts[t] - 1]
+// in the order they were added.
+struct interest_batches {
+    u16 counts[INTEREST_MAX_TYPES];
+    u16 starts[INTEREST_MAX_TYPES];
+    u16 indices[INTEREST_MAX_EVENTS];
+};
+
+static inline void interest_events_batch(const struct interest_events *e, const struct interest *in, PlayerId id,
+                                         struct interest_batches *b) {
+    u16 relevant[INTEREST_MAX_EVENTS];
+    u32 num_relevant = 0;
+    memset(b->counts, 0, sizeof(b->counts));
+    for (u32 i = 0; i < e->num_events; ++i) {
+        const struct interest_event *event = &e->events[i];
+        if (!interest_event_relevant(in, event, id))
+            continue;
+        relevant[num_relevant++] = (u16) i;
+        ++b->counts[event->type];
+    }
+
+    // Counting sort, keeps the order within each type
+    u16 next[INTEREST_MAX_TYPES];
+    u16 start = 0;
+    for (u32 t = 0; t < INTEREST_MAX_TYPES; ++t) {
+        b->starts[t] = start;
+        next[t] = start;
+        start += b->counts[t];
+    }
+    for (u32 i = 0; i < num_relevant; ++i)
+        b->indices[next[e->events[relevant[i]].type]++] = relevant[i];
+}
+
+static inline void interest_events_reset(struct interest_events *e) {
+    e->buffer.top = e->buffer.base;
+    e->num_events = 0;
+}
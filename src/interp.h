@@ -0,0 +1,131 @@
+#pragma once
+
+#include "common.h"
+#include "game.h"
+#include "v2.h"
+
+//
+// Snapshot interpolation
+//
+// Remote players are rendered at a render tick some delay behind the
+// server, so there is usually a received state on either side of it to
+// interpolate between. States are kept per player in the order of the
+// sim_tick they were produced at, independent of when they arrived, so
+// bunched up or late packets don't change the playback rate.
+//
+// If the render tick passes the newest state the player is extrapolated
+// along its velocity for at most INTERP_MAX_EXTRAPOLATION ticks, and then
+// held where it is until more states arrive.
+//
+
+#define INTERP_BUFFER_SIZE 32
+// Default delay, two network ticks covers one lost or late batch
+#define INTERP_DEFAULT_DELAY (2*NET_PER_SIM_TICKS)
+#define INTERP_MAX_EXTRAPOLATION (2*NET_PER_SIM_TICKS)
+
+struct interp_entry {
+    struct player player;
+    u64 sim_tick;
+};
+
+struct interp_buffer {
+    struct interp_entry data[INTERP_BUFFER_SIZE];
+    u64 bottom;
+    u64 used;
+};
+
+enum interp_result {
+    INTERP_EMPTY = 0,
+    INTERP_INTERPOLATED,
+    // Render tick is past the newest state
+    INTERP_EXTRAPOLATED,
+    // Render tick is before the oldest state, or too far past the newest
+    INTERP_HELD,
+};
+
+static inline struct interp_entry *interp_at(struct interp_buffer *b, u64 i) {
+    return &b->data[(b->bottom + i) % ARRLEN(b->data)];
+}
+
+static inline void interp_clear(struct interp_buffer *b) {
+    b->used = 0;
+}
+
+// Inserts a state, states older than the newest one are dropped and a
+// state for the same tick replaces it. When full the oldest is dropped.
+static inline void interp_push(struct interp_buffer *b, const struct player *p, u64 sim_tick) {
+    if (b->used > 0) {
+        struct interp_entry *newest = interp_at(b, b->used - 1);
+        if (sim_tick < newest->sim_tick)
+            return;
+        if (sim_tick == newest->sim_tick) {
+            newest->player = *p;
+            return;
+        }
+    }
+
+    if (b->used == ARRLEN(b->data))
+        CIRCULAR_BUFFER_POP(b);
+    struct interp_entry entry = {
+        .player = *p,
+        .sim_tick = sim_tick,
+    };
+    CIRCULAR_BUFFER_APPEND(b, entry);
+}
+
+static inline struct player interp_lerp(const struct player *a, const struct player *b, f32 t) {
+    // Discrete state comes from the older state until the newer one is
+    // reached
+    struct player p = *a;
+    p.pos = v2add(a->pos, v2scale(t, v2sub(b->pos, a->pos)));
+    p.velocity = v2add(a->velocity, v2scale(t, v2sub(b->velocity, a->velocity)));
+    p.look = v2add(a->look, v2scale(t, v2sub(b->look, a->look)));
+    if (!v2iszero(p.look))
+        p.look = v2normalize(p.look);
+    return p;
+}
+
+// Writes the state at render_tick to out. States that are no longer
+// needed to interpolate render_tick are dropped, so render_tick should
+// only move forward.
+static inline enum interp_result interp_sample(struct interp_buffer *b, f64 render_tick, f32 dt, struct player *out) {
+    if (b->used == 0)
+        return INTERP_EMPTY;
+
+    // Drop states while the next one is still at or before render_tick
+    while (b->used > 1 && (f64) interp_at(b, 1)->sim_tick <= render_tick)
+        CIRCULAR_BUFFER_POP(b);
+
+    const struct interp_entry *from = interp_at(b, 0);
+    if (render_tick < (f64) from->sim_tick) {
+        *out = from->player;
+        return INTERP_HELD;
+    }
+
+    if (b->used > 1) {
+        const struct interp_entry *to = interp_at(b, 1);
+        const f32 t = (f32) ((render_tick - (f64) from->sim_tick) / (f64) (to->sim_tick - from->sim_tick));
+        *out = interp_lerp(&from->player, &to->player, t);
+        return INTERP_INTERPOLATED;
+    }
+
+    // Past the newest state
+    f64 ahead = render_tick - (f64) from->sim_tick;
+    const bool held = ahead > INTERP_MAX_EXTRAPOLATION;
+    if (held)
+        ahead = INTERP_MAX_EXTRAPOLATION;
+    *out = from->player;
+    out->pos = v2add(out->pos, v2scale((f32) ahead*dt, out->velocity));
+    return held ? INTERP_HELD : INTERP_EXTRAPOLATED;
+}
+
+// view_delay to send with input for sim_tick when other players are shown
+// at render_tick, rounded to the nearest tick
+static inline u16 interp_view_delay(u64 sim_tick, f64 render_tick) {
+    const f64 delay = (f64) sim_tick - render_tick + 0.5;
+    if (delay <= 0.0)
+        return 0;
+    if (delay >= (f64) UINT16_MAX)
+        return UINT16_MAX;
+    return (u16) delay;
+}
@@ -0,0 +1,1183 @@
+#include "match.h"
+#include "packet.h"
+#include "interest.h"
+#include "output.h"
+#include "transport.h"
+#include "record.h"
+#include "trace.h"
+#include "common.h"
+#include "random.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(DRAW)
+#include "draw.h"
+#include <raylib.h>
+#endif
+
+#define PACKET_LOG_SIZE 2048
+#define OUTPUT_BUFFER_SIZE 32000
+#define INPUT_BUFFER_LENGTH 16
+#define UPDATE_LOG_BUFFER_SIZE 512
+#define MAX_BROADCAST_FILTERS 1024
+#define SNAPSHOT_HISTORY 32
+#define BUDGET_BURST_TICKS 2
+
+struct update_log_entry {
+    u64 client_sim_tick;
+    u64 server_net_tick;
+    struct client_packet_update input_update;
+};
+
+struct update_log_buffer {
+    struct update_log_entry data[UPDATE_LOG_BUFFER_SIZE];
+    u64 bottom;
+    u64 used;
+};
+
+//
+// Each peer keeps a history of the player states we've sent it per network
+// tick, and which of those ticks it has acknowledged. Player states are
+// delta encoded against the latest acknowledged state of that player.
+//
+
+struct snapshot_entry {
+    PlayerId id;
+    struct player_fields fields;
+};
+
+struct snapshot {
+    u64 net_tick;
+    bool valid;
+    bool acked;
+    u32 num_players;
+    struct snapshot_entry players[MAX_PLAYERS_PER_MATCH];
+};
+
+struct server_peer {
+    PlayerId id;
+    struct update_log_buffer update_log;
+    ENetPeer *enet_peer;
+    u64 connect_net_tick;
+
+    // Packets for the next per-peer batch, split into chunks that are
+    // sent as separate datagrams
+    struct output output;
+
+    // Send time of the latest client batch and when we received it, echoed
+    // in every chunk so the client can sync its clock, see clock.h
+    u64 sync_client_time;
+    u64 sync_receive_time;
+
+    // Set when the player has processed input since the last network
+    // tick, other peers only receive the latest state once per network tick.
+    bool player_dirty;
+    u64 player_dirty_sim_tick;
+
+    // SNAPSHOT_HISTORY entries indexed by net_tick % SNAPSHOT_HISTORY
+    struct snapshot *snapshots;
+
+    // Cells and players this peer is interested in, and the quantized
+    // state of its own player replicated to others this network tick.
+    struct interest interest;
+    struct player_fields replicated_fields;
+
+    // Payload bytes this peer may still be sent, refilled every network
+    // tick, and the priority of unsent player states indexed by the slot
+    // of the other peer. A state is waiting to be sent while its priority
+    // is above 0.
+    i64 budget;
+    f32 priority[MAX_PLAYERS_PER_MATCH];
+
+    // Stable index of the peer for as long as it's connected, unlike its
+    // position in peer_map
+    u32 slot;
+};
+
+// Returns the buffer to write a packet of size bytes to
+static inline struct byte_buffer *new_packet(struct output_pool *pool, struct server_peer *p, size_t size) {
+    struct byte_buffer *b = output_reserve(&p->output, pool, size);
+    struct server_batch_header *batch = (void *) b->base;
+    assert(batch->num_packets < UINT16_MAX);
+    ++batch->num_packets;
+    return b;
+}
+
+static inline struct snapshot *snapshot_begin(struct server_peer *p, u64 net_tick) {
+    struct snapshot *s = &p->snapshots[net_tick % SNAPSHOT_HISTORY];
+    s->net_tick = net_tick;
+    s->valid = true;
+    s->acked = false;
+    s->num_players = 0;
+    return s;
+}
+
+static inline void snapshot_record(struct snapshot *s, PlayerId id, const struct player_fields *fields) {
+    assert(s->num_players < ARRLEN(s->players));
+    s->players[s->num_players++] = (struct snapshot_entry) {
+        .id = id,
+        .fields = *fields,
+    };
+}
+
+static inline void snapshot_ack(struct server_peer *p, u64 ack_net_tick, u32 ack_bits) {
+    for (u32 i = 0; i < 32 && i <= ack_net_tick; ++i) {
+        if (!(ack_bits & (1u << i)))
+            continue;
+        struct snapshot *s = &p->snapshots[(ack_net_tick - i) % SNAPSHOT_HISTORY];
+        if (s->valid && s->net_tick == ack_net_tick - i)
+            s->acked = true;
+    }
+}
+
+// Finds the latest acknowledged state of player id sent before net_tick
+static inline const struct player_fields *snapshot_find_baseline(struct server_peer *p, u64 net_tick, PlayerId id, u8 *age) {
+    for (u32 i = 1; i < SNAPSHOT_HISTORY && i <= net_tick; ++i) {
+        struct snapshot *s = &p->snapshots[(net_tick - i) % SNAPSHOT_HISTORY];
+        if (!s->valid || !s->acked || s->net_tick != net_tick - i)
+            continue;
+        for (u32 j = 0; j < s->num_players; ++j) {
+            if (s->players[j].id == id) {
+                *age = (u8) i;
+                return &s->players[j].fields;
+            }
+        }
+    }
+    return NULL;
+}
+
+//
+// Bandwidth budget
+//
+// With a budget set every peer is refilled a number of payload bytes each
+// network tick, and can save up at most BUDGET_BURST_TICKS worth. Packets
+// the client can't do without (greetings, spawns, its own AUTHs, leaves and
+// the broadcast batch) are always sent and use the budget first, possibly
+// overdrawing it by up to BUDGET_BURST_TICKS worth, any debt past that is
+// forgiven. What's left is filled with player states and spatial events in
+// priority order, and the highest priority one is sent even if nothing is
+// left.
+//
+// The priority of a player state grows every network tick it waits to be
+// sent and is reset once it's sent, so distant players are updated less
+// often rather than never, even when the always sent packets alone are
+// over budget. Events only matter the tick they happen, those that don't
+// fit are dropped, steps first.
+//
+
+// Priority gained per network tick by a waiting player state, and the
+// priority of events by type. Both are divided by 1 + the distance in
+// interest cells to the peer.
+#define PRIORITY_PLAYER 1.0f
+#define PRIORITY_PLAYER_ENTERED 4.0f
+
+static const f32 event_priorities[INTEREST_MAX_TYPES] = {
+    [SERVER_PACKET_NADE]    = 8.0f,
+    [SERVER_PACKET_HITSCAN] = 8.0f,
+    [SERVER_PACKET_SOUND]   = 2.0f,
+    [SERVER_PACKET_STEP]    = 0.5f,
+};
+
+struct replicate_candidate {
+    f32 priority;
+    u16 size;
+    // Index into the player states or the batched event indices
+    u16 index;
+    bool is_event;
+    u8 type;
+    bool selected;
+};
+
+// Player state waiting to be sent to a peer
+struct replicate_state {
+    struct server_peer *other_peer;
+    f32 *priority;
+    u8 baseline_age;
+    u8 size;
+    u8 delta[PLAYER_DELTA_MAX_BYTES];
+};
+
+static int compare_candidates(const void *a, const void *b) {
+    const f32 pa = ((const struct replicate_candidate *) a)->priority;
+    const f32 pb = ((const struct replicate_candidate *) b)->priority;
+    // Highest priority first
+    return (pa < pb) - (pa > pb);
+}
+
+// Events of a type share one packet header
+static inline i64 candidate_cost(const struct replicate_candidate *c, const bool *has_batch) {
+    if (c->is_event && !has_batch[c->type])
+        return c->size + sizeof(struct server_header) + sizeof(struct server_packet_events);
+    return c->size;
+}
+
+// Selects the candidates that fit in budget bytes, highest priority first.
+// The first one is always selected.
+static void replicate_select(struct replicate_candidate *candidates, u32 num_candidates, i64 budget) {
+    // Most of the time everything fits and there's no need to sort
+    bool has_batch[INTEREST_MAX_TYPES] = {0};
+    i64 total = 0;
+    for (u32 i = 0; i < num_candidates; ++i) {
+        total += candidate_cost(&candidates[i], has_batch);
+        if (candidates[i].is_event)
+            has_batch[candidates[i].type] = true;
+    }
+    if (total <= budget) {
+        for (u32 i = 0; i < num_candidates; ++i)
+            candidates[i].selected = true;
+        return;
+    }
+
+    qsort(candidates, num_candidates, sizeof(candidates[0]), compare_candidates);
+    memset(has_batch, 0, sizeof(has_batch));
+    for (u32 i = 0; i < num_candidates; ++i) {
+        const i64 cost = candidate_cost(&candidates[i], has_batch);
+        candidates[i].selected = i == 0 || cost <= budget;
+        if (candidates[i].selected) {
+            budget -= cost;
+            if (candidates[i].is_event)
+                has_batch[candidates[i].type] = true;
+        }
+    }
+}
+
+//
+// Events common to all peers (greetings, disconnects, kills) are
+// serialized once per network tick into a single broadcast batch, which is
+// sent as one refcounted ENetPacket to every peer. Per-peer exclusions are
+// stored in the filter list and appended to the end of the batch when sent.
+// Spatial events only go to interested peers, see interest.h.
+//
+
+struct broadcast {
+    struct byte_buffer output_buffer;
+    struct server_broadcast_filter filters[MAX_BROADCAST_FILTERS];
+    u16 num_filters;
+};
+
+static inline void new_broadcast_packet(struct broadcast *b, PlayerId exclude_id) {
+    struct server_batch_header *batch = (void *) b->output_buffer.base;
+    assert(batch->num_packets < UINT16_MAX);
+
+    if (exclude_id != HASH_MAP_INVALID_HASH) {
+        assert(b->num_filters < MAX_BROADCAST_FILTERS);
+        b->filters[b->num_filters++] = (struct server_broadcast_filter) {
+            .packet_index = batch->num_packets,
+            .player_id = exclude_id,
+        };
+    }
+
+    ++batch->num_packets;
+}
+
+// Size of the batch once the filters are appended, 0 if there's nothing
+// to send
+static inline i64 broadcast_batch_size(const struct broadcast *b) {
+    const struct server_batch_header *batch = (const void *) b->output_buffer.base;
+    if (batch->num_packets == 0)
+        return 0;
+    return (i64) (b->output_buffer.top - b->output_buffer.base) + b->num_filters*sizeof(b->filters[0]);
+}
+
+static inline void broadcast_reset(struct broadcast *b) {
+    b->output_buffer.top = b->output_buffer.base;
+    b->num_filters = 0;
+
+    struct server_batch_header batch = {
+        .num_packets = 0,
+    };
+    APPEND(&b->output_buffer, &batch);
+}
+
+struct respawn_list_item {
+    PlayerId id;
+    f32 time_left;
+};
+
+struct match {
+    u32 id;
+    bool verbose;
+    bool quit_requested;
+
+    struct match_net *net;
+
+    struct frame frame;
+    struct game game;
+    HashMap(struct server_peer) peer_map;
+    bool peer_slots_used[MAX_PLAYERS_PER_MATCH];
+
+    struct broadcast broadcast;
+    struct output_pool output_pool;
+
+    // Payload bytes per peer and network tick, 0 is unlimited
+    i64 budget_per_tick;
+    struct match_bandwidth bandwidth;
+    struct match_bandwidth bandwidth_start;
+    struct interest_grid interest_grid;
+    struct interest_events interest_events;
+
+    u64 seed;
+    struct random_series_pcg random;
+    // In order of death, only ever removed from in order
+    List(struct respawn_list_item, MAX_CLIENTS) respawn_list;
+
+    struct recorder recorder;
+
+    f32 t;
+    f32 fps;
+    struct frame_debug_data frame_debug;
+
+    u64 phase_times[MATCH_PHASE_LAST];
+    struct match_profile profile;
+    u64 profile_start_tick;
+};
+
+// Adds the time since *phase_start to phase and starts the next one,
+// phases are expected to run in enum order
+static inline void match_phase_end(struct match *m, enum match_phase phase, u64 *phase_start) {
+    const u64 now = time_current();
+    const u64 delta = now - *phase_start;
+    m->phase_times[phase] += delta;
+    histogram_record(&m->profile.phases[phase], delta);
+    *phase_start = now;
+
+    trace_end_at(match_phase_names[phase], now);
+    if (phase + 1 < MATCH_PHASE_LAST)
+        trace_begin_at(match_phase_names[phase + 1], now);
+}
+
+struct match *match_create(u32 id, struct match_net *net, u64 seed, bool verbose) {
+    struct match *m = calloc(1, sizeof(struct match));
+    assert(m);
+
+    m->id = id;
+    m->verbose = verbose;
+    m->net = net;
+
+    m->frame = (struct frame) {
+        .desired_delta = NANOSECONDS(1) / (f32) FPS,
+        .dt = 1.0f / (f32) FPS,
+    };
+
+    m->game.map = map;
+
+    m->broadcast.output_buffer = byte_buffer_alloc(OUTPUT_BUFFER_SIZE);
+    broadcast_reset(&m->broadcast);
+
+    m->interest_grid = interest_grid_init(&m->game.map, INTEREST_CELL_SIZE, INTEREST_RADIUS, INTEREST_HYSTERESIS);
+    m->interest_events.buffer = byte_buffer_alloc(OUTPUT_BUFFER_SIZE);
+
+    m->seed = seed;
+    m->random = random_seed_pcg(seed, 0x9005);
+
+    return m;
+}
+
+void match_destroy(struct match *m) {
+    HashMapForEach(m->peer_map, struct server_peer, peer) {
+        output_release(&peer->output, &m->output_pool);
+        free(peer->snapshots);
+        interest_free(&peer->interest);
+    }
+    HashMapFree(m->peer_map);
+    HashMapFree(m->game.player_map);
+
+    recorder_close(&m->recorder);
+    output_pool_free(&m->output_pool);
+    byte_buffer_free(&m->broadcast.output_buffer);
+    byte_buffer_free(&m->interest_events.buffer);
+    interest_grid_free(&m->interest_grid);
+    free(m);
+}
+
+bool match_record(struct match *m, const char *path) {
+    return recorder_open(&m->recorder, path, m->seed, &m->game.map);
+}
+
+void match_set_budget(struct match *m, u32 bytes_per_second) {
+    m->budget_per_tick = (i64) bytes_per_second*NET_PER_SIM_TICKS/FPS;
+}
+
+const struct match_bandwidth *match_bandwidth(struct match *m) {
+    return &m->bandwidth;
+}
+
+const u64 *match_phase_times(struct match *m) {
+    return m->phase_times;
+}
+
+const struct match_profile *match_profile(struct match *m) {
+    return &m->profile;
+}
+
+void match_profile_print(struct match *m) {
+    printf("match %u profile over %lu ticks:\n", m->id, m->frame.simulation_tick - m->profile_start_tick);
+    printf("  %-11s | %9s | %9s | %9s | %9s\n", "phase", "p50 us", "p99 us", "max us", "mean us");
+    for (u32 i = 0; i <= MATCH_PHASE_LAST; ++i) {
+        const struct histogram *h = (i < MATCH_PHASE_LAST) ? &m->profile.phases[i] : &m->profile.tick;
+        printf("  %-11s | %9.1f | %9.1f | %9.1f | %9.1f\n",
+               (i < MATCH_PHASE_LAST) ? match_phase_names[i] : "tick",
+               histogram_percentile(h, 0.50)/1000.0,
+               histogram_percentile(h, 0.99)/1000.0,
+               h->max/1000.0,
+               histogram_mean(h)/1000.0);
+    }
+}
+
+void match_profile_reset(struct match *m) {
+    for (u32 i = 0; i < MATCH_PHASE_LAST; ++i)
+        histogram_reset(&m->profile.phases[i]);
+    histogram_reset(&m->profile.tick);
+    m->profile_start_tick = m->frame.simulation_tick;
+}
+
+bool match_quit_requested(struct match *m) {
+    return m->quit_requested;
+}
+
+u32 match_tick(struct match *m) {
+    const u64 frame_start = time_current();
+    u64 phase_start = frame_start;
+    trace_begin_at("match_tick", frame_start);
+    trace_begin_at(match_phase_names[MATCH_PHASE_RECEIVE], frame_start);
+
+    // Collect frame debug data
+    if (m->frame.simulation_tick % FPS == 0) {
+        m->frame_debug.total_delta = frame_start - m->frame_debug.total_frame_start;
+        m->frame_debug.total_frame_start = frame_start;
+    }
+
+    // Handle network
+    if (m->frame.simulation_tick % NET_PER_SIM_TICKS == 0) {
+        struct net_event event;
+        bool ok = true;
+        while (true) {
+            SPSC_RING_POP(&m->net->inbound, event, ok);
+            if (!ok)
+                break;
+
+            trace_begin(net_event_names[event.type]);
+            switch (event.type) {
+            case NET_EVENT_CONNECT: {
+                const u64 id = event.id;
+
+                struct server_peer *peer = NULL;
+                HashMapInsert(m->peer_map, id, peer);
+                peer->slot = 0;
+                while (m->peer_slots_used[peer->slot])
+                    ++peer->slot;
+                assert(peer->slot < MAX_PLAYERS_PER_MATCH);
+                m->peer_slots_used[peer->slot] = true;
+                peer->enet_peer = event.peer;
+                peer->output = output_init(sizeof(struct server_batch_header));
+                peer->connect_net_tick = m->frame.network_tick;
+                peer->snapshots = calloc(SNAPSHOT_HISTORY, sizeof(struct snapshot));
+                assert(peer->snapshots);
+                peer->interest = interest_alloc(&m->interest_grid);
+
+                struct player *p = NULL;
+                HashMapInsert(m->game.player_map, id, p);
+                record_write(&m->recorder, m->frame.simulation_tick, RECORD_CONNECT, &(struct record_connect) {id});
+
+                struct respawn_list_item item = {id, 0.1f};
+                ListInsert(m->respawn_list, item);
+
+                // Send greeting for peer
+                {
+                    struct server_header header = {
+                        .type = SERVER_PACKET_GREETING,
+                    };
+
+                    struct server_packet_greeting greeting = {
+                        .codec_version = CODEC_VERSION,
+                        .initial_net_tick = m->frame.network_tick,
+                        .id = id,
+                    };
+
+                    struct byte_buffer *out = new_packet(&m->output_pool, peer, sizeof(header) + sizeof(greeting));
+                    APPEND(out, &header);
+                    APPEND(out, &greeting);
+                }
+
+                // Send greeting to all other peers
+                {
+                    struct server_header header = {
+                        .type = SERVER_PACKET_PEER_GREETING,
+                    };
+
+                    struct server_packet_peer_greeting greeting = {
+                        .id = id,
+                    };
+
+                    new_broadcast_packet(&m->broadcast, id);
+                    APPEND(&m->broadcast.output_buffer, &header);
+                    APPEND(&m->broadcast.output_buffer, &greeting);
+                }
+                break;
+            }
+            case NET_EVENT_RECEIVE: {
+                struct byte_buffer net_input_buffer = byte_buffer_init(event.packet->data, event.packet->dataLength);
+                struct client_batch_header *batch;
+                POP(&net_input_buffer, &batch);
+
+                const PlayerId id = event.id;
+
+                struct server_peer *peer = NULL;
+                HashMapLookup(m->peer_map, id, peer);
+                if (peer == NULL)
+                    break;
+
+                if (batch->codec_version != CODEC_VERSION) {
+                    printf("Dropping packet, codec version %u, expected %u\n", batch->codec_version, CODEC_VERSION);
+                    break;
+                }
+
+                snapshot_ack(peer, batch->ack_net_tick, batch->ack_bits);
+
+                if (batch->client_time > peer->sync_client_time) {
+                    peer->sync_client_time = batch->client_time;
+                    peer->sync_receive_time = event.time;
+                }
+
+                // Clients sync their clocks so input arrives before we
+                // simulate its tick, input that doesn't is dropped.
+                assert(batch->num_packets > 0);
+                const u64 tick = ((struct client_header *) net_input_buffer.top)->sim_tick;
+                if (tick < m->frame.simulation_tick) {
+                    struct server_header response_header = {
+                        .type = SERVER_PACKET_DROPPED,
+                    };
+
+                    printf("Dropping packet, too late: sim_tick %lu, should be >= %lu\n", tick, m->frame.simulation_tick);
+
+                    struct byte_buffer *out = new_packet(&m->output_pool, peer, sizeof(response_header));
+                    APPEND(out, &response_header);
+                    break;
+                }
+
+                for (u16 packet = 0; packet < batch->num_packets; ++packet) {
+                    struct client_header *header;
+                    POP(&net_input_buffer, &header);
+
+                    switch (header->type) {
+                    case CLIENT_PACKET_UPDATE: {
+                        struct client_packet_update *input_update;
+                        POP(&net_input_buffer, &input_update);
+
+                        struct update_log_entry entry = {
+                            .client_sim_tick = header->sim_tick,
+                            .server_net_tick = m->frame.network_tick,
+                            .input_update = *input_update,
+                        };
+                        CIRCULAR_BUFFER_APPEND(&peer->update_log, entry);
+                    } break;
+                    default:
+                        printf("Received unknown packet type %d\n", header->type);
+                    }
+                }
+            } break;
+
+            case NET_EVENT_DISCONNECT: {
+                PlayerId id = event.id;
+
+                struct server_peer *peer = NULL;
+                HashMapLookup(m->peer_map, id, peer);
+
+                printf("%lu disconnected (%s).\n", (u64) id, event.timeout ? "timeout" : "quit");
+
+                {
+                    struct server_header response_header = {
+                        .type = SERVER_PACKET_PEER_DISCONNECTED,
+                    };
+
+                    struct server_packet_peer_disconnected disc = {
+                        .player_id = id,
+                    };
+
+                    new_broadcast_packet(&m->broadcast, HASH_MAP_INVALID_HASH);
+                    APPEND(&m->broadcast.output_buffer, &response_header);
+                    APPEND(&m->broadcast.output_buffer, &disc);
+                }
+
+                output_release(&peer->output, &m->output_pool);
+                free(peer->snapshots);
+                interest_free(&peer->interest);
+
+                // Clients remove the player on PEER_DISCONNECTED, no
+                // need to tell them it left their area of interest
+                HashMapForEach(m->peer_map, struct server_peer, other_peer) {
+                    if (other_peer == peer)
+                        continue;
+                    interest_forget(&other_peer->interest, id);
+                    other_peer->priority[peer->slot] = 0.0f;
+                }
+
+                // Players that leave while dead must not be respawned
+                ForEachList(m->respawn_list, struct respawn_list_item, item) {
+                    if (item->id == id)
+                        ListTagRemovePtr(m->respawn_list, item);
+                }
+                ListRemoveTaggedItems(m->respawn_list);
+
+                m->peer_slots_used[peer->slot] = false;
+                HashMapRemove(m->game.player_map, id);
+                HashMapRemove(m->peer_map, id);
+                record_write(&m->recorder, m->frame.simulation_tick, RECORD_DISCONNECT, &(struct record_disconnect) {id});
+            } break;
+            }
+
+            if (event.packet != NULL)
+                transport_packet_destroy(event.packet);
+            trace_end(net_event_names[event.type]);
+        }
+
+        // Greet peers that connected this network tick about everyone
+        // who connected before and is still here. Peers connecting
+        // together greet each other through the broadcast batch, which
+        // also carries any disconnects from this tick.
+        HashMapForEach(m->peer_map, struct server_peer, peer) {
+            if (peer->connect_net_tick != m->frame.network_tick)
+                continue;
+
+            struct server_header header = {
+                .type = SERVER_PACKET_PEER_GREETING,
+            };
+
+            HashMapForEach(m->peer_map, struct server_peer, other_peer) {
+                if (other_peer->connect_net_tick == m->frame.network_tick)
+                    continue;
+                struct server_packet_peer_greeting greeting = {
+                    .id = other_peer->id,
+                };
+
+                struct byte_buffer *out = new_packet(&m->output_pool, peer, sizeof(header) + sizeof(greeting));
+                APPEND(out, &header);
+                APPEND(out, &greeting);
+            }
+        }
+    }
+    match_phase_end(m, MATCH_PHASE_RECEIVE, &phase_start);
+
+    HashMapForEach(m->peer_map, struct server_peer, peer) {
+
+        struct player *player = NULL;
+        HashMapLookup(m->game.player_map, peer->id, player);
+
+        while (peer->update_log.used > 0) {
+            struct update_log_entry *entry = &peer->update_log.data[peer->update_log.bottom];
+            if (entry->client_sim_tick > m->frame.simulation_tick)
+                break;
+
+            // Hitscan fired by this input is tested against where the
+            // shooter saw the other players
+            m->game.view_tick = lag_compensation_view_tick(m->frame.simulation_tick, entry->client_sim_tick, entry->input_update.view_delay);
+
+            const struct record_input record = {
+                .player_id = peer->id,
+                .client_tick_age = m->frame.simulation_tick - entry->client_sim_tick,
+                .view_tick_age = (m->game.view_tick != 0) ? m->frame.simulation_tick - m->game.view_tick : 0,
+                .input = entry->input_update.input,
+            };
+            record_write(&m->recorder, m->frame.simulation_tick, RECORD_INPUT, &record);
+
+            struct input input = input_decode(&entry->input_update.input);
+            update_player(&m->game, player, &input, m->frame.dt);
+            m->game.view_tick = 0;
+            collect_and_resolve_static_collisions(&m->game);
+
+            // Send AUTH packet to peer
+            {
+                struct server_header response_header = {
+                    .type = SERVER_PACKET_AUTH,
+                };
+
+                struct server_packet_auth auth = {
+                    .sim_tick = entry->client_sim_tick,
+                    .player = player_encode(&m->game.map, player),
+                };
+
+                struct byte_buffer *out = new_packet(&m->output_pool, peer, sizeof(response_header) + sizeof(auth));
+                APPEND(out, &response_header);
+                APPEND(out, &auth);
+            }
+
+            // Mark player for replication to other peers on the next
+            // network tick
+            peer->player_dirty = true;
+            if (entry->client_sim_tick > peer->player_dirty_sim_tick)
+                peer->player_dirty_sim_tick = entry->client_sim_tick;
+
+            CIRCULAR_BUFFER_POP(&peer->update_log);
+        }
+
+        //struct collision_result results[16] = {0};
+        //u32 num_results = 0;
+        //collect_dynamic_collisions(&m->game, results, &num_results, 16);
+        //resolve_dynamic_collisions(&m->game, results, num_results);
+    }
+    match_phase_end(m, MATCH_PHASE_INPUT, &phase_start);
+
+    ForEachList(m->respawn_list, struct respawn_list_item, item) {
+        item->time_left -= m->frame.dt;
+
+        if (item->time_left <= 0.0f) {
+            struct player *p = NULL;
+            HashMapLookup(m->game.player_map, item->id, p);
+
+            const struct record_spawn record = {
+                .player_id = item->id,
+                .random = m->random,
+            };
+            record_write(&m->recorder, m->frame.simulation_tick, RECORD_SPAWN, &record);
+
+            match_spawn_player(&m->random, &m->game.map, p);
+
+            struct server_peer *peer = NULL;
+            HashMapLookup(m->peer_map, item->id, peer);
+
+            {
+                struct server_header response_header = {
+                    .type = SERVER_PACKET_PLAYER_SPAWN,
+                };
+
+                struct server_packet_player_spawn spawn = {
+                    .player = player_encode(&m->game.map, p),
+                };
+
+                struct byte_buffer *out = new_packet(&m->output_pool, peer, sizeof(response_header) + sizeof(spawn));
+                APPEND(out, &response_header);
+                APPEND(out, &spawn);
+            }
+
+            ListTagRemovePtr(m->respawn_list, item);
+        }
+    }
+    ListRemoveTaggedItems(m->respawn_list);
+    match_phase_end(m, MATCH_PHASE_RESPAWN, &phase_start);
+
+    // Event payloads are stored without headers, they're grouped into one
+    // packet per type for each peer when replicating
+    ForEachList(m->game.new_nade_list, struct nade_projectile, nade) {
+        struct server_packet_nade nade_packet = {
+            .nade = *nade,
+        };
+
+        struct interest_event *event = interest_event_begin(&m->interest_events, &m->interest_grid, SERVER_PACKET_NADE, nade->player_id_from, nade->start_pos, nade->impact);
+        APPEND(&m->interest_events.buffer, &nade_packet);
+        interest_event_end(&m->interest_events, event);
+    }
+
+    ForEachList(m->game.new_hitscan_list, struct hitscan_projectile, hitscan) {
+        struct server_packet_hitscan hitscan_packet = {
+            .hitscan = *hitscan,
+        };
+
+        struct interest_event *event = interest_event_begin(&m->interest_events, &m->interest_grid, SERVER_PACKET_HITSCAN, hitscan->player_id_from, hitscan->pos, hitscan->impact);
+        APPEND(&m->interest_events.buffer, &hitscan_packet);
+        interest_event_end(&m->interest_events, event);
+    }
+    ListClear(m->game.new_nade_list);
+    ListClear(m->game.new_hitscan_list);
+
+    ForEachList(m->game.sound_list, struct spatial_sound, sound) {
+        struct server_packet_sound sound_packet = {
+            .sound = *sound,
+        };
+
+        struct interest_event *event = interest_event_begin(&m->interest_events, &m->interest_grid, SERVER_PACKET_SOUND, sound->player_id_from, sound->pos, sound->pos);
+        APPEND(&m->interest_events.buffer, &sound_packet);
+        interest_event_end(&m->interest_events, event);
+    }
+    ListClear(m->game.sound_list);
+
+    ForEachList(m->game.step_list, struct step, step) {
+        struct server_packet_step step_packet = {
+            .step = *step,
+        };
+
+        struct interest_event *event = interest_event_begin(&m->interest_events, &m->interest_grid, SERVER_PACKET_STEP, step->player_id_from, step->pos, step->pos);
+        APPEND(&m->interest_events.buffer, &step_packet);
+        interest_event_end(&m->interest_events, event);
+    }
+    // We don't care about keeping track of "alive" steps, only which steps
+    // occured this frame, so clear the list.
+    ListClear(m->game.step_list);
+    match_phase_end(m, MATCH_PHASE_EVENTS, &phase_start);
+
+    // Positions after this tick's inputs and respawns are what peers will
+    // see for it
+    player_history_record(&m->game, m->frame.simulation_tick);
+
+    // Now it's time for per-frame updates
+    update_projectiles(&m->game, m->frame.dt);
+    // We don't care about sounds made in update_projectiles as these
+    // are already handled by peers as we sync projectiles
+    ListClear(m->game.sound_list);
+    match_phase_end(m, MATCH_PHASE_PROJECTILES, &phase_start);
+
+    // Apply damage
+    ForEachList(m->game.damage_list, struct damage_entry, d) {
+        struct player *p = NULL;
+        HashMapLookup(m->game.player_map, d->player_id, p);
+        p->health -= d->damage;
+
+        if (p->health <= 0.0f) {
+            struct respawn_list_item item = {p->id, 1.0f};
+            ListInsert(m->respawn_list, item);
+            record_write(&m->recorder, m->frame.simulation_tick, RECORD_KILL, &(struct record_kill) {p->id});
+
+            // Send kill packet to all connected peers
+            {
+                struct server_header header = {
+                    .type = SERVER_PACKET_PLAYER_KILL,
+                };
+
+                struct server_packet_player_kill kill = {
+                    .player_id = p->id,
+                };
+
+                new_broadcast_packet(&m->broadcast, HASH_MAP_INVALID_HASH);
+                APPEND(&m->broadcast.output_buffer, &header);
+                APPEND(&m->broadcast.output_buffer, &kill);
+            }
+        }
+    }
+    ListClear(m->game.damage_list);
+
+    if (m->recorder.file != NULL && m->frame.simulation_tick % NET_PER_SIM_TICKS == 0) {
+        const struct record_checksum checksum = record_checksum(&m->game);
+        record_write(&m->recorder, m->frame.simulation_tick, RECORD_CHECKSUM, &checksum);
+    }
+    match_phase_end(m, MATCH_PHASE_DAMAGE, &phase_start);
+
+    // If we're on a network tick, then update the area of interest of
+    // each peer and send it the latest state of each player in it that
+    // has processed input since the last network tick, delta encoded
+    // against what the peer has acknowledged, along with the events around
+    // it. Both are limited by the bandwidth budget of the peer.
+    if (m->frame.simulation_tick % NET_PER_SIM_TICKS == 0) {
+        interest_grid_begin(&m->interest_grid);
+        HashMapForEach(m->peer_map, struct server_peer, peer) {
+
+            struct player *player = NULL;
+            HashMapLookup(m->game.player_map, peer->id, player);
+            interest_grid_add(&m->interest_grid, peer->id, player->pos);
+            peer->replicated_fields = player_quantize(&m->game.map, player);
+
+            snapshot_begin(peer, m->frame.network_tick);
+
+            if (m->budget_per_tick > 0) {
+                const i64 burst = BUDGET_BURST_TICKS*m->budget_per_tick;
+                if (peer->budget < -burst)
+                    peer->budget = -burst;
+                peer->budget += m->budget_per_tick;
+                if (peer->budget > burst)
+                    peer->budget = burst;
+            }
+        }
+        interest_grid_build(&m->interest_grid);
+
+        // Kills and disconnects are already in the broadcast batch, which is
+        // sent after this
+        const i64 broadcast_size = broadcast_batch_size(&m->broadcast);
+
+        HashMapForEach(m->peer_map, struct server_peer, peer) {
+
+            struct player *player = NULL;
+            HashMapLookup(m->game.player_map, peer->id, player);
+            interest_update(&m->interest_grid, &peer->interest, player->pos);
+
+            PlayerId entered[MAX_CLIENTS];
+            PlayerId left[MAX_CLIENTS];
+            u32 num_entered = 0;
+            u32 num_left = 0;
+            interest_collect(&m->interest_grid, &peer->interest, peer->id, entered, &num_entered, left, &num_left);
+
+            for (u32 i = 0; i < num_left; ++i) {
+                struct server_header response_header = {
+                    .type = SERVER_PACKET_PEER_LEAVE,
+                };
+
+                struct server_packet_peer_leave leave = {
+                    .player_id = left[i],
+                };
+
+                struct byte_buffer *out = new_packet(&m->output_pool, peer, sizeof(response_header) + sizeof(leave));
+                APPEND(out, &response_header);
+                APPEND(out, &leave);
+
+                // A waiting state is sent again in full if the player comes back
+                struct server_peer *other_peer = NULL;
+                HashMapLookup(m->peer_map, left[i], other_peer);
+                if (other_peer != NULL)
+                    peer->priority[other_peer->slot] = 0.0f;
+            }
+
+            // Player states and events competing for the budget
+            struct replicate_candidate candidates[MAX_CLIENTS + INTEREST_MAX_EVENTS];
+            struct replicate_state states[MAX_CLIENTS];
+            u32 num_candidates = 0;
+            u32 num_states = 0;
+
+            // Both lists are sorted by id
+            u32 next_entered = 0;
+            for (u32 i = 0; i < peer->interest.num_visible; ++i) {
+                const PlayerId id = peer->interest.visible[i];
+                const bool just_entered = next_entered < num_entered && entered[next_entered] == id;
+                if (just_entered)
+                    ++next_entered;
+
+                struct server_peer *other_peer = NULL;
+                HashMapLookup(m->peer_map, id, other_peer);
+                f32 *priority = &peer->priority[other_peer->slot];
+                if (!other_peer->player_dirty && !just_entered && *priority == 0.0f)
+                    continue;
+
+                struct player *other_player = NULL;
+                HashMapLookup(m->game.player_map, id, other_player);
+                const u32 distance = interest_cell_distance(&m->interest_grid, peer->interest.center,
+                                                            interest_cell_at(&m->interest_grid, other_player->pos));
+                *priority += (just_entered ? PRIORITY_PLAYER_ENTERED : PRIORITY_PLAYER) / (1.0f + (f32) distance);
+
+                struct replicate_state *state = &states[num_states];
+                u8 age = 0;
+                const struct player_fields *baseline = snapshot_find_baseline(peer, m->frame.network_tick, id, &age);
+                *state = (struct replicate_state) {
+                    .other_peer = other_peer,
+                    .priority = priority,
+                    .baseline_age = (baseline != NULL) ? age : 0,
+                };
+                state->size = (u8) player_write_delta(state->delta, sizeof(state->delta), baseline, &other_peer->replicated_fields);
+
+                candidates[num_candidates++] = (struct replicate_candidate) {
+                    .priority = *priority,
+                    .size = sizeof(struct server_header) + sizeof(struct server_packet_peer_auth) + state->size,
+                    .index = (u16) num_states++,
+                };
+            }
+
+            struct interest_batches batches;
+            interest_events_batch(&m->interest_events, &peer->interest, peer->id, &batches);
+            for (u32 type = 0; type < INTEREST_MAX_TYPES; ++type) {
+                for (u32 i = batches.starts[type]; i < batches.starts[type] + batches.counts[type]; ++i) {
+                    const struct interest_event *event = &m->interest_events.events[batches.indices[i]];
+                    u32 distance = interest_cell_distance(&m->interest_grid, peer->interest.center, event->cells[0]);
+                    if (event->cells[1] != INTEREST_INVALID_CELL) {
+                        const u32 other_distance = interest_cell_distance(&m->interest_grid, peer->interest.center, event->cells[1]);
+                        distance = (other_distance < distance) ? other_distance : distance;
+                    }
+
+                    candidates[num_candidates++] = (struct replicate_candidate) {
+                        .priority = event_priorities[type] / (1.0f + (f32) distance),
+                        .size = (u16) event->size,
+                        .index = (u16) i,
+                        .is_event = true,
+                        .type = (u8) type,
+                    };
+                }
+            }
+
+            // Everything so far is sent regardless of the budget
+            const i64 mandatory = (i64) output_size(&peer->output) + broadcast_size;
+            m->bandwidth.bytes_mandatory += (u64) mandatory;
+
+            i64 budget = INT64_MAX;
+            if (m->budget_per_tick > 0)
+                budget = peer->budget - mandatory;
+            replicate_select(candidates, num_candidates, budget);
+
+            // Send selected player states, delta encoded against what the
+            // peer has acknowledged
+            bool event_selected[INTEREST_MAX_EVENTS];
+            for (u32 i = 0; i < num_candidates; ++i) {
+                const struct replicate_candidate *c = &candidates[i];
+                if (c->is_event) {
+                    event_selected[c->index] = c->selected;
+                    m->bandwidth.events_dropped += !c->selected;
+                    continue;
+                }
+                if (!c->selected) {
+                    ++m->bandwidth.states_deferred;
+                    continue;
+                }
+
+                struct replicate_state *state = &states[c->index];
+                struct server_peer *other_peer = state->other_peer;
+
+                struct server_header response_header = {
+                    .type = SERVER_PACKET_PEER_AUTH,
+                };
+
+                struct server_packet_peer_auth peer_auth = {
+                    .sim_tick = other_peer->player_dirty_sim_tick,
+                    .player_id = (u32) other_peer->id,
+                    .baseline_age = state->baseline_age,
+                    .size = state->size,
+                };
+
+                struct byte_buffer *out = new_packet(&m->output_pool, peer, sizeof(response_header) + sizeof(peer_auth) + state->size);
+                APPEND(out, &response_header);
+                APPEND(out, &peer_auth);
+                append(out, state->delta, state->size);
+
+                snapshot_record(&peer->snapshots[m->frame.network_tick % SNAPSHOT_HISTORY], other_peer->id, &other_peer->replicated_fields);
+                *state->priority = 0.0f;
+            }
+
+            // Selected spatial events, one packet per event type with the
+            // payloads back to back. Events of a type are all the same
+            // size, batches that don't fit in the current chunk are split so
+            // no chunk depends on another.
+            for (u32 type = 0; type < INTEREST_MAX_TYPES; ++type) {
+                u16 *indices = &batches.indices[batches.starts[type]];
+                u16 remaining = 0;
+                for (u32 i = 0; i < batches.counts[type]; ++i) {
+                    if (event_selected[batches.starts[type] + i])
+                        indices[remaining++] = indices[i];
+                }
+
+                while (remaining > 0) {
+                    struct server_header events_header = {
+                        .type = type,
+                    };
+
+                    const size_t event_size = m->interest_events.events[indices[0]].size;
+                    const size_t header_size = sizeof(events_header) + sizeof(struct server_packet_events);
+                    struct byte_buffer *out = new_packet(&m->output_pool, peer, header_size + event_size);
+
+                    const size_t fits = (output_remaining(&peer->output) - header_size) / event_size;
+                    struct server_packet_events events = {
+                        .count = (remaining < fits) ? remaining : (u16) fits,
+                    };
+
+                    APPEND(out, &events_header);
+                    APPEND(out, &events);
+                    for (u32 i = 0; i < events.count; ++i) {
+                        const struct interest_event *event = &m->interest_events.events[indices[i]];
+                        assert(event->size == event_size);
+                        append(out, m->interest_events.buffer.base + event->offset, event->size);
+                    }
+
+                    indices += events.count;
+                    remaining -= events.count;
+                }
+            }
+        }
+
+        interest_events_reset(&m->interest_events);
+    }
+    match_phase_end(m, MATCH_PHASE_REPLICATE, &phase_start);
+
+    // If we're on a network tick, then send the broadcast batch to all
+    // peers
+    if (m->frame.simulation_tick % NET_PER_SIM_TICKS == 0) {
+        struct server_batch_header *batch = (void *) m->broadcast.output_buffer.base;
+        if (batch->num_packets > 0) {
+            batch->net_tick = m->frame.network_tick;
+            batch->flags = SERVER_BATCH_FLAG_BROADCAST;
+            batch->num_filters = m->broadcast.num_filters;
+            append(&m->broadcast.output_buffer, m->broadcast.filters, m->broadcast.num_filters*sizeof(m->broadcast.filters[0]));
+
+            const size_t size = (intptr_t) m->broadcast.output_buffer.top - (intptr_t) m->broadcast.output_buffer.base;
+            ENetPacket *packet = net_packet_hold(transport_packet_create(m->broadcast.output_buffer.base, size));
+            HashMapForEach(m->peer_map, struct server_peer, peer) {
+                net_send(m->net, peer->enet_peer, peer->id, packet, false);
+                peer->budget -= (i64) size;
+                m->bandwidth.bytes_sent += size;
+            }
+            net_send(m->net, NULL, HASH_MAP_INVALID_HASH, packet, true);
+
+            broadcast_reset(&m->broadcast);
+        }
+    }
+
+    // If we're on a network tick, then send batch. Every peer has been
+    // replicated to by now, so dirty players can be cleared here too.
+    if (m->frame.simulation_tick % NET_PER_SIM_TICKS == 0) {
+        HashMapForEach(m->peer_map, struct server_peer, peer) {
+            peer->player_dirty = false;
+            if (output_empty(&peer->output))
+                continue;
+
+            u16 chunk_index = 0;
+            for (struct output_chunk *c = peer->output.head; c != NULL; c = c->next) {
+                struct server_batch_header *sent_batch = (void *) c->buffer.base;
+                sent_batch->net_tick = m->frame.network_tick;
+                sent_batch->client_time = peer->sync_client_time;
+                sent_batch->receive_time = peer->sync_receive_time;
+                sent_batch->server_time = frame_start;
+                sent_batch->sim_tick = m->frame.simulation_tick;
+                sent_batch->chunk_index = chunk_index++;
+                sent_batch->num_chunks = (u16) peer->output.num_chunks;
+
+                const size_t size = (intptr_t) c->buffer.top - (intptr_t) c->buffer.base;
+                ENetPacket *packet = net_packet_hold(transport_packet_create(c->buffer.base, size));
+                net_send(m->net, peer->enet_peer, peer->id, packet, true);
+                peer->budget -= (i64) size;
+                m->bandwidth.bytes_sent += size;
+            }
+            output_release(&peer->output, &m->output_pool);
+        }
+    }
+    match_phase_end(m, MATCH_PHASE_SEND, &phase_start);
+
+#if defined(DRAW)
+    if (IsKeyDown(KEY_Q))
+        m->quit_requested = true;
+    BeginDrawing();
+    ClearBackground(RAYWHITE);
+    //draw_game(&m->game, t);
+
+    draw_all_debug_v2s((struct camera) {0});
+
+    DrawText("server", 10, 10, 20, BLACK);
+    if (m->frame.simulation_tick % FPS == 0) {
+        m->fps = 1.0f / ((f32)m->frame.delta/(f32)NANOSECONDS(1));
+    }
+    if (!isinf(m->fps))
+        DrawText(TextFormat("fps: %.0f", m->fps), 10, 30, 20, GRAY);
+
+    EndDrawing();
+#else
+    if (m->verbose && m->frame.simulation_tick % FPS == 0) {
+        // Bandwidth over the last second, counted by the network thread
+        const u64 incoming_data_total = atomic_load_explicit(&m->net->incoming_data_total, memory_order_relaxed);
+        const u64 outgoing_data_total = atomic_load_explicit(&m->net->outgoing_data_total, memory_order_relaxed);
+        m->frame_debug.incoming_bandwidth = incoming_data_total - m->frame_debug.incoming_data_total_start;
+        m->frame_debug.outgoing_bandwidth = outgoing_data_total - m->frame_debug.outgoing_data_total_start;
+        m->frame_debug.incoming_data_total_start = incoming_data_total;
+        m->frame_debug.outgoing_data_total_start = outgoing_data_total;
+
+        printf("fps: %10.0f (%.0f) | in: %10u | out: %10u \n", m->frame_debug.fps, 1000000000.0f*FPS/((f32)m->frame_debug.total_delta), m->frame_debug.incoming_bandwidth, m->frame_debug.outgoing_bandwidth);
+
+        // Payload per peer, and what the budget held back
+        const struct match_bandwidth *b = &m->bandwidth;
+        const struct match_bandwidth *start = &m->bandwidth_start;
+        const u64 num_peers = (m->peer_map.num_items > 0) ? m->peer_map.num_items : 1;
+        printf("per peer out: %8lu (budget %lu, always sent %lu) | states deferred: %6lu | events dropped: %6lu\n",
+               (b->bytes_sent - start->bytes_sent) / num_peers,
+               (u64) m->budget_per_tick*FPS/NET_PER_SIM_TICKS,
+               (b->bytes_mandatory - start->bytes_mandatory) / num_peers,
+               b->states_deferred - start->states_deferred,
+               b->events_dropped - start->events_dropped);
+        m->bandwidth_start = *b;
+    }
+#endif
+
+    // End frame
+    const u64 frame_end = time_current();
+    m->frame.delta = frame_end - frame_start;
+    trace_end_at("match_tick", frame_end);
+    histogram_record(&m->profile.tick, m->frame.delta);
+    if (m->frame.simulation_tick % FPS == 0)
+        m->frame_debug.fps = 1.0f / ((f32) m->frame.delta / (f32) NANOSECONDS(1));
+
+    if (m->frame.simulation_tick % NET_PER_SIM_TICKS == 0)
+        ++m->frame.network_tick;
+    ++m->frame.simulation_tick;
+    m->t += m->frame.dt;
+
+    return m->peer_map.num_items;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "enet.h"
+#include "common.h"
+#include "game.h"
+#include "random.h"
+#include "histogram.h"
+
+#include <sched.h>
+
+//
+// Match
+//
+// A match is one independent game with its own peers, RNG and frame
+// counters. The server runs one or more matches on a pool of worker
+// threads, each match only ever being ticked by one worker.
+//
+// Matches never touch ENet directly. The network I/O thread hands them
+// connects, received packets and disconnects through the inbound ring,
+// and matches hand finished packets back through the outbound ring. Both
+// are single producer/single consumer: the I/O thread on one end and the
+// worker ticking the match on the other. ENetPeer pointers are only used
+// as opaque handles by the match; matches own the packets they pop and
+// hand the packets they push over to the I/O thread, see net_packet_hold.
+//
+
+#define NET_RING_SIZE 1024
+
+enum net_event_type {
+    NET_EVENT_CONNECT,
+    NET_EVENT_RECEIVE,
+    NET_EVENT_DISCONNECT,
+};
+
+static const char *net_event_names[] = {
+    [NET_EVENT_CONNECT]    = "connect",
+    [NET_EVENT_RECEIVE]    = "receive_packet",
+    [NET_EVENT_DISCONNECT] = "disconnect",
+};
+
+struct net_event {
+    enum net_event_type type;
+    PlayerId id;
+    ENetPeer *peer;
+    ENetPacket *packet;
+    bool timeout;
+    // time_current() when the packet was received, for clock sync
+    u64 time;
+};
+
+// The match holds a reference to every packet it queues, taken with
+// net_packet_hold before the first net_send. Otherwise the network thread
+// could send a broadcast packet to the peers queued so far, have ENet free
+// it once they're done with it, and then find the same pointer queued for
+// the rest of the peers.
+static inline ENetPacket *net_packet_hold(ENetPacket *packet) {
+    ++packet->referenceCount;
+    return packet;
+}
+
+// Sends packet to peer if it's still connected as player id. If release is
+// set the match's reference is dropped after the send, and the packet is
+// destroyed if no peer holds one either. A NULL peer only releases the
+// packet. Nothing may be queued for a packet after it's released.
+struct net_send {
+    PlayerId id;
+    ENetPeer *peer;
+    ENetPacket *packet;
+    bool release;
+};
+
+struct match_net {
+    SpscRing(struct net_event, NET_RING_SIZE) inbound;
+    SpscRing(struct net_send,  NET_RING_SIZE) outbound;
+
+    // Payload bytes received/sent, used for bandwidth debug output
+    _Atomic u64 incoming_data_total;
+    _Atomic u64 outgoing_data_total;
+};
+
+static inline void net_send(struct match_net *net, ENetPeer *peer, PlayerId id, ENetPacket *packet, bool release) {
+    const struct net_send send = {
+        .id = id,
+        .peer = peer,
+        .packet = packet,
+        .release = release,
+    };
+
+    bool ok = false;
+    while (true) {
+        SPSC_RING_PUSH(&net->outbound, send, ok);
+        if (ok)
+            break;
+        sched_yield();
+    }
+}
+
+//
+// Profiling
+//
+// Every phase of match_tick is timed. Totals since the match was created
+// are kept for benchmarks, and per tick timings are recorded into
+// histograms covering the current profile window, which the server dumps
+// periodically and on SIGUSR1. Phases are also traced, see trace.h.
+//
+
+enum match_phase {
+    MATCH_PHASE_RECEIVE = 0,    // Draining the inbound ring into update logs
+    MATCH_PHASE_INPUT,          // Applying logged inputs and sending AUTH
+    MATCH_PHASE_RESPAWN,        // Respawning dead players
+    MATCH_PHASE_EVENTS,         // Serializing spatial events
+    MATCH_PHASE_PROJECTILES,    // update_projectiles
+    MATCH_PHASE_DAMAGE,         // Applying damage and sending kills
+    MATCH_PHASE_REPLICATE,      // Area of interest, PEER_AUTH deltas and event fan-out
+    MATCH_PHASE_SEND,           // Handing batches to the outbound ring
+    MATCH_PHASE_LAST,
+};
+
+static const char *match_phase_names[MATCH_PHASE_LAST] = {
+    [MATCH_PHASE_RECEIVE]     = "receive",
+    [MATCH_PHASE_INPUT]       = "input",
+    [MATCH_PHASE_RESPAWN]     = "respawn",
+    [MATCH_PHASE_EVENTS]      = "events",
+    [MATCH_PHASE_PROJECTILES] = "projectiles",
+    [MATCH_PHASE_DAMAGE]      = "damage",
+    [MATCH_PHASE_REPLICATE]   = "replicate",
+    [MATCH_PHASE_SEND]        = "send",
+};
+
+// Places p at a random free tile and resets it to a fresh spawn. Shared
+// with replays so they consume the RNG exactly like the match did.
+static inline void match_spawn_player(struct random_series_pcg *random, const struct map *m, struct player *p) {
+retry:;
+
+    f32 x = m->width  * random_next_unilateral(random);
+    f32 y = m->height * random_next_unilateral(random);
+    if (map_at(m, (v2){x,y}) == TILE_STONE)
+        goto retry;
+    p->pos.x = x;
+    p->pos.y = y;
+
+    p->weapons[0] = PLAYER_WEAPON_SNIPER;
+    p->weapons[1] = PLAYER_WEAPON_NADE;
+    p->hue = 20.0f + 80.0f*p->id;
+    p->health = 100.0f;
+}
+
+struct match_profile {
+    struct histogram phases[MATCH_PHASE_LAST];
+    struct histogram tick;
+};
+
+// Totals since the match was created of what has been sent to peers,
+// see match_set_budget
+struct match_bandwidth {
+    // Payload bytes of per-peer and broadcast batches, summed over peers
+    u64 bytes_sent;
+    // Payload bytes sent regardless of the budget, if this is more than
+    // the budget allows player states and events are barely sent at all
+    u64 bytes_mandatory;
+    // Player states that didn't fit in the budget and were sent later
+    u64 states_deferred;
+    // Events that didn't fit in the budget
+    u64 events_dropped;
+};
+
+struct match;
+
+// verbose matches print frame and bandwidth stats once per second
+struct match *match_create(u32 id, struct match_net *net, u64 seed, bool verbose);
+void match_destroy(struct match *m);
+
+// Runs one simulation tick, returns the number of connected peers
+u32 match_tick(struct match *m);
+
+// Nanoseconds spent in each phase since the match was created, indexed
+// by enum match_phase
+const u64 *match_phase_times(struct match *m);
+
+// Phase timings of the current profile window
+const struct match_profile *match_profile(struct match *m);
+void match_profile_print(struct match *m);
+void match_profile_reset(struct match *m);
+
+// Limits the payload sent to each peer to bytes_per_second, 0 (the
+// default) sends everything. Critical packets (greetings, spawns, kills,
+// the peer's own state) are always sent, player states and events fill
+// what is left in priority order.
+void match_set_budget(struct match *m, u32 bytes_per_second);
+const struct match_bandwidth *match_bandwidth(struct match *m);
+
+// Starts writing a match log to path, see record.h
+bool match_record(struct match *m, const char *path);
+
+// Set when the match wants the server to shut down (q in DRAW builds)
+bool match_quit_requested(struct match *m);
@@ -0,0 +1,159 @@
+#include "net.h"
+#include "common.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sched.h>
+
+static void net_flush_outbound(struct net_io *net) {
+    trace_begin("flush_outbound");
+    for (u32 i = 0; i < net->num_matches; ++i) {
+        struct match_net *match_net = &net->matches[i];
+
+        bool ok = true;
+        struct net_send send;
+        while (true) {
+            SPSC_RING_POP(&match_net->outbound, send, ok);
+            if (!ok)
+                break;
+
+            const struct net_peer_data *data = (send.peer != NULL) ? send.peer->data : NULL;
+            if (data != NULL && data->id == send.id) {
+                atomic_fetch_add_explicit(&match_net->outgoing_data_total, send.packet->dataLength, memory_order_relaxed);
+                transport_send(net->transport, send.peer, send.packet);
+            }
+            if (send.release && --send.packet->referenceCount == 0)
+                transport_packet_destroy(send.packet);
+        }
+    }
+    trace_end("flush_outbound");
+}
+
+static void net_push_event(struct net_io *net, u32 match, struct net_event e) {
+    bool ok = false;
+    while (true) {
+        SPSC_RING_PUSH(&net->matches[match].inbound, e, ok);
+        if (ok)
+            break;
+        // The match might be waiting on us to drain its outbound ring, so
+        // keep sending while we wait.
+        net_flush_outbound(net);
+        sched_yield();
+    }
+}
+
+void net_service(struct net_io *net, u32 timeout) {
+    ENetEvent event = {0};
+
+    net_flush_outbound(net);
+    transport_flush(net->transport);
+
+    if (transport_service(net->transport, &event, timeout) <= 0)
+        return;
+
+    do {
+        switch (event.type) {
+        case ENET_EVENT_TYPE_CONNECT: {
+            i8 ip[64] = {0};
+            if (enet_address_get_host_ip_new(&event.peer->address, (char *) ip, ARRLEN(ip)) != 0)
+                strcpy((char *) ip, "????");
+
+            const u32 match = event.data;
+            if (match >= net->num_matches || net->num_players[match] >= MAX_PLAYERS_PER_MATCH) {
+                if (net->verbose)
+                    printf("Rejecting client from %s:%u, match %u is %s.\n", ip, event.peer->address.port, match,
+                           (match >= net->num_matches) ? "invalid" : "full");
+                transport_disconnect(net->transport, event.peer);
+                break;
+            }
+            if (net->verbose)
+                printf("A new client connected from %s:%u to match %u.\n", ip, event.peer->address.port, match);
+
+            struct net_peer_data *data = malloc(sizeof(struct net_peer_data));
+            assert(data);
+            data->id = player_id();
+            data->match = match;
+            event.peer->data = data;
+            ++net->num_players[match];
+
+            net_push_event(net, match, (struct net_event) {
+                .type = NET_EVENT_CONNECT,
+                .id = data->id,
+                .peer = event.peer,
+            });
+        } break;
+
+        case ENET_EVENT_TYPE_RECEIVE: {
+            const struct net_peer_data *data = event.peer->data;
+            if (data == NULL) {
+                transport_packet_destroy(event.packet);
+                break;
+            }
+
+            atomic_fetch_add_explicit(&net->matches[data->match].incoming_data_total, event.packet->dataLength, memory_order_relaxed);
+            net_push_event(net, data->match, (struct net_event) {
+                .type = NET_EVENT_RECEIVE,
+                .id = data->id,
+                .peer = event.peer,
+                .packet = event.packet,
+                .time = time_current(),
+            });
+        } break;
+
+        case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+        case ENET_EVENT_TYPE_DISCONNECT: {
+            struct net_peer_data *data = event.peer->data;
+            if (data == NULL)
+                break;
+
+            --net->num_players[data->match];
+            net_push_event(net, data->match, (struct net_event) {
+                .type = NET_EVENT_DISCONNECT,
+                .id = data->id,
+                .timeout = event.type == ENET_EVENT_TYPE_DISCONNECT_TIMEOUT,
+            });
+            free(data);
+            event.peer->data = NULL;
+        } break;
+
+        case ENET_EVENT_TYPE_NONE:
+            break;
+        }
+    } while (transport_service(net->transport, &event, 0) > 0);
+}
+
+void *net_thread(void *arg) {
+    struct net_io *net = arg;
+    trace_thread_name("net");
+
+    // Wait at most 1 ms for socket activity so outgoing packets are
+    // picked up promptly
+    while (atomic_load_explicit(&net->running, memory_order_relaxed))
+        net_service(net, 1);
+
+    trace_thread_flush();
+    return NULL;
+}
+
+void net_free(struct net_io *net) {
+    net_flush_outbound(net);
+
+    for (u32 i = 0; i < net->num_matches; ++i) {
+        bool ok = true;
+        struct net_event event;
+        while (true) {
+            SPSC_RING_POP(&net->matches[i].inbound, event, ok);
+            if (!ok)
+                break;
+            if (event.packet != NULL)
+                transport_packet_destroy(event.packet);
+        }
+    }
+
+    for (u32 i = 0; i < transport_num_peers(net->transport); ++i) {
+        ENetPeer *peer = transport_peer(net->transport, i);
+        free(peer->data);
+        peer->data = NULL;
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "transport.h"
+#include "match.h"
+#include "common.h"
+
+#include <pthread.h>
+
+#define MAX_MATCHES 1024
+
+//
+// Network I/O
+//
+// The transport is serviced on its own thread so connects and large
+// receives don't delay the tick. A single host is shared by all matches,
+// clients pick a match by passing its index as the data of the connect,
+// see match.h for how packets are handed between this thread and the
+// matches.
+//
+
+struct net_peer_data {
+    PlayerId id;
+    u32 match;
+};
+
+struct net_io {
+    struct transport *transport;
+    pthread_t thread;
+    atomic_bool running;
+
+    struct match_net *matches;
+    u32 num_matches;
+
+    // Print connects and rejected clients
+    bool verbose;
+
+    // Only touched by the I/O thread
+    u32 num_players[MAX_MATCHES];
+};
+
+// Sends everything the matches have queued, then routes incoming events
+// to matches until the transport has nothing more, waiting at most
+// timeout ms for the first event.
+void net_service(struct net_io *net, u32 timeout);
+
+// Services net until net->running is cleared
+void *net_thread(void *arg);
+
+// Releases what's left in the rings and the data of peers that are still
+// connected, call once the thread and the matches have stopped and before
+// the transport is destroyed
+void net_free(struct net_io *net);
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Chunked output
+//
+// Outgoing data for a peer is written into a list of fixed size chunks
+// instead of one large buffer. Each chunk is sent as its own packet and is
+// small enough to fit in a single datagram, so ENet never fragments it and
+// a lost datagram only loses what was in that chunk.
+//
+// Every chunk starts with header_size zeroed bytes the caller fills in
+// before sending (the batch header), and writes never straddle two
+// chunks, so each chunk can be decoded on its own. A write that doesn't
+// fit in the current chunk starts a new one, so the output grows with the
+// amount of data instead of overflowing.
+//
+// Chunks come from a pool that is owned by a single thread, and go back to
+// it once sent.
+//
+
+// Leaves room for ENet, UDP and IP headers within the default 1400 byte
+// ENet MTU
+#define OUTPUT_CHUNK_SIZE 1200
+
+struct output_chunk {
+    struct output_chunk *next;
+    struct byte_buffer buffer;
+    u8 data[OUTPUT_CHUNK_SIZE];
+};
+
+struct output_pool {
+    struct output_chunk *free_list;
+    u32 num_chunks;
+};
+
+struct output {
+    struct output_chunk *head;
+    struct output_chunk *tail;
+    u32 num_chunks;
+    u32 header_size;
+};
+
+static inline struct output output_init(u32 header_size) {
+    assert(header_size < OUTPUT_CHUNK_SIZE);
+    return (struct output) {
+        .header_size = header_size,
+    };
+}
+
+static inline struct output_chunk *output_pool_get(struct output_pool *pool) {
+    struct output_chunk *c = pool->free_list;
+    if (c != NULL) {
+        pool->free_list = c->next;
+    } else {
+        c = malloc(sizeof(struct output_chunk));
+        assert(c);
+        ++pool->num_chunks;
+    }
+    c->next = NULL;
+    c->buffer = byte_buffer_init(c->data, sizeof(c->data));
+    return c;
+}
+
+static inline void output_pool_free(struct output_pool *pool) {
+    while (pool->free_list != NULL) {
+        struct output_chunk *c = pool->free_list;
+        pool->free_list = c->next;
+        free(c);
+    }
+    pool->num_chunks = 0;
+}
+
+// Returns the buffer to write size bytes to, starting a new chunk if they
+// don't fit in the current one
+static inline struct byte_buffer *output_reserve(struct output *o, struct output_pool *pool, size_t size) {
+    assert(o->header_size + size <= OUTPUT_CHUNK_SIZE);
+
+    struct output_chunk *c = o->tail;
+    if (c == NULL || c->buffer.top + size > c->buffer.base + c->buffer.size) {
+        c = output_pool_get(pool);
+        memset(c->buffer.top, 0, o->header_size);
+        c->buffer.top += o->header_size;
+
+        if (o->tail != NULL)
+            o->tail->next = c;
+        else
+            o->head = c;
+        o->tail = c;
+        ++o->num_chunks;
+    }
+
+    return &c->buffer;
+}
+
+// Bytes left in the current chunk
+static inline size_t output_remaining(const struct output *o) {
+    if (o->tail == NULL)
+        return 0;
+    const struct byte_buffer *b = &o->tail->buffer;
+    return (size_t) ((b->base + b->size) - b->top);
+}
+
+// Bytes written so far, including chunk headers
+static inline size_t output_size(const struct output *o) {
+    size_t size = 0;
+    for (const struct output_chunk *c = o->head; c != NULL; c = c->next)
+        size += (size_t) (c->buffer.top - c->buffer.base);
+    return size;
+}
+
+static inline bool output_empty(const struct output *o) {
+    return o->head == NULL;
+}
+
+// Returns all chunks to the pool
+static inline void output_release(struct output *o, struct output_pool *pool) {
+    if (o->head != NULL) {
+        o->tail->next = pool->free_list;
+        pool->free_list = o->head;
+    }
+    o->head = NULL;
+    o->tail = NULL;
+    o->num_chunks = 0;
+}
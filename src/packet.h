@@ -4,6 +4,414 @@
 #include "v2.h"
 #include "game.h"
 
+//
+// Codec
+//
+// Player state and inputs are bit-packed and quantized before being put on
+// the wire. Positions are stored as fixed-point relative to the map bounds,
+// directions as angles and timers/scalars as fixed-point with enough
+// fractional bits to stay well below EPSILON. Bump CODEC_LAYOUT_VERSION
+// whenever the layout below changes.
+//
+
+#define CODEC_LAYOUT_VERSION 7
+
+// Float and fixed-point simulations can't predict each other, so the
+// simulation mode is part of the version clients, servers and match logs
+// are checked against
+#if defined(FIXED_POINT)
+#define CODEC_VERSION (CODEC_LAYOUT_VERSION | 0x80)
+#else
+#define CODEC_VERSION CODEC_LAYOUT_VERSION
+#endif
+
+#define CODEC_ID_BITS           32
+#define CODEC_POS_BITS          24
+#define CODEC_VELOCITY_BITS     20
+#define CODEC_ANGLE_BITS        16
+#define CODEC_TIMER_BITS        16
+#define CODEC_HUE_BITS          16
+#define CODEC_HEALTH_BITS       16
+#define CODEC_NADE_BITS         16
+#define CODEC_ZOOM_BITS         16
+#define CODEC_WEAPON_BITS       1
+#define CODEC_STATE_BITS        1
+#define CODEC_INPUT_FLAG_BITS   INPUT_LAST
+
+// Number of integer bits for each fixed-point field, the rest are used for
+// the fractional part. Ranges: velocity [-16,16), timers [0,4), hue [0,512),
+// health [-32768,32768), nade distance [0,4), zoom [0,2).
+#define CODEC_VELOCITY_INT_BITS 5
+#define CODEC_TIMER_INT_BITS    2
+#define CODEC_HUE_INT_BITS      9
+#define CODEC_HEALTH_INT_BITS   16
+#define CODEC_NADE_INT_BITS     2
+#define CODEC_ZOOM_INT_BITS     1
+
+// Margin around the map, in tiles, that positions are allowed to be in
+#define CODEC_POS_MARGIN 1
+
+#define PLAYER_CODEC_BITS                   \
+    (CODEC_ID_BITS +                        \
+     2*CODEC_POS_BITS +                     \
+     2*CODEC_VELOCITY_BITS +                \
+     2*(1 + CODEC_ANGLE_BITS) +             \
+     CODEC_TIMER_BITS + 1 +                 \
+     2*CODEC_TIMER_BITS +                   \
+     CODEC_HUE_BITS +                       \
+     CODEC_HEALTH_BITS +                    \
+     2*CODEC_TIMER_BITS +                   \
+     2*CODEC_WEAPON_BITS +                  \
+     CODEC_WEAPON_BITS +                    \
+     CODEC_NADE_BITS +                      \
+     CODEC_ZOOM_BITS +                      \
+     CODEC_STATE_BITS)
+
+#define INPUT_CODEC_BITS \
+    (CODEC_ANGLE_BITS + CODEC_INPUT_FLAG_BITS)
+
+#define CODEC_BYTES(bits) (((bits) + 7)/8)
+
+Pack(struct packed_player {
+    u8 data[CODEC_BYTES(PLAYER_CODEC_BITS)];
+});
+
+Pack(struct packed_input {
+    u8 data[CODEC_BYTES(INPUT_CODEC_BITS)];
+});
+
+struct bit_stream {
+    u8 *data;
+    size_t size;
+    size_t byte;
+    u64 scratch;
+    u32 scratch_bits;
+};
+
+static inline struct bit_stream bit_stream_init(void *data, size_t size) {
+    return (struct bit_stream) {
+        .data = data,
+        .size = size,
+    };
+}
+
+static inline void bit_write(struct bit_stream *s, u32 value, u32 bits) {
+    assert(bits <= 32);
+    const u64 mask = (bits == 32) ? UINT32_MAX : ((1ull << bits) - 1);
+    s->scratch |= ((u64) value & mask) << s->scratch_bits;
+    s->scratch_bits += bits;
+    while (s->scratch_bits >= 8) {
+        assert(s->byte < s->size);
+        s->data[s->byte++] = (u8) s->scratch;
+        s->scratch >>= 8;
+        s->scratch_bits -= 8;
+    }
+}
+
+static inline void bit_flush(struct bit_stream *s) {
+    if (s->scratch_bits > 0) {
+        assert(s->byte < s->size);
+        s->data[s->byte++] = (u8) s->scratch;
+        s->scratch = 0;
+        s->scratch_bits = 0;
+    }
+}
+
+static inline u32 bit_read(struct bit_stream *s, u32 bits) {
+    assert(bits <= 32);
+    while (s->scratch_bits < bits) {
+        assert(s->byte < s->size);
+        s->scratch |= (u64) s->data[s->byte++] << s->scratch_bits;
+        s->scratch_bits += 8;
+    }
+    const u64 mask = (bits == 32) ? UINT32_MAX : ((1ull << bits) - 1);
+    const u32 value = (u32) (s->scratch & mask);
+    s->scratch >>= bits;
+    s->scratch_bits -= bits;
+    return value;
+}
+
+static inline u32 codec_quantize(f32 value, f32 min, u32 bits, u32 int_bits) {
+    assert(int_bits <= bits);
+    const f64 scaled = ((f64) value - (f64) min) * (f64) (1ull << (bits - int_bits));
+    const f64 max = (f64) ((1ull << bits) - 1);
+    if (!(scaled > 0.0))
+        return 0;
+    if (scaled >= max)
+        return (u32) max;
+    return (u32) (scaled + 0.5);
+}
+
+static inline f32 codec_dequantize(u32 value, f32 min, u32 bits, u32 int_bits) {
+    return (f32) ((f64) min + (f64) value / (f64) (1ull << (bits - int_bits)));
+}
+
+// Angles are quantized to CODEC_ANGLE_BITS, the length is not preserved
+static inline u32 codec_quantize_angle(v2 dir) {
+    const f64 angle = atan2(dir.y, dir.x) + M_PI;
+    return (u32) (angle / (2.0*M_PI) * (f64) (1u << CODEC_ANGLE_BITS) + 0.5) & ((1u << CODEC_ANGLE_BITS) - 1);
+}
+
+// Decoded inputs feed the simulation on both ends, so with FIXED_POINT
+// this avoids libm
+static inline v2 codec_dequantize_angle(u32 value) {
+#if defined(FIXED_POINT)
+    // value is in [0,2pi) offset by pi, CORDIC wants [0,2pi) in units of
+    // 2^32 per turn
+    fixed s, c;
+    fixed_sincos((value << (32 - CODEC_ANGLE_BITS)) + (1u << 31), &s, &c);
+    return (v2) {fixed_to_f32(c), fixed_to_f32(s)};
+#else
+    const f64 angle = 2.0*M_PI*value / (f64) (1u << CODEC_ANGLE_BITS) - M_PI;
+    return (v2) {(f32) cos(angle), (f32) sin(angle)};
+#endif
+}
+
+// Unit directions, the lowest bit flags whether the vector is nonzero
+static inline u32 codec_quantize_dir(v2 dir) {
+    if (v2iszero(dir))
+        return 0;
+    return 1 | (codec_quantize_angle(dir) << 1);
+}
+
+static inline v2 codec_dequantize_dir(u32 value) {
+    if (!(value & 1))
+        return (v2) {0, 0};
+    return codec_dequantize_angle(value >> 1);
+}
+
+// Positions use all bits available that fit the map (plus margin) in the
+// integer part
+static inline u32 codec_pos_int_bits(const struct map *m) {
+    const f32 extent = f32_max(m->width, m->height)*m->tile_size + 2*CODEC_POS_MARGIN*m->tile_size;
+    u32 int_bits = 0;
+    while ((f32) (1u << int_bits) < extent)
+        ++int_bits;
+    assert(int_bits < CODEC_POS_BITS);
+    return int_bits;
+}
+
+//
+// Players are quantized field by field, which lets us send only the fields
+// that changed compared to a baseline the receiver already has.
+//
+
+enum player_field {
+    PLAYER_FIELD_ID = 0,
+    PLAYER_FIELD_POS_X,
+    PLAYER_FIELD_POS_Y,
+    PLAYER_FIELD_VELOCITY_X,
+    PLAYER_FIELD_VELOCITY_Y,
+    PLAYER_FIELD_DODGE,
+    PLAYER_FIELD_LOOK,
+    PLAYER_FIELD_STEP_DELAY,
+    PLAYER_FIELD_STEP_LEFT_SIDE,
+    PLAYER_FIELD_TIME_LEFT_IN_DODGE,
+    PLAYER_FIELD_TIME_LEFT_IN_DODGE_DELAY,
+    PLAYER_FIELD_HUE,
+    PLAYER_FIELD_HEALTH,
+    PLAYER_FIELD_WEAPON_COOLDOWN_0,
+    PLAYER_FIELD_WEAPON_COOLDOWN_1,
+    PLAYER_FIELD_WEAPON_0,
+    PLAYER_FIELD_WEAPON_1,
+    PLAYER_FIELD_CURRENT_WEAPON,
+    PLAYER_FIELD_NADE_DISTANCE,
+    PLAYER_FIELD_SNIPER_ZOOM,
+    PLAYER_FIELD_STATE,
+    PLAYER_FIELD_LAST,
+};
+
+static const u8 player_field_bits[PLAYER_FIELD_LAST] = {
+    [PLAYER_FIELD_ID]                       = CODEC_ID_BITS,
+    [PLAYER_FIELD_POS_X]                    = CODEC_POS_BITS,
+    [PLAYER_FIELD_POS_Y]                    = CODEC_POS_BITS,
+    [PLAYER_FIELD_VELOCITY_X]               = CODEC_VELOCITY_BITS,
+    [PLAYER_FIELD_VELOCITY_Y]               = CODEC_VELOCITY_BITS,
+    [PLAYER_FIELD_DODGE]                    = 1 + CODEC_ANGLE_BITS,
+    [PLAYER_FIELD_LOOK]                     = 1 + CODEC_ANGLE_BITS,
+    [PLAYER_FIELD_STEP_DELAY]               = CODEC_TIMER_BITS,
+    [PLAYER_FIELD_STEP_LEFT_SIDE]           = 1,
+    [PLAYER_FIELD_TIME_LEFT_IN_DODGE]       = CODEC_TIMER_BITS,
+    [PLAYER_FIELD_TIME_LEFT_IN_DODGE_DELAY] = CODEC_TIMER_BITS,
+    [PLAYER_FIELD_HUE]                      = CODEC_HUE_BITS,
+    [PLAYER_FIELD_HEALTH]                   = CODEC_HEALTH_BITS,
+    [PLAYER_FIELD_WEAPON_COOLDOWN_0]        = CODEC_TIMER_BITS,
+    [PLAYER_FIELD_WEAPON_COOLDOWN_1]        = CODEC_TIMER_BITS,
+    [PLAYER_FIELD_WEAPON_0]                 = CODEC_WEAPON_BITS,
+    [PLAYER_FIELD_WEAPON_1]                 = CODEC_WEAPON_BITS,
+    [PLAYER_FIELD_CURRENT_WEAPON]           = CODEC_WEAPON_BITS,
+    [PLAYER_FIELD_NADE_DISTANCE]            = CODEC_NADE_BITS,
+    [PLAYER_FIELD_SNIPER_ZOOM]              = CODEC_ZOOM_BITS,
+    [PLAYER_FIELD_STATE]                    = CODEC_STATE_BITS,
+};
+
+// Delta encoded players start with a mask of the changed fields, the id is
+// never part of the delta.
+#define PLAYER_DELTA_MASK_BITS (PLAYER_FIELD_LAST - 1)
+#define PLAYER_DELTA_MAX_BYTES CODEC_BYTES(PLAYER_DELTA_MASK_BITS + PLAYER_CODEC_BITS - CODEC_ID_BITS)
+
+struct player_fields {
+    u32 values[PLAYER_FIELD_LAST];
+};
+
+static inline struct player_fields player_quantize(const struct map *m, const struct player *p) {
+    const u32 pos_int_bits = codec_pos_int_bits(m);
+    const v2 pos_min = v2sub(m->origin, (v2) {CODEC_POS_MARGIN*m->tile_size, CODEC_POS_MARGIN*m->tile_size});
+    const f32 velocity_min = -(f32) (1u << (CODEC_VELOCITY_INT_BITS-1));
+    const f32 health_min = -(f32) (1u << (CODEC_HEALTH_INT_BITS-1));
+
+    struct player_fields f = {0};
+    u32 *v = f.values;
+    v[PLAYER_FIELD_ID]                       = (u32) p->id;
+    v[PLAYER_FIELD_POS_X]                    = codec_quantize(p->pos.x, pos_min.x, CODEC_POS_BITS, pos_int_bits);
+    v[PLAYER_FIELD_POS_Y]                    = codec_quantize(p->pos.y, pos_min.y, CODEC_POS_BITS, pos_int_bits);
+    v[PLAYER_FIELD_VELOCITY_X]               = codec_quantize(p->velocity.x, velocity_min, CODEC_VELOCITY_BITS, CODEC_VELOCITY_INT_BITS);
+    v[PLAYER_FIELD_VELOCITY_Y]               = codec_quantize(p->velocity.y, velocity_min, CODEC_VELOCITY_BITS, CODEC_VELOCITY_INT_BITS);
+    v[PLAYER_FIELD_DODGE]                    = codec_quantize_dir(p->dodge);
+    v[PLAYER_FIELD_LOOK]                     = codec_quantize_dir(p->look);
+    v[PLAYER_FIELD_STEP_DELAY]               = codec_quantize(p->step_delay, 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS);
+    v[PLAYER_FIELD_STEP_LEFT_SIDE]           = p->step_left_side;
+    v[PLAYER_FIELD_TIME_LEFT_IN_DODGE]       = codec_quantize(p->time_left_in_dodge, 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS);
+    v[PLAYER_FIELD_TIME_LEFT_IN_DODGE_DELAY] = codec_quantize(p->time_left_in_dodge_delay, 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS);
+    v[PLAYER_FIELD_HUE]                      = codec_quantize(fmodf(p->hue, 360.0f), 0.0f, CODEC_HUE_BITS, CODEC_HUE_INT_BITS);
+    v[PLAYER_FIELD_HEALTH]                   = codec_quantize(p->health, health_min, CODEC_HEALTH_BITS, CODEC_HEALTH_INT_BITS);
+    v[PLAYER_FIELD_WEAPON_COOLDOWN_0]        = codec_quantize(p->time_left_in_weapon_cooldown[0], 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS);
+    v[PLAYER_FIELD_WEAPON_COOLDOWN_1]        = codec_quantize(p->time_left_in_weapon_cooldown[1], 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS);
+    v[PLAYER_FIELD_WEAPON_0]                 = p->weapons[0];
+    v[PLAYER_FIELD_WEAPON_1]                 = p->weapons[1];
+    v[PLAYER_FIELD_CURRENT_WEAPON]           = p->current_weapon;
+    v[PLAYER_FIELD_NADE_DISTANCE]            = codec_quantize(p->nade_distance, 0.0f, CODEC_NADE_BITS, CODEC_NADE_INT_BITS);
+    v[PLAYER_FIELD_SNIPER_ZOOM]              = codec_quantize(p->sniper_zoom, 0.0f, CODEC_ZOOM_BITS, CODEC_ZOOM_INT_BITS);
+    v[PLAYER_FIELD_STATE]                    = p->state;
+
+    return f;
+}
+
+static inline struct player player_dequantize(const struct map *m, const struct player_fields *f) {
+    const u32 pos_int_bits = codec_pos_int_bits(m);
+    const v2 pos_min = v2sub(m->origin, (v2) {CODEC_POS_MARGIN*m->tile_size, CODEC_POS_MARGIN*m->tile_size});
+    const f32 velocity_min = -(f32) (1u << (CODEC_VELOCITY_INT_BITS-1));
+    const f32 health_min = -(f32) (1u << (CODEC_HEALTH_INT_BITS-1));
+
+    const u32 *v = f->values;
+    return (struct player) {
+        .id                             = v[PLAYER_FIELD_ID],
+        .pos.x                          = codec_dequantize(v[PLAYER_FIELD_POS_X], pos_min.x, CODEC_POS_BITS, pos_int_bits),
+        .pos.y                          = codec_dequantize(v[PLAYER_FIELD_POS_Y], pos_min.y, CODEC_POS_BITS, pos_int_bits),
+        .velocity.x                     = codec_dequantize(v[PLAYER_FIELD_VELOCITY_X], velocity_min, CODEC_VELOCITY_BITS, CODEC_VELOCITY_INT_BITS),
+        .velocity.y                     = codec_dequantize(v[PLAYER_FIELD_VELOCITY_Y], velocity_min, CODEC_VELOCITY_BITS, CODEC_VELOCITY_INT_BITS),
+        .dodge                          = codec_dequantize_dir(v[PLAYER_FIELD_DODGE]),
+        .look                           = codec_dequantize_dir(v[PLAYER_FIELD_LOOK]),
+        .step_delay                     = codec_dequantize(v[PLAYER_FIELD_STEP_DELAY], 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS),
+        .step_left_side                 = v[PLAYER_FIELD_STEP_LEFT_SIDE],
+        .time_left_in_dodge             = codec_dequantize(v[PLAYER_FIELD_TIME_LEFT_IN_DODGE], 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS),
+        .time_left_in_dodge_delay       = codec_dequantize(v[PLAYER_FIELD_TIME_LEFT_IN_DODGE_DELAY], 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS),
+        .hue                            = codec_dequantize(v[PLAYER_FIELD_HUE], 0.0f, CODEC_HUE_BITS, CODEC_HUE_INT_BITS),
+        .health                         = codec_dequantize(v[PLAYER_FIELD_HEALTH], health_min, CODEC_HEALTH_BITS, CODEC_HEALTH_INT_BITS),
+        .time_left_in_weapon_cooldown   = {
+            codec_dequantize(v[PLAYER_FIELD_WEAPON_COOLDOWN_0], 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS),
+            codec_dequantize(v[PLAYER_FIELD_WEAPON_COOLDOWN_1], 0.0f, CODEC_TIMER_BITS, CODEC_TIMER_INT_BITS),
+        },
+        .weapons                        = {v[PLAYER_FIELD_WEAPON_0], v[PLAYER_FIELD_WEAPON_1]},
+        .current_weapon                 = v[PLAYER_FIELD_CURRENT_WEAPON],
+        .nade_distance                  = codec_dequantize(v[PLAYER_FIELD_NADE_DISTANCE], 0.0f, CODEC_NADE_BITS, CODEC_NADE_INT_BITS),
+        .sniper_zoom                    = codec_dequantize(v[PLAYER_FIELD_SNIPER_ZOOM], 0.0f, CODEC_ZOOM_BITS, CODEC_ZOOM_INT_BITS),
+        .state                          = v[PLAYER_FIELD_STATE],
+    };
+}
+
+static inline struct packed_player player_encode(const struct map *m, const struct player *p) {
+    struct packed_player packed = {0};
+    struct bit_stream s = bit_stream_init(packed.data, sizeof(packed.data));
+
+    const struct player_fields f = player_quantize(m, p);
+    for (u32 i = 0; i < PLAYER_FIELD_LAST; ++i)
+        bit_write(&s, f.values[i], player_field_bits[i]);
+    bit_flush(&s);
+
+    return packed;
+}
+
+static inline struct player player_decode(const struct map *m, const struct packed_player *packed) {
+    struct bit_stream s = bit_stream_init((void *) packed->data, sizeof(packed->data));
+
+    struct player_fields f = {0};
+    for (u32 i = 0; i < PLAYER_FIELD_LAST; ++i)
+        f.values[i] = bit_read(&s, player_field_bits[i]);
+
+    return player_dequantize(m, &f);
+}
+
+// Writes the fields of f that differ from baseline, or all fields if there
+// is no baseline. Returns the number of bytes written.
+static inline size_t player_write_delta(u8 *data, size_t size, const struct player_fields *baseline, const struct player_fields *f) {
+    struct bit_stream s = bit_stream_init(data, size);
+
+    u32 mask = 0;
+    for (u32 i = PLAYER_FIELD_ID + 1; i < PLAYER_FIELD_LAST; ++i) {
+        if (baseline == NULL || baseline->values[i] != f->values[i])
+            mask |= 1u << (i - 1);
+    }
+
+    bit_write(&s, mask, PLAYER_DELTA_MASK_BITS);
+    for (u32 i = PLAYER_FIELD_ID + 1; i < PLAYER_FIELD_LAST; ++i) {
+        if (mask & (1u << (i - 1)))
+            bit_write(&s, f->values[i], player_field_bits[i]);
+    }
+    bit_flush(&s);
+
+    return s.byte;
+}
+
+static inline struct player_fields player_read_delta(const u8 *data, size_t size, const struct player_fields *baseline, u32 id) {
+    struct bit_stream s = bit_stream_init((void *) data, size);
+
+    struct player_fields f = {0};
+    if (baseline != NULL)
+        f = *baseline;
+    f.values[PLAYER_FIELD_ID] = id;
+
+    const u32 mask = bit_read(&s, PLAYER_DELTA_MASK_BITS);
+    for (u32 i = PLAYER_FIELD_ID + 1; i < PLAYER_FIELD_LAST; ++i) {
+        if (mask & (1u << (i - 1)))
+            f.values[i] = bit_read(&s, player_field_bits[i]);
+    }
+
+    return f;
+}
+
+static inline struct packed_input input_encode(const struct input *input) {
+    struct packed_input packed = {0};
+    struct bit_stream s = bit_stream_init(packed.data, sizeof(packed.data));
+
+    u32 flags = 0;
+    for (u32 i = 0; i < INPUT_LAST; ++i)
+        flags |= (u32) input->active[i] << i;
+
+    bit_write(&s, codec_quantize_angle(input->look), CODEC_ANGLE_BITS);
+    bit_write(&s, flags, CODEC_INPUT_FLAG_BITS);
+    bit_flush(&s);
+
+    return packed;
+}
+
+static inline struct input input_decode(const struct packed_input *packed) {
+    struct input input = {0};
+    struct bit_stream s = bit_stream_init((void *) packed->data, sizeof(packed->data));
+
+    input.look = codec_dequantize_angle(bit_read(&s, CODEC_ANGLE_BITS));
+
+    const u32 flags = bit_read(&s, CODEC_INPUT_FLAG_BITS);
+    for (u32 i = 0; i < INPUT_LAST; ++i)
+        input.active[i] = (flags >> i) & 1;
+
+    return input;
+}
+
+//
+// Packets
+//
+
 enum server_packet_type {
     SERVER_PACKET_GREETING,
     SERVER_PACKET_PEER_GREETING,
@@ -17,28 +425,115 @@ enum server_packet_type {
     SERVER_PACKET_NADE,
     SERVER_PACKET_SOUND,
     SERVER_PACKET_STEP,
+    SERVER_PACKET_PEER_LEAVE,
 };
 
 enum client_packet_type {
     CLIENT_PACKET_UPDATE,
 };
 
+enum server_batch_flags {
+    SERVER_BATCH_FLAG_BROADCAST = 1 << 0,
+};
+
 Pack(struct server_batch_header {
+    u64 net_tick;
+    u8 flags;
     u16 num_packets;
-    i8 adjustment;
-    u8 adjustment_iteration;
-    i64 avg_drift;
+    u16 num_filters;
+    // Clock sync, see clock.h. client_time is the send time of the latest
+    // client batch received before this one was sent, and receive_time the
+    // server time it was received at. server_time is the start of the
+    // server tick sim_tick this batch was sent in. Zero in broadcast
+    // batches.
+    u64 client_time;
+    u64 receive_time;
+    u64 server_time;
+    u64 sim_tick;
+    // Per-peer batches are split into chunks, see batch_acks
+    u16 chunk_index;
+    u16 num_chunks;
+});
+
+// Broadcast batches are shared between all peers, so packets that should
+// not be handled by a specific player (e.g. its own sounds) are listed in a
+// filter table stored after the last packet of the batch.
+Pack(struct server_broadcast_filter {
+    u16 packet_index;
+    PlayerId player_id;
 });
 
 Pack(struct server_header {
     enum server_packet_type type;
 });
 
+//
+// Acknowledgements
+//
+// Per-peer batches are split into chunks that each fit in a single
+// datagram (see output.h), so ENet never has to fragment them. Every chunk
+// carries a copy of the batch header and only whole packets, so it can be
+// decoded on its own and losing one only loses the packets in it.
+//
+// A network tick is only acknowledged once all chunks of it have been
+// received and decoded, otherwise the server could delta encode against
+// player states the client never got. Ticks split into more than
+// BATCH_ACK_MAX_CHUNKS chunks are never acknowledged, which only costs
+// delta compression.
+//
+
+#define BATCH_ACK_MAX_CHUNKS 64
+#define BATCH_ACK_HISTORY 32
+
+struct batch_ack_chunks {
+    u64 net_tick;
+    // Bit i is set if chunk i has been received
+    u64 chunks;
+};
+
+struct batch_acks {
+    // Latest server net_tick we've received a whole batch for, bit i of
+    // ack_bits is set if we received ack_net_tick - i.
+    u64 ack_net_tick;
+    u32 ack_bits;
+
+    // Chunks received per net_tick, indexed by net_tick % BATCH_ACK_HISTORY
+    struct batch_ack_chunks received[BATCH_ACK_HISTORY];
+};
+
+// Call for every per-peer chunk that was decoded without problems
+static inline void batch_acks_receive(struct batch_acks *a, const struct server_batch_header *batch) {
+    if (batch->num_chunks > BATCH_ACK_MAX_CHUNKS || batch->chunk_index >= batch->num_chunks)
+        return;
+
+    struct batch_ack_chunks *r = &a->received[batch->net_tick % BATCH_ACK_HISTORY];
+    if (r->net_tick != batch->net_tick) {
+        r->net_tick = batch->net_tick;
+        r->chunks = 0;
+    }
+    r->chunks |= 1ull << batch->chunk_index;
+    if (__builtin_popcountll(r->chunks) != batch->num_chunks)
+        return;
+
+    if (a->ack_bits == 0 || batch->net_tick > a->ack_net_tick) {
+        const u64 shift = batch->net_tick - a->ack_net_tick;
+        a->ack_bits = (a->ack_bits != 0 && shift < 32) ? (a->ack_bits << shift) | 1 : 1;
+        a->ack_net_tick = batch->net_tick;
+    } else if (a->ack_net_tick - batch->net_tick < 32) {
+        a->ack_bits |= 1u << (a->ack_net_tick - batch->net_tick);
+    }
+}
+
 Pack(struct client_batch_header {
+    u8 codec_version;
     u64 net_tick;
+    // Latest server net_tick we've received every chunk of a (non-broadcast)
+    // batch for, bit i of ack_bits is set if we received ack_net_tick - i.
+    u64 ack_net_tick;
+    u32 ack_bits;
     u16 num_packets;
-    u8 adjustment_iteration;
-    u64 avg_total_frame_time;
+    // time_current() on the client when the batch was sent
+    u64 client_time;
 });
 
 Pack(struct client_header {
@@ -47,6 +542,7 @@ Pack(struct client_header {
 });
 
 Pack(struct server_packet_greeting {
+    u8 codec_version;
     u64 initial_net_tick;
     u64 id;
 });
@@ -57,28 +553,46 @@ Pack(struct server_packet_peer_greeting {
 });
 
 Pack(struct server_packet_auth {
-    struct player player;
+    struct packed_player player;
     u64 sim_tick;
 });
 
+// Followed by size bytes of player_write_delta data. The delta is against
+// the state of the player sent baseline_age net ticks before this batch, or
+// a full state if baseline_age is 0.
 Pack(struct server_packet_peer_auth {
-    struct player player;
     u64 sim_tick;
-    u8 peer_index;
+    u32 player_id;
+    u8 baseline_age;
+    u8 size;
 });
 
 Pack(struct server_packet_peer_disconnected {
     PlayerId player_id;
 });
 
+// Sent when a player is no longer in the area of interest of the peer, the
+// player is hidden until the next PEER_AUTH.
+Pack(struct server_packet_peer_leave {
+    PlayerId player_id;
+});
+
 Pack(struct server_packet_player_spawn {
-    struct player player;
+    struct packed_player player;
 });
 
 Pack(struct server_packet_player_kill {
     u64 player_id;
 });
 
+// Spatial events (HITSCAN, NADE, SOUND, STEP) are sent in batches, one
+// server_header per event type followed by the number of events and then
+// that many tightly packed payloads of the type, e.g. count
+// server_packet_nade for SERVER_PACKET_NADE.
+Pack(struct server_packet_events {
+    u16 count;
+});
+
 Pack(struct server_packet_hitscan {
     struct hitscan_projectile hitscan;
 });
@@ -95,6 +609,44 @@ Pack(struct server_packet_step {
     struct step step;
 });
 
+// view_delay is how many ticks behind sim_tick the client was showing
+// other players, used to rewind hitscan, see lag compensation in game.h
 Pack(struct client_packet_update {
-    struct input input;
+    struct packed_input input;
+    u16 view_delay;
 });
+
+// Payload size following each server_header, used to skip filtered packets.
+// PEER_AUTH and event batches are variable size and never part of a
+// broadcast batch, for events this is the size of a single event.
+static const size_t server_packet_payload_size[] = {
+    [SERVER_PACKET_GREETING]          = sizeof(struct server_packet_greeting),
+    [SERVER_PACKET_PEER_GREETING]     = sizeof(struct server_packet_peer_greeting),
+    [SERVER_PACKET_DROPPED]           = 0,
+    [SERVER_PACKET_AUTH]              = sizeof(struct server_packet_auth),
+    [SERVER_PACKET_PEER_AUTH]         = sizeof(struct server_packet_peer_auth),
+    [SERVER_PACKET_PEER_DISCONNECTED] = sizeof(struct server_packet_peer_disconnected),
+    [SERVER_PACKET_PLAYER_KILL]       = sizeof(struct server_packet_player_kill),
+    [SERVER_PACKET_PLAYER_SPAWN]      = sizeof(struct server_packet_player_spawn),
+    [SERVER_PACKET_HITSCAN]           = sizeof(struct server_packet_hitscan),
+    [SERVER_PACKET_NADE]              = sizeof(struct server_packet_nade),
+    [SERVER_PACKET_SOUND]             = sizeof(struct server_packet_sound),
+    [SERVER_PACKET_STEP]              = sizeof(struct server_packet_step),
+    [SERVER_PACKET_PEER_LEAVE]        = sizeof(struct server_packet_peer_leave),
+};
+
+static const char *server_packet_names[] = {
+    [SERVER_PACKET_GREETING]          = "greeting",
+    [SERVER_PACKET_PEER_GREETING]     = "peer_greeting",
+    [SERVER_PACKET_DROPPED]           = "dropped",
+    [SERVER_PACKET_AUTH]              = "auth",
+    [SERVER_PACKET_PEER_AUTH]         = "peer_auth",
+    [SERVER_PACKET_PEER_DISCONNECTED] = "peer_disconnected",
+    [SERVER_PACKET_PLAYER_KILL]       = "player_kill",
+    [SERVER_PACKET_PLAYER_SPAWN]      = "player_spawn",
+    [SERVER_PACKET_HITSCAN]           = "hitscan",
+    [SERVER_PACKET_NADE]              = "nade",
+    [SERVER_PACKET_SOUND]             = "sound",
+    [SERVER_PACKET_STEP]              = "step",
+    [SERVER_PACKET_PEER_LEAVE]        = "peer_leave",
+};
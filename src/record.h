@@ -0,0 +1,189 @@
+#pragma once
+
+#include "common.h"
+#include "game.h"
+#include "packet.h"
+#include "random.h"
+
+#include <stdio.h>
+
+//
+// Match recording
+//
+// A match log is a file header followed by a stream of records, each a
+// type byte and a packed payload of fixed size. Records don't carry a tick,
+// instead a RECORD_TICK is written before the first record of every
+// simulation tick that has any. Within a tick records are in the order the
+// match produced them:
+//
+//   CONNECT, DISCONNECT   handled network events
+//   INPUT                 every update_log_entry as it is applied
+//   SPAWN                 respawns, with the RNG state used to place them
+//   KILL, CHECKSUM        outcome of the tick, used to verify replays
+//
+// Replaying only needs the first three groups, see replay.c. The outcome
+// only matches if the replay is built with the same floating point
+// behaviour as the server, which with FIXED_POINT is any build.
+//
+
+#define RECORD_MAGIC 0x43524c46 // "FLRC"
+#define RECORD_VERSION 2
+#define RECORD_FILE_BUFFER_SIZE (1 << 16)
+
+Pack(struct record_file_header {
+    u32 magic;
+    u16 version;
+    u16 codec_version;
+    u16 fps;
+    u16 net_per_sim_ticks;
+    u32 map_width;
+    u32 map_height;
+    u64 seed;
+});
+
+enum record_type {
+    RECORD_TICK = 0,
+    RECORD_CONNECT,
+    RECORD_DISCONNECT,
+    RECORD_INPUT,
+    RECORD_SPAWN,
+    RECORD_KILL,
+    RECORD_CHECKSUM,
+    RECORD_LAST,
+};
+
+Pack(struct record_tick {
+    u64 sim_tick;
+});
+
+// Player ids are handed out sequentially, 32 bits is plenty
+Pack(struct record_connect {
+    u32 player_id;
+});
+
+Pack(struct record_disconnect {
+    u32 player_id;
+});
+
+// client_sim_tick is stored as how far behind the simulation tick it is,
+// and the lag compensated view tick the same way, 0 if hitscan wasn't
+// rewound
+Pack(struct record_input {
+    u32 player_id;
+    u16 client_tick_age;
+    u16 view_tick_age;
+    struct packed_input input;
+});
+
+Pack(struct record_spawn {
+    u32 player_id;
+    struct random_series_pcg random;
+});
+
+Pack(struct record_kill {
+    u32 player_id;
+});
+
+// Written every network tick
+Pack(struct record_checksum {
+    u64 hash;
+    u32 num_players;
+});
+
+static const size_t record_payload_size[RECORD_LAST] = {
+    [RECORD_TICK]       = sizeof(struct record_tick),
+    [RECORD_CONNECT]    = sizeof(struct record_connect),
+    [RECORD_DISCONNECT] = sizeof(struct record_disconnect),
+    [RECORD_INPUT]      = sizeof(struct record_input),
+    [RECORD_SPAWN]      = sizeof(struct record_spawn),
+    [RECORD_KILL]       = sizeof(struct record_kill),
+    [RECORD_CHECKSUM]   = sizeof(struct record_checksum),
+};
+
+//
+// Checksum
+//
+
+// FNV-1a over the simulated state of all players, in map order, and all
+// nades in flight
+static inline u64 record_hash(u64 hash, const void *data, size_t size) {
+    const u8 *bytes = data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static inline struct record_checksum record_checksum(struct game *game) {
+    struct record_checksum c = {
+        .hash = 0xcbf29ce484222325ull,
+    };
+    HashMapForEach(game->player_map, struct player, p) {
+        c.hash = record_hash(c.hash, &p->id, sizeof(p->id));
+        c.hash = record_hash(c.hash, &p->pos, sizeof(p->pos));
+        c.hash = record_hash(c.hash, &p->velocity, sizeof(p->velocity));
+        c.hash = record_hash(c.hash, &p->health, sizeof(p->health));
+        c.hash = record_hash(c.hash, &p->state, sizeof(p->state));
+        ++c.num_players;
+    }
+    ForEachList(game->nade_list, struct nade_projectile, nade) {
+        c.hash = record_hash(c.hash, &nade->pos, sizeof(nade->pos));
+    }
+    return c;
+}
+
+//
+// Writing
+//
+
+struct recorder {
+    FILE *file;
+    u64 sim_tick;
+    bool tick_written;
+};
+
+static inline bool recorder_open(struct recorder *r, const char *path, u64 seed, const struct map *m) {
+    r->file = fopen(path, "wb");
+    if (r->file == NULL)
+        return false;
+    setvbuf(r->file, NULL, _IOFBF, RECORD_FILE_BUFFER_SIZE);
+    r->tick_written = false;
+
+    const struct record_file_header header = {
+        .magic = RECORD_MAGIC,
+        .version = RECORD_VERSION,
+        .codec_version = CODEC_VERSION,
+        .fps = FPS,
+        .net_per_sim_ticks = NET_PER_SIM_TICKS,
+        .map_width = m->width,
+        .map_height = m->height,
+        .seed = seed,
+    };
+    fwrite(&header, sizeof(header), 1, r->file);
+    return true;
+}
+
+static inline void recorder_close(struct recorder *r) {
+    if (r->file != NULL)
+        fclose(r->file);
+    r->file = NULL;
+}
+
+static inline void record_write(struct recorder *r, u64 sim_tick, enum record_type type, const void *payload) {
+    if (r->file == NULL)
+        return;
+
+    if (!r->tick_written || sim_tick != r->sim_tick) {
+        const u8 tick_type = RECORD_TICK;
+        const struct record_tick tick = {sim_tick};
+        fwrite(&tick_type, 1, 1, r->file);
+        fwrite(&tick, sizeof(tick), 1, r->file);
+        r->sim_tick = sim_tick;
+        r->tick_written = true;
+    }
+
+    const u8 type_byte = type;
+    fwrite(&type_byte, 1, 1, r->file);
+    fwrite(payload, record_payload_size[type], 1, r->file);
+}
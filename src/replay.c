@@ -0,0 +1,268 @@
+#include "record.h"
+#include "match.h"
+#include "game.h"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Replays a match log written by the server with --record, see record.h.
+//
+// Inputs, connects and spawns are fed through update_player and
+// update_projectiles exactly like match_tick does, without any
+// networking, and kills and checksums are compared against what the
+// server recorded. Prints how long the simulation took so recorded
+// matches can be used as workloads, and exits with 1 if the outcome
+// differs so they can be used as regression tests.
+//
+
+#define MAX_KILLS_PER_TICK 256
+
+struct replay_stats {
+    u64 num_ticks;
+    u64 num_inputs;
+    u64 num_spawns;
+    u64 num_kills;
+    u64 num_checksums;
+    u64 num_mismatches;
+    u64 first_mismatch_tick;
+    u64 sim_time;
+};
+
+struct replay {
+    struct game *game;
+    struct replay_stats stats;
+
+    // Current tick, and whether its simulation step has run
+    u64 sim_tick;
+    bool stepped;
+
+    PlayerId killed[MAX_KILLS_PER_TICK];
+    u32 num_killed;
+    u32 num_kills_checked;
+};
+
+static void replay_mismatch(struct replay *r, const char *what) {
+    if (r->stats.num_mismatches == 0) {
+        printf("First mismatch at tick %lu: %s\n", r->sim_tick, what);
+        r->stats.first_mismatch_tick = r->sim_tick;
+    }
+    ++r->stats.num_mismatches;
+}
+
+// Everything match_tick does to the game after spawning players
+static void replay_step(struct replay *r) {
+    struct game *game = r->game;
+    const f32 dt = 1.0f / (f32) FPS;
+    const u64 start = time_current();
+
+    ListClear(game->new_nade_list);
+    ListClear(game->new_hitscan_list);
+    ListClear(game->sound_list);
+    ListClear(game->step_list);
+
+    player_history_record(game, r->sim_tick);
+    update_projectiles(game, dt);
+    ListClear(game->sound_list);
+
+    r->num_killed = 0;
+    ForEachList(game->damage_list, struct damage_entry, d) {
+        struct player *p = NULL;
+        HashMapLookup(game->player_map, d->player_id, p);
+        p->health -= d->damage;
+        if (p->health <= 0.0f && r->num_killed < MAX_KILLS_PER_TICK)
+            r->killed[r->num_killed++] = p->id;
+    }
+    ListClear(game->damage_list);
+
+    r->stats.sim_time += time_current() - start;
+    r->stepped = true;
+    r->num_kills_checked = 0;
+}
+
+static void replay_end_tick(struct replay *r) {
+    if (!r->stepped)
+        replay_step(r);
+    if (r->num_kills_checked != r->num_killed)
+        replay_mismatch(r, "more kills than recorded");
+    ++r->stats.num_ticks;
+    ++r->sim_tick;
+    r->stepped = false;
+}
+
+static bool replay_run(const u8 *data, size_t size, struct replay_stats *stats) {
+    struct replay r = {
+        .game = calloc(1, sizeof(struct game)),
+    };
+    assert(r.game);
+    r.game->map = map;
+    const f32 dt = 1.0f / (f32) FPS;
+
+    struct byte_buffer buffer = byte_buffer_init((u8 *) data, size);
+    buffer.top += sizeof(struct record_file_header);
+
+    bool started = false;
+    bool ok = true;
+    while (buffer.top < buffer.base + buffer.size) {
+        u8 *type;
+        POP(&buffer, &type);
+        if (*type >= RECORD_LAST) {
+            printf("Corrupt log at offset %lu\n", (u64) (buffer.top - buffer.base));
+            ok = false;
+            break;
+        }
+        // Servers that didn't shut down cleanly leave a partial record
+        if (buffer.top + record_payload_size[*type] > buffer.base + buffer.size) {
+            printf("Log ends mid record at offset %lu, ignoring it\n", (u64) (buffer.top - buffer.base));
+            break;
+        }
+
+        switch (*type) {
+        case RECORD_TICK: {
+            struct record_tick *tick;
+            POP(&buffer, &tick);
+            if (!started) {
+                r.sim_tick = tick->sim_tick;
+                started = true;
+            }
+            // Ticks without records still move projectiles
+            while (r.sim_tick < tick->sim_tick)
+                replay_end_tick(&r);
+        } break;
+
+        case RECORD_CONNECT: {
+            struct record_connect *connect;
+            POP(&buffer, &connect);
+            struct player *p = NULL;
+            HashMapInsert(r.game->player_map, connect->player_id, p);
+        } break;
+
+        case RECORD_DISCONNECT: {
+            struct record_disconnect *disconnect;
+            POP(&buffer, &disconnect);
+            HashMapRemove(r.game->player_map, disconnect->player_id);
+        } break;
+
+        case RECORD_INPUT: {
+            struct record_input *record;
+            POP(&buffer, &record);
+
+            struct player *p = NULL;
+            HashMapLookup(r.game->player_map, record->player_id, p);
+
+            const u64 start = time_current();
+            r.game->view_tick = (record->view_tick_age != 0) ? r.sim_tick - record->view_tick_age : 0;
+            struct input input = input_decode(&record->input);
+            update_player(r.game, p, &input, dt);
+            r.game->view_tick = 0;
+            collect_and_resolve_static_collisions(r.game);
+            r.stats.sim_time += time_current() - start;
+            ++r.stats.num_inputs;
+        } break;
+
+        case RECORD_SPAWN: {
+            struct record_spawn *spawn;
+            POP(&buffer, &spawn);
+
+            struct player *p = NULL;
+            HashMapLookup(r.game->player_map, spawn->player_id, p);
+            struct random_series_pcg random = spawn->random;
+            match_spawn_player(&random, &r.game->map, p);
+            ++r.stats.num_spawns;
+        } break;
+
+        case RECORD_KILL: {
+            struct record_kill *kill;
+            POP(&buffer, &kill);
+            if (!r.stepped)
+                replay_step(&r);
+            if (r.num_kills_checked >= r.num_killed || r.killed[r.num_kills_checked] != kill->player_id)
+                replay_mismatch(&r, "recorded kill didn't happen");
+            ++r.num_kills_checked;
+            ++r.stats.num_kills;
+        } break;
+
+        case RECORD_CHECKSUM: {
+            struct record_checksum *checksum;
+            POP(&buffer, &checksum);
+            if (!r.stepped)
+                replay_step(&r);
+            const struct record_checksum c = record_checksum(r.game);
+            if (c.hash != checksum->hash || c.num_players != checksum->num_players)
+                replay_mismatch(&r, "checksum differs");
+            ++r.stats.num_checksums;
+        } break;
+        }
+    }
+    if (started)
+        replay_end_tick(&r);
+
+    HashMapFree(r.game->player_map);
+    free(r.game);
+    *stats = r.stats;
+    return ok && r.stats.num_mismatches == 0;
+}
+
+static void usage(const char *name) {
+    printf("usage: %s <match log> [--repeat N]\n", name);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    u32 repeat = 1;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--repeat") == 0 && i+1 < argc) {
+            repeat = (u32) atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        printf("Failed to open %s\n", argv[1]);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    const size_t size = (size_t) ftell(file);
+    fseek(file, 0, SEEK_SET);
+    u8 *data = malloc(size);
+    assert(data);
+    const bool read_ok = fread(data, 1, size, file) == size;
+    fclose(file);
+
+    const struct record_file_header *header = (const void *) data;
+    if (!read_ok || size < sizeof(*header) || header->magic != RECORD_MAGIC || header->version != RECORD_VERSION) {
+        printf("%s is not a version %u match log\n", argv[1], RECORD_VERSION);
+        return 1;
+    }
+    if (header->codec_version != CODEC_VERSION || header->fps != FPS || header->net_per_sim_ticks != NET_PER_SIM_TICKS ||
+        header->map_width != map.width || header->map_height != map.height) {
+        printf("%s was recorded with a different codec, simulation mode, tick rate or map\n", argv[1]);
+        return 1;
+    }
+
+    time_init();
+
+    bool ok = true;
+    for (u32 i = 0; i < repeat; ++i) {
+        struct replay_stats stats = {0};
+        ok = replay_run(data, size, &stats) && ok;
+
+        printf("%lu ticks (%.1f s) | %lu inputs | %lu spawns | %lu kills | %lu checksums | %lu mismatches | sim: %.1f us per tick, %.0f ns per input\n",
+               stats.num_ticks, (f64) stats.num_ticks / FPS,
+               stats.num_inputs, stats.num_spawns, stats.num_kills,
+               stats.num_checksums, stats.num_mismatches,
+               (stats.num_ticks > 0) ? (f64) stats.sim_time / 1000.0 / stats.num_ticks : 0.0,
+               (stats.num_inputs > 0) ? (f64) stats.sim_time / stats.num_inputs : 0.0);
+    }
+
+    free(data);
+    time_deinit();
+    return ok ? 0 : 1;
+}
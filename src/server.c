@@ -1,12 +1,17 @@
 #define ENET_IMPLEMENTATION
 #include "enet.h"
-#include "packet.h"
+#include "match.h"
+#include "net.h"
+#include "transport.h"
+#include "trace.h"
 #include "common.h"
-#include "random.h"
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 
 #if defined(DRAW)
 #include "draw.h"
@@ -16,668 +21,286 @@
 #define HEIGHT 600
 #endif
 
-#define PACKET_LOG_SIZE 2048
-#define OUTPUT_BUFFER_SIZE 32000
-#define INPUT_BUFFER_LENGTH 16
-#define UPDATE_LOG_BUFFER_SIZE 512
-#define VALID_TICK_WINDOW 5
+atomic_bool running = true;
 
-bool running = true;
+// Seconds between match profile dumps, 0 to only dump on SIGUSR1
+static u32 profile_interval = 10;
 
-//
-// TODO(anjo): We should attach adjustment info to the earliest possible packet that returns to the
-//             client. Currently we attach the adjustment info whenever we process the update packet.
-//             This should lead to delays in getting the client synced, but shouldn't cause more problems
-//             than that.
-//
+// Bumped on SIGUSR1, workers dump the profile of their matches when it
+// changes
+static atomic_uint profile_requests = 0;
 
-struct update_log_entry {
-    u64 client_sim_tick;
-    u64 server_net_tick;
-    struct client_packet_update input_update;
-};
+// Shut down cleanly on SIGINT/SIGTERM so match logs are flushed, dump
+// match profiles on SIGUSR1
+static void handle_signal(int sig) {
+    if (sig == SIGUSR1) {
+        atomic_fetch_add(&profile_requests, 1);
+        return;
+    }
+    running = false;
+}
 
-struct update_log_buffer {
-    struct update_log_entry data[UPDATE_LOG_BUFFER_SIZE];
-    u64 bottom;
-    u64 used;
-};
+//
+// Workers
+//
+// Each worker ticks a fixed set of matches in lockstep at FPS, waiting on
+// its own tick scheduler. Matches are assigned round robin at startup.
+//
 
-struct server_peer {
-    PlayerId id;
-    struct update_log_buffer update_log;
-    struct byte_buffer output_buffer;
-    ENetPeer *enet_peer;
-    bool has_specified_adjustment_this_frame;
+struct worker {
+    u32 id;
+    pthread_t thread;
+    struct match **matches;
+    u32 num_matches;
+    bool verbose;
+    u32 profile_requests;
+    char name[32];
 };
 
-static inline void new_packet(struct server_peer *p) {
-    struct server_batch_header *batch = (void *) p->output_buffer.base;
-    assert(batch->num_packets < UINT16_MAX);
-    ++batch->num_packets;
+static int compare_u64(const void *a, const void *b) {
+    const u64 x = *(const u64 *) a;
+    const u64 y = *(const u64 *) b;
+    return (x > y) - (x < y);
 }
 
-static inline void randomize_player_spawn(struct random_series_pcg *random, struct map m, struct player *p) {
-retry:;
-
-    f32 x = m.width  * random_next_unilateral(random);
-    f32 y = m.height * random_next_unilateral(random);
-    if (map_at(&m, (v2){x,y}) == TILE_STONE)
-        goto retry;
-    p->pos.x = x;
-    p->pos.y = y;
+// p in [0,1], sorts values
+static u64 percentile(u64 *values, u32 num_values, f64 p) {
+    qsort(values, num_values, sizeof(values[0]), compare_u64);
+    const u32 index = (u32) (p*(num_values - 1) + 0.5);
+    return values[index];
 }
 
-struct respawn_list_item {
-    PlayerId id;
-    f32 time_left;
-};
-
-int main() {
-    if (enet_initialize() != 0) {
-        printf("An error occurred while initializing ENet.\n");
-        return 1;
-    }
-
-    ENetAddress address = {0};
-
-    address.host = ENET_HOST_ANY;
-    address.port = 9053;
-
-    /* create a server */
-    ENetHost *server = enet_host_create(&address, MAX_CLIENTS, 1, 0, 0);
-
-    if (server == NULL) {
-        printf("An error occurred while trying to create an ENet server host.\n");
-        return 1;
-    }
-
-    ENetEvent event = {0};
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
 
-    f32 t = 0.0f;
-    f32 fps = 0.0f;
+    struct tick_scheduler scheduler = tick_scheduler_init(NANOSECONDS(1) / FPS);
+    trace_thread_name(w->name);
 
-    struct frame frame = {
-        .desired_delta = NANOSECONDS(1) / (f32) FPS,
-        .dt = 1.0f / (f32) FPS,
-    };
+    // Time spent in the last FPS frames, excluding waiting for the next tick
+    u64 frame_times[FPS] = {0};
+    u64 tick = 0;
 
-    struct game game = {
-        .map = map,
-    };
-
-    HashMap(struct server_peer, MAX_CLIENTS) peer_map = {0};
+    while (running) {
+        const u64 frame_start = time_current();
+        trace_begin_at("frame", frame_start);
 
-    struct random_series_pcg random = random_seed_pcg(0x9053, 0x9005);
+        u32 num_players = 0;
+        for (u32 i = 0; i < w->num_matches; ++i) {
+            num_players += match_tick(w->matches[i]);
+            if (match_quit_requested(w->matches[i]))
+                running = false;
+        }
 
-#if defined(DRAW)
-    InitWindow(WIDTH, HEIGHT, "floating");
-    HideCursor();
+        const u64 frame_end = time_current();
+        frame_times[tick % FPS] = frame_end - frame_start;
+        trace_end_at("frame", frame_end);
+        ++tick;
+
+#if !defined(DRAW)
+        if (tick % FPS == 0) {
+            u64 sorted_frame_times[FPS];
+            memcpy(sorted_frame_times, frame_times, sizeof(frame_times));
+            const u64 p50 = percentile(sorted_frame_times, FPS, 0.50);
+            const u64 p99 = percentile(sorted_frame_times, FPS, 0.99);
+
+            const struct tick_stats *stats = &scheduler.stats;
+            if (w->verbose) {
+                printf("frame: %7.1f us p50, %7.1f us p99, %7.1f us max\n",
+                       p50/1000.0, p99/1000.0, sorted_frame_times[FPS-1]/1000.0);
+                if (stats->num_ticks > 0)
+                    printf("jitter: %6.1f us mean, %6.1f us stddev, %7.1f us max | spin: %5.1f us | overruns: %lu | catch-up: %lu | dropped: %lu\n",
+                           tick_stats_jitter_mean(stats)/1000.0, sqrt(tick_stats_jitter_variance(stats))/1000.0, stats->jitter_max/1000.0,
+                           scheduler.spin/1000.0, stats->num_overruns, stats->num_catch_up_ticks, stats->num_dropped_ticks);
+            } else {
+                printf("worker %2u: %3u matches, %4u players | frame: %7.1f us p50, %7.1f us p99 | jitter: %6.1f us max | overruns: %lu\n",
+                       w->id, w->num_matches, num_players, p50/1000.0, p99/1000.0,
+                       (stats->num_ticks > 0) ? stats->jitter_max/1000.0 : 0.0, stats->num_overruns);
+            }
+            tick_stats_reset(&scheduler.stats);
+        }
 #endif
 
-    List(struct respawn_list_item, MAX_CLIENTS) respawn_list = {0};
+        const u32 requests = atomic_load(&profile_requests);
+        const bool dump_requested = requests != w->profile_requests;
+        w->profile_requests = requests;
+        const bool dump_periodic = profile_interval > 0 && tick % (profile_interval*FPS) == 0;
+        if (dump_requested || dump_periodic) {
+            for (u32 i = 0; i < w->num_matches; ++i) {
+                match_profile_print(w->matches[i]);
+                // Requested dumps don't cut the periodic window short
+                if (dump_periodic)
+                    match_profile_reset(w->matches[i]);
+            }
+        }
 
-    u64 total_delta = 0;
+        trace_begin("wait");
+        tick_scheduler_wait(&scheduler);
+        trace_end("wait");
+    }
 
-    struct frame_debug_data frame_debug = {0};
+    trace_thread_flush();
+    return NULL;
+}
 
-    while (running) {
-        const u64 total_frame_start = time_current();
-        const u64 frame_start = time_current();
+static void usage(const char *name) {
+    printf("usage: %s [--matches N] [--workers N] [--port N] [--record DIR] [--profile SECONDS] [--trace PATH] [--budget BYTES_PER_SECOND]\n", name);
+}
 
-        // Collect frame debug data
-        if (frame.simulation_tick % FPS == 0) {
-            frame_debug.total_frame_start = time_current();
-            // Save incoming data before each frame so we can compute
-            // bandwidth, for somer reason peer->[incoming|outoing]Bandwidth
-            // is always zero.
-            frame_debug.incoming_data_total_start = 0;
-            frame_debug.outgoing_data_total_start = 0;
-            HashMapForEach(peer_map, struct server_peer, peer) {
-                if (!HashMapExists(peer_map, peer))
-                    continue;
-                frame_debug.incoming_data_total_start += peer->enet_peer->incomingDataTotal;
-                frame_debug.outgoing_data_total_start += peer->enet_peer->outgoingDataTotal;
-            }
+int main(int argc, char **argv) {
+    u32 num_matches = 1;
+    u32 num_workers = 1;
+    u16 port = 9053;
+    const char *record_dir = NULL;
+    const char *trace_path = NULL;
+    u32 budget = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--matches") == 0 && i+1 < argc) {
+            num_matches = (u32) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i+1 < argc) {
+            num_workers = (u32) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--port") == 0 && i+1 < argc) {
+            port = (u16) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--record") == 0 && i+1 < argc) {
+            record_dir = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i+1 < argc) {
+            profile_interval = (u32) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i+1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--budget") == 0 && i+1 < argc) {
+            budget = (u32) atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
         }
+    }
+    if (num_matches == 0 || num_matches > MAX_MATCHES || num_workers == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (num_workers > num_matches)
+        num_workers = num_matches;
 
-        // Handle network
-        if (frame.simulation_tick % NET_PER_SIM_TICKS == 0) {
-            while (enet_host_service(server, &event, 0) > 0) {
-                switch (event.type) {
-                case ENET_EVENT_TYPE_CONNECT: {
-                    i8 ip[64] = {0};
-                    if (enet_address_get_host_ip_new(&event.peer->address, (char *) ip, ARRLEN(ip)) == 0) {
-                        printf("A new client connected from %s:%u.\n", ip, event.peer->address.port);
-                    } else {
-                        printf("A new client connected from ????:%u.\n", event.peer->address.port);
-                    }
-
-                    const u64 id = player_id();
-
-                    event.peer->data = malloc(sizeof(PlayerId));
-                    *(PlayerId *)event.peer->data = id;
-
-                    struct server_peer *peer = NULL;
-                    HashMapInsert(peer_map, id, peer);
-                    peer->enet_peer = event.peer;
-                    peer->output_buffer = byte_buffer_alloc(OUTPUT_BUFFER_SIZE);
-
-                    struct player *p = NULL;
-                    HashMapInsert(game.player_map, id, p);
-
-                    struct respawn_list_item item = {id, 0.1f};
-                    ListInsert(respawn_list, item);
-
-                    struct server_batch_header batch = {
-                        .num_packets = 0,
-                    };
-                    APPEND(&peer->output_buffer, &batch);
-
-                    // Send greeting for peer
-                    {
-                        struct server_header header = {
-                            .type = SERVER_PACKET_GREETING,
-                        };
-
-                        struct server_packet_greeting greeting = {
-                            .initial_net_tick = frame.network_tick,
-                            .id = id,
-                        };
-
-                        new_packet(peer);
-                        APPEND(&peer->output_buffer, &header);
-                        APPEND(&peer->output_buffer, &greeting);
-                    }
-
-                    // Send greeting to all other peers
-                    {
-                        struct server_header header = {
-                            .type = SERVER_PACKET_PEER_GREETING,
-                        };
-
-                        struct server_packet_peer_greeting greeting = {
-                            .id = id,
-                        };
-
-                        HashMapForEach(peer_map, struct server_peer, other_peer) {
-                            if (!HashMapExists(peer_map, other_peer) || peer == other_peer)
-                                continue;
-                            new_packet(other_peer);
-                            APPEND(&other_peer->output_buffer, &header);
-                            APPEND(&other_peer->output_buffer, &greeting);
-                        }
-                    }
-
-                    // Send greeting to this peer about all other peers already connected
-                    {
-                        struct server_header header = {
-                            .type = SERVER_PACKET_PEER_GREETING,
-                        };
-
-                        HashMapForEach(peer_map, struct server_peer, other_peer) {
-                            if (!HashMapExists(peer_map, other_peer) || peer == other_peer)
-                                continue;
-                            struct server_packet_peer_greeting greeting = {
-                                .id = other_peer->id,
-                            };
-
-                            new_packet(peer);
-                            APPEND(&peer->output_buffer, &header);
-                            APPEND(&peer->output_buffer, &greeting);
-                        }
-                    }
-                    break;
-                }
-                case ENET_EVENT_TYPE_RECEIVE: {
-                    struct byte_buffer net_input_buffer = byte_buffer_init(event.packet->data, event.packet->dataLength);
-                    struct client_batch_header *batch;
-                    POP(&net_input_buffer, &batch);
-
-                    const PlayerId id = *(PlayerId *)event.peer->data;
-
-                    struct server_peer *peer = NULL;
-                    HashMapLookup(peer_map, id, peer);
-
-                    assert(batch->num_packets > 0);
-                    i64 tick = (i64) ((struct client_header *) net_input_buffer.top)->sim_tick;
-
-                    i8 adjustment = 0;
-                    i64 diff = (i64) frame.simulation_tick + (VALID_TICK_WINDOW-1) - tick;
-                    if (diff < INT8_MIN || diff > INT8_MAX) {
-                        printf("net_tick diff outside range of adjustment variable!\n");
-                        // TODO(anjo): what do?
-                        break;
-                    }
-                    if (diff < -(VALID_TICK_WINDOW-1) || diff > 0) {
-                        // Need adjustment
-                        adjustment = (i8) diff;
-                    }
-
-                    if (!peer->has_specified_adjustment_this_frame) {
-                        struct server_batch_header *server_batch = (void *) peer->output_buffer.base;
-                        server_batch->adjustment = adjustment;
-                        server_batch->adjustment_iteration = batch->adjustment_iteration;
-                        peer->has_specified_adjustment_this_frame = true;
-                    }
-
-                    if (tick >= frame.simulation_tick) {
-                        if (diff < -(VALID_TICK_WINDOW-1)) {
-                            printf("Allowing packet, too late: net_tick %lu, should be >= %lu\n", batch->net_tick, frame.network_tick);
-                            printf("adjustment (%u): %d\n", batch->adjustment_iteration, adjustment);
-                        }
-                    } else {
-                        struct server_header response_header = {
-                            .type = SERVER_PACKET_DROPPED,
-                        };
-
-                        printf("Dropping packet, too early: net_tick %lu, should be >= %lu\n", batch->net_tick, frame.network_tick);
-                        printf("adjustment (%u): %d\n", batch->adjustment_iteration, adjustment);
-
-                        new_packet(peer);
-                        APPEND(&peer->output_buffer, &response_header);
-                        break;
-                    }
-
-                    for (u16 packet = 0; packet < batch->num_packets; ++packet) {
-                        struct client_header *header;
-                        POP(&net_input_buffer, &header);
-
-                        switch (header->type) {
-                        case CLIENT_PACKET_UPDATE: {
-                            struct client_packet_update *input_update;
-                            POP(&net_input_buffer, &input_update);
-
-                            struct update_log_entry entry = {
-                                .client_sim_tick = header->sim_tick,
-                                .server_net_tick = frame.network_tick,
-                                .input_update = *input_update,
-                            };
-                            CIRCULAR_BUFFER_APPEND(&peer->update_log, entry);
-                        } break;
-                        default:
-                            printf("Received unknown packet type %d\n", header->type);
-                        }
-                    }
-                } break;
-
-                case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
-                case ENET_EVENT_TYPE_DISCONNECT: {
-                    PlayerId id = *(PlayerId *) event.peer->data;
-
-                    struct server_peer *peer = NULL;
-                    HashMapLookup(peer_map, id, peer);
-
-                    printf("%d disconnected (%s).\n", id, (event.type == ENET_EVENT_TYPE_DISCONNECT_TIMEOUT) ? "timeout" : "quit");
-
-                    {
-                        struct server_header response_header = {
-                            .type = SERVER_PACKET_PEER_DISCONNECTED,
-                        };
-
-                        struct server_packet_peer_disconnected disc = {
-                            .player_id = id,
-                        };
-
-                        HashMapForEach(peer_map, struct server_peer, other_peer) {
-                            if (!HashMapExists(peer_map, other_peer) || other_peer == peer)
-                                continue;
-                            new_packet(other_peer);
-                            APPEND(&other_peer->output_buffer, &response_header);
-                            APPEND(&other_peer->output_buffer, &disc);
-                        }
-                    }
-
-                    byte_buffer_free(&peer->output_buffer);
-                    HashMapRemove(game.player_map, id);
-                    HashMapRemove(peer_map, id);
-                    free(event.peer->data);
-                    event.peer->data = NULL;
-                } break;
-
-                case ENET_EVENT_TYPE_NONE:
-                    break;
-                }
-                enet_packet_destroy(event.packet);
-            }
-        }
+#if defined(DRAW)
+    if (num_matches > 1) {
+        printf("Only a single match is supported when drawing.\n");
+        return 1;
+    }
+#endif
 
-        HashMapForEach(peer_map, struct server_peer, peer) {
-            if (!HashMapExists(peer_map, peer))
-                continue;
-
-            struct player *player = NULL;
-            HashMapLookup(game.player_map, peer->id, player);
-
-            while (peer->update_log.used > 0) {
-                struct update_log_entry *entry = &peer->update_log.data[peer->update_log.bottom];
-                if (entry->client_sim_tick > frame.simulation_tick)
-                    break;
-
-                struct input input = entry->input_update.input;
-                update_player(&game, player, &input, frame.dt);
-                collect_and_resolve_static_collisions(&game);
-
-                // Send AUTH packet to peer
-                {
-                    struct server_header response_header = {
-                        .type = SERVER_PACKET_AUTH,
-                    };
-
-                    struct server_packet_auth auth = {
-                        .sim_tick = entry->client_sim_tick,
-                        .player = *player,
-                    };
-
-                    new_packet(peer);
-                    APPEND(&peer->output_buffer, &response_header);
-                    APPEND(&peer->output_buffer, &auth);
-                }
-
-                // Send PEER_AUTH packet to all other peers
-                // TODO(anjo): We are not attaching any adjustment data here
-                {
-                    struct server_header response_header = {
-                        .type = SERVER_PACKET_PEER_AUTH,
-                    };
-
-                    struct server_packet_peer_auth peer_auth = {
-                        .sim_tick = entry->client_sim_tick,
-                        .player = *player,
-                    };
-
-                    HashMapForEach(peer_map, struct server_peer, other_peer) {
-                        if (!HashMapExists(peer_map, other_peer) || other_peer == peer)
-                            continue;
-                        new_packet(other_peer);
-                        APPEND(&other_peer->output_buffer, &response_header);
-                        APPEND(&other_peer->output_buffer, &peer_auth);
-                    }
-                }
-
-                CIRCULAR_BUFFER_POP(&peer->update_log);
-            }
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGUSR1, handle_signal);
 
-            //struct collision_result results[16] = {0};
-            //u32 num_results = 0;
-            //collect_dynamic_collisions(&game, results, &num_results, 16);
-            //resolve_dynamic_collisions(&game, results, num_results);
-        }
+    if (enet_initialize() != 0) {
+        printf("An error occurred while initializing ENet.\n");
+        return 1;
+    }
 
-        ForEachList(respawn_list, struct respawn_list_item, item) {
-            item->time_left -= frame.dt;
+    ENetAddress address = {0};
 
-            if (item->time_left <= 0.0f) {
-                struct player *p = NULL;
-                HashMapLookup(game.player_map, item->id, p);
+    address.host = ENET_HOST_ANY;
+    address.port = port;
 
-                randomize_player_spawn(&random, game.map, p);
-                p->weapons[0] = PLAYER_WEAPON_SNIPER;
-                p->weapons[1] = PLAYER_WEAPON_NADE;
-                p->hue = 20.0f + 80.0f*p->id;
-                p->health = 100.0f;
+    /* create a server */
+    u32 max_peers = num_matches*MAX_PLAYERS_PER_MATCH;
+    if (max_peers > ENET_PROTOCOL_MAXIMUM_PEER_ID)
+        max_peers = ENET_PROTOCOL_MAXIMUM_PEER_ID;
+    ENetHost *server = enet_host_create(&address, max_peers, 1, 0, 0);
 
-                struct server_peer *peer = NULL;
-                HashMapLookup(peer_map, item->id, peer);
+    if (server == NULL) {
+        printf("An error occurred while trying to create an ENet server host.\n");
+        return 1;
+    }
 
-                {
-                    struct server_header response_header = {
-                        .type = SERVER_PACKET_PLAYER_SPAWN,
-                    };
+    time_init();
 
-                    struct server_packet_player_spawn spawn = {
-                        .player = *p,
-                    };
+    // Threads pick up tracing when they start, so open it before any
+    if (trace_path != NULL && !trace_open(trace_path)) {
+        printf("Failed to open %s for tracing.\n", trace_path);
+        return 1;
+    }
 
-                    new_packet(peer);
-                    APPEND(&peer->output_buffer, &response_header);
-                    APPEND(&peer->output_buffer, &spawn);
-                }
+    struct transport transport = {
+        .host = server,
+    };
 
-                ListTagRemovePtr(respawn_list, item);
-            }
-        }
-        ListRemoveTaggedItems(respawn_list);
-
-        // TODO(anjo): We can always send all new nades in a single packet
-        // instead of as separate packets
-        //
-        // @OPTIMIZATION
-        ForEachList(game.new_nade_list, struct nade_projectile, nade) {
-            struct player *p = NULL;
-            HashMapLookup(game.player_map, nade->player_id_from, p);
-
-            // Loop over all connected peers and send nade packet
-            HashMapForEach(peer_map, struct server_peer, other_peer) {
-                if (!HashMapExists(peer_map, other_peer) || other_peer->id == p->id)
-                    continue;
-
-                {
-                    struct server_header header = {
-                        .type = SERVER_PACKET_NADE,
-                    };
-
-                    struct server_packet_nade nade_packet = {
-                        .nade = *nade,
-                    };
-
-                    new_packet(other_peer);
-                    APPEND(&other_peer->output_buffer, &header);
-                    APPEND(&other_peer->output_buffer, &nade_packet);
-                }
+    static struct net_io net = {0};
+    net.transport = &transport;
+    net.verbose = true;
+    net.num_matches = num_matches;
+    net.matches = calloc(num_matches, sizeof(struct match_net));
+    assert(net.matches);
+
+    struct match **matches = calloc(num_matches, sizeof(struct match *));
+    assert(matches);
+    for (u32 i = 0; i < num_matches; ++i) {
+        matches[i] = match_create(i, &net.matches[i], 0x9053 + i, num_matches == 1);
+        match_set_budget(matches[i], budget);
+        if (record_dir != NULL) {
+            char path[512];
+            snprintf(path, sizeof(path), "%s/match-%u.rec", record_dir, i);
+            if (!match_record(matches[i], path)) {
+                printf("Failed to open %s for recording.\n", path);
+                return 1;
             }
         }
+    }
 
-        // TODO(anjo): We can always send all new hitscans in a single packet
-        // instead of as separate packets
-        //
-        // @OPTIMIZATION
-        ForEachList(game.new_hitscan_list, struct hitscan_projectile, hitscan) {
-            struct player *p = NULL;
-            HashMapLookup(game.player_map, hitscan->player_id_from, p);
-
-            // Loop over all connected peers and send hitscan packet
-            HashMapForEach(peer_map, struct server_peer, other_peer) {
-                if (!HashMapExists(peer_map, other_peer) || other_peer->id == p->id)
-                    continue;
-
-                {
-                    struct server_header header = {
-                        .type = SERVER_PACKET_HITSCAN,
-                    };
-
-                    struct server_packet_hitscan hitscan_packet = {
-                        .hitscan = *hitscan,
-                    };
-
-                    new_packet(other_peer);
-                    APPEND(&other_peer->output_buffer, &header);
-                    APPEND(&other_peer->output_buffer, &hitscan_packet);
-                }
-            }
-        }
-        ListClear(game.new_nade_list);
-        ListClear(game.new_hitscan_list);
-
-        // TODO(anjo): We can always send all new sounds in a single packet
-        // instead of as separate packets
-        //
-        // @OPTIMIZATION
-        ForEachList(game.sound_list, struct spatial_sound, sound) {
-            struct player *p = NULL;
-            HashMapLookup(game.player_map, sound->player_id_from, p);
-
-            // Loop over all connected peers and send hitscan packet
-            HashMapForEach(peer_map, struct server_peer, other_peer) {
-                if (!HashMapExists(peer_map, other_peer) || other_peer->id == p->id)
-                    continue;
-
-                {
-                    struct server_header header = {
-                        .type = SERVER_PACKET_SOUND,
-                    };
-
-                    struct server_packet_sound sound_packet = {
-                        .sound = *sound,
-                    };
-
-                    new_packet(other_peer);
-                    APPEND(&other_peer->output_buffer, &header);
-                    APPEND(&other_peer->output_buffer, &sound_packet);
-                }
-            }
-        }
-        ListClear(game.sound_list);
-
-        // TODO(anjo): We can always send all new steps in a single packet
-        // instead of as separate packets
-        //
-        // @OPTIMIZATION
-        ForEachList(game.step_list, struct step, step) {
-            struct player *p = NULL;
-            HashMapLookup(game.player_map, step->player_id_from, p);
-
-            // Loop over all connected peers and send hitscan packet
-            HashMapForEach(peer_map, struct server_peer, other_peer) {
-                if (!HashMapExists(peer_map, other_peer) || other_peer->id == p->id)
-                    continue;
-
-                {
-                    struct server_header header = {
-                        .type = SERVER_PACKET_STEP,
-                    };
-
-                    struct server_packet_step step_packet = {
-                        .step = *step,
-                    };
-
-                    new_packet(other_peer);
-                    APPEND(&other_peer->output_buffer, &header);
-                    APPEND(&other_peer->output_buffer, &step_packet);
-                }
-            }
-        }
-        // We don't care about keeping track of "alive" steps, only which steps
-        // occured this frame, so clear the list.
-        ListClear(game.step_list);
-
-        // Now it's time for per-frame updates
-        update_projectiles(&game, frame.dt);
-        // We don't care about sounds made in update_projectiles as these
-        // are already handled by peers as we sync projectiles
-        ListClear(game.sound_list);
-
-        // Apply damage
-        ForEachList(game.damage_list, struct damage_entry, d) {
-            struct player *p = NULL;
-            HashMapLookup(game.player_map, d->player_id, p);
-            p->health -= d->damage;
-
-            if (p->health <= 0.0f) {
-                struct respawn_list_item item = {p->id, 1.0f};
-                ListInsert(respawn_list, item);
-
-                // Loop over all connected peers and send kill packet
-                HashMapForEach(peer_map, struct server_peer, other_peer) {
-                    if (!HashMapExists(peer_map, other_peer))
-                        continue;
-
-                    {
-                        struct server_header header = {
-                            .type = SERVER_PACKET_PLAYER_KILL,
-                        };
-
-                        struct server_packet_player_kill kill = {
-                            .player_id = p->id,
-                        };
-
-                        new_packet(other_peer);
-                        APPEND(&other_peer->output_buffer, &header);
-                        APPEND(&other_peer->output_buffer, &kill);
-                    }
-                }
-            }
-        }
-        ListClear(game.damage_list);
-
-        // If we're on a network tick, then send batch
-        if (frame.simulation_tick % NET_PER_SIM_TICKS == 0) {
-            HashMapForEach(peer_map, struct server_peer, peer) {
-                if (!HashMapExists(peer_map, peer))
-                    continue;
-                const size_t size = (intptr_t) peer->output_buffer.top - (intptr_t) peer->output_buffer.base;
-                if (size > sizeof(struct server_batch_header)) {
-                    ENetPacket *packet = enet_packet_create(peer->output_buffer.base, size, ENET_PACKET_FLAG_UNSEQUENCED);
-                    enet_peer_send(peer->enet_peer, 0, packet);
-                    peer->output_buffer.top = peer->output_buffer.base;
-
-                    peer->has_specified_adjustment_this_frame = false;
-
-                    struct server_batch_header batch = {
-                        .num_packets = 0,
-                    };
-                    APPEND(&peer->output_buffer, &batch);
-                }
-            }
-        }
+    atomic_store(&net.running, true);
+    if (pthread_create(&net.thread, NULL, net_thread, &net) != 0) {
+        printf("Failed to create network thread.\n");
+        return 1;
+    }
 
 #if defined(DRAW)
-        if (IsKeyDown(KEY_Q))
-            running = false;
-        BeginDrawing();
-        ClearBackground(RAYWHITE);
-        //draw_game(&game, t);
-
-        draw_all_debug_v2s((struct camera) {0});
-
-        DrawText("server", 10, 10, 20, BLACK);
-        if (frame.simulation_tick % FPS == 0) {
-            fps = 1.0f / ((f32)frame.delta/(f32)NANOSECONDS(1));
-        }
-        if (!isinf(fps))
-            DrawText(TextFormat("fps: %.0f", fps), 10, 30, 20, GRAY);
-
-        EndDrawing();
-#else
-        if (frame.simulation_tick % FPS == 0) {
-            if (!isinf(fps))
-                printf("fps: %10.0f (%.0f) | in: %10u | out: %10u \n", frame_debug.fps, 1000000000.0f/((f32)frame_debug.total_delta), frame_debug.incoming_bandwidth, frame_debug.outgoing_bandwidth);
-        }
+    InitWindow(WIDTH, HEIGHT, "floating");
+    HideCursor();
 #endif
 
-        // End frame
-        const u64 frame_end = time_current();
-        frame.delta = frame_end - frame_start;
-        if (frame.delta < frame.desired_delta) {
-            time_nanosleep(frame.desired_delta - frame.delta);
-        }
+    struct worker *workers = calloc(num_workers, sizeof(struct worker));
+    assert(workers);
+    for (u32 i = 0; i < num_workers; ++i) {
+        workers[i].id = i;
+        workers[i].verbose = num_matches == 1;
+        snprintf(workers[i].name, sizeof(workers[i].name), "worker %u", i);
+        workers[i].matches = calloc(num_matches, sizeof(struct match *));
+        assert(workers[i].matches);
+    }
+    for (u32 i = 0; i < num_matches; ++i) {
+        struct worker *w = &workers[i % num_workers];
+        w->matches[w->num_matches++] = matches[i];
+    }
 
-        // Collect frame debug data
-        if (frame.simulation_tick % FPS == 0) {
-            frame_debug.fps = 1.0f / ((f32) frame.delta / (f32) NANOSECONDS(1));
-
-            u32 incoming_data_total_end = 0;
-            u32 outgoing_data_total_end = 0;
-            HashMapForEach(peer_map, struct server_peer, peer) {
-                if (!HashMapExists(peer_map, peer))
-                    continue;
-                incoming_data_total_end += peer->enet_peer->incomingDataTotal;
-                outgoing_data_total_end += peer->enet_peer->outgoingDataTotal;
-            }
-            frame_debug.incoming_bandwidth = FPS * (incoming_data_total_end - frame_debug.incoming_data_total_start);
-            frame_debug.outgoing_bandwidth = FPS * (outgoing_data_total_end - frame_debug.outgoing_data_total_start);
+    if (num_matches > 1)
+        printf("Running %u matches on %u workers, port %u\n", num_matches, num_workers, port);
 
-            frame_debug.total_delta = time_current() - frame_debug.total_frame_start;
+    // The first worker runs on the main thread, drawing has to happen there
+    for (u32 i = 1; i < num_workers; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            printf("Failed to create worker thread.\n");
+            return 1;
         }
-
-        if (frame.simulation_tick % NET_PER_SIM_TICKS == 0)
-            ++frame.network_tick;
-        ++frame.simulation_tick;
-        t += frame.dt;
     }
+    worker_run(&workers[0]);
+    for (u32 i = 1; i < num_workers; ++i)
+        pthread_join(workers[i].thread, NULL);
+
+    atomic_store(&net.running, false);
+    pthread_join(net.thread, NULL);
+    net_free(&net);
+    trace_close();
+
+    for (u32 i = 0; i < num_matches; ++i)
+        match_destroy(matches[i]);
+    for (u32 i = 0; i < num_workers; ++i)
+        free(workers[i].matches);
+    free(workers);
+    free(matches);
+    free(net.matches);
 
     enet_host_destroy(server);
     enet_deinitialize();
+    time_deinit();
 #if defined(DRAW)
     CloseWindow();
 #endif
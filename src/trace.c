@@ -0,0 +1,193 @@
+#include "trace.h"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+bool trace_enabled = false;
+_Thread_local struct trace_buffer *trace_local_buffer = NULL;
+
+static struct {
+    FILE *file;
+    u64 start_time;
+    u32 pid;
+    bool first_event;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool closing;
+
+    // Full buffers waiting to be written, oldest first
+    struct trace_buffer *queue_head;
+    struct trace_buffer *queue_tail;
+    // Written buffers ready for reuse
+    struct trace_buffer *free_list;
+    u32 num_buffers;
+
+    atomic_uint next_tid;
+    atomic_ulong num_dropped;
+} trace = {0};
+
+static _Thread_local u32 trace_local_tid = 0;
+
+static void trace_write_buffer(struct trace_buffer *b) {
+    for (u32 i = 0; i < b->num_events; ++i) {
+        const struct trace_event *e = &b->events[i];
+        const char *separator = trace.first_event ? "\n" : ",\n";
+        trace.first_event = false;
+
+        if (e->phase == TRACE_THREAD_NAME) {
+            fprintf(trace.file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                    separator, trace.pid, b->tid, e->name);
+        } else {
+            const u64 t = (e->time > trace.start_time) ? e->time - trace.start_time : 0;
+            fprintf(trace.file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":%u,\"tid\":%u}",
+                    separator, e->name, e->phase, t / 1000, t % 1000, trace.pid, b->tid);
+        }
+    }
+}
+
+static void *trace_writer(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&trace.mutex);
+    while (true) {
+        while (trace.queue_head == NULL && !trace.closing)
+            pthread_cond_wait(&trace.cond, &trace.mutex);
+        if (trace.queue_head == NULL)
+            break;
+
+        struct trace_buffer *b = trace.queue_head;
+        trace.queue_head = b->next;
+        if (trace.queue_head == NULL)
+            trace.queue_tail = NULL;
+
+        // Format without holding the lock so traced threads can keep
+        // handing over buffers
+        pthread_mutex_unlock(&trace.mutex);
+        trace_write_buffer(b);
+        pthread_mutex_lock(&trace.mutex);
+
+        b->next = trace.free_list;
+        trace.free_list = b;
+    }
+    pthread_mutex_unlock(&trace.mutex);
+
+    return NULL;
+}
+
+// Expects the lock to be held
+static void trace_enqueue(struct trace_buffer *b) {
+    b->next = NULL;
+    if (trace.queue_tail != NULL)
+        trace.queue_tail->next = b;
+    else
+        trace.queue_head = b;
+    trace.queue_tail = b;
+    pthread_cond_signal(&trace.cond);
+}
+
+struct trace_buffer *trace_buffer_next() {
+    if (trace_local_tid == 0)
+        trace_local_tid = atomic_fetch_add(&trace.next_tid, 1) + 1;
+
+    pthread_mutex_lock(&trace.mutex);
+    if (trace_local_buffer != NULL)
+        trace_enqueue(trace_local_buffer);
+
+    struct trace_buffer *b = trace.free_list;
+    if (b != NULL)
+        trace.free_list = b->next;
+    if (b == NULL && trace.num_buffers < TRACE_MAX_BUFFERS) {
+        b = malloc(sizeof(struct trace_buffer));
+        assert(b);
+        ++trace.num_buffers;
+    }
+    pthread_mutex_unlock(&trace.mutex);
+
+    if (b == NULL) {
+        // Events are dropped until the writer catches up
+        trace_local_buffer = NULL;
+        atomic_fetch_add_explicit(&trace.num_dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    b->tid = trace_local_tid;
+    b->num_events = 0;
+    trace_local_buffer = b;
+    return b;
+}
+
+void trace_thread_flush() {
+    struct trace_buffer *b = trace_local_buffer;
+    if (b == NULL)
+        return;
+    trace_local_buffer = NULL;
+
+    pthread_mutex_lock(&trace.mutex);
+    if (b->num_events > 0) {
+        trace_enqueue(b);
+    } else {
+        b->next = trace.free_list;
+        trace.free_list = b;
+    }
+    pthread_mutex_unlock(&trace.mutex);
+}
+
+bool trace_open(const char *path) {
+    trace.file = fopen(path, "w");
+    if (trace.file == NULL)
+        return false;
+
+    trace.start_time = time_current();
+    trace.pid = (u32) getpid();
+    trace.first_event = true;
+    trace.closing = false;
+    pthread_mutex_init(&trace.mutex, NULL);
+    pthread_cond_init(&trace.cond, NULL);
+    fprintf(trace.file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    if (pthread_create(&trace.thread, NULL, trace_writer, NULL) != 0) {
+        fclose(trace.file);
+        trace.file = NULL;
+        return false;
+    }
+
+    trace_enabled = true;
+    return true;
+}
+
+void trace_close() {
+    if (!trace_enabled)
+        return;
+
+    trace_thread_flush();
+    trace_enabled = false;
+
+    pthread_mutex_lock(&trace.mutex);
+    trace.closing = true;
+    pthread_cond_signal(&trace.cond);
+    pthread_mutex_unlock(&trace.mutex);
+    pthread_join(trace.thread, NULL);
+
+    fprintf(trace.file, "\n]}\n");
+    fclose(trace.file);
+    trace.file = NULL;
+
+    const u64 num_dropped = atomic_load(&trace.num_dropped);
+    if (num_dropped > 0)
+        printf("Trace dropped %lu events, the writer couldn't keep up.\n", num_dropped);
+
+    while (trace.free_list != NULL) {
+        struct trace_buffer *b = trace.free_list;
+        trace.free_list = b->next;
+        free(b);
+    }
+    trace.num_buffers = 0;
+
+    pthread_mutex_destroy(&trace.mutex);
+    pthread_cond_destroy(&trace.cond);
+}
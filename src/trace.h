@@ -0,0 +1,106 @@
+#pragma once
+
+#include "common.h"
+
+//
+// Tracing
+//
+// Opt-in begin/end events written as Chrome trace JSON, which can be
+// opened in Perfetto or chrome://tracing to look at individual frames.
+//
+// Every thread appends fixed size events to its own buffer, without any
+// locking or formatting. Full buffers are handed to a writer thread that
+// formats them and writes them to disk, and are then reused. If the writer
+// falls behind by more than TRACE_MAX_BUFFERS buffers events are dropped
+// rather than stalling the traced thread.
+//
+// Names must be string literals (or otherwise outlive the trace) and must
+// not need escaping in JSON.
+//
+// When tracing isn't enabled all calls are a load and a branch.
+//
+
+#define TRACE_BUFFER_EVENTS 4096
+#define TRACE_MAX_BUFFERS 256
+
+enum trace_phase {
+    TRACE_BEGIN = 'B',
+    TRACE_END = 'E',
+    // Sets the name of the thread, name is the thread name
+    TRACE_THREAD_NAME = 'M',
+};
+
+struct trace_event {
+    const char *name;
+    u64 time;
+    u8 phase;
+};
+
+struct trace_buffer {
+    struct trace_buffer *next;
+    u32 tid;
+    u32 num_events;
+    struct trace_event events[TRACE_BUFFER_EVENTS];
+};
+
+// Only written by trace_open/trace_close, while no other threads are
+// tracing
+extern bool trace_enabled;
+
+extern _Thread_local struct trace_buffer *trace_local_buffer;
+
+// Starts tracing to path. Call before spawning threads that trace.
+bool trace_open(const char *path);
+
+// Flushes the calling thread and writes what's left. Every other thread
+// must have called trace_thread_flush before this.
+void trace_close();
+
+// Hands the calling thread's events to the writer, call before a tracing
+// thread exits
+void trace_thread_flush();
+
+// Slow path of trace_push, swaps the full local buffer for an empty one.
+// Returns NULL if the writer is too far behind.
+struct trace_buffer *trace_buffer_next();
+
+static inline void trace_push(const char *name, u64 time, enum trace_phase phase) {
+    struct trace_buffer *b = trace_local_buffer;
+    if (b == NULL || b->num_events == TRACE_BUFFER_EVENTS) {
+        b = trace_buffer_next();
+        if (b == NULL)
+            return;
+    }
+    b->events[b->num_events++] = (struct trace_event) {
+        .name = name,
+        .time = time,
+        .phase = phase,
+    };
+}
+
+static inline void trace_begin(const char *name) {
+    if (trace_enabled)
+        trace_push(name, time_current(), TRACE_BEGIN);
+}
+
+static inline void trace_end(const char *name) {
+    if (trace_enabled)
+        trace_push(name, time_current(), TRACE_END);
+}
+
+// Same as above with a time that has already been measured, for code that
+// times itself anyway. Events of a thread must be in time order.
+static inline void trace_begin_at(const char *name, u64 time) {
+    if (trace_enabled)
+        trace_push(name, time, TRACE_BEGIN);
+}
+
+static inline void trace_end_at(const char *name, u64 time) {
+    if (trace_enabled)
+        trace_push(name, time, TRACE_END);
+}
+
+static inline void trace_thread_name(const char *name) {
+    if (trace_enabled)
+        trace_push(name, time_current(), TRACE_THREAD_NAME);
+}
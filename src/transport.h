@@ -0,0 +1,225 @@
+#pragma once
+
+#include "enet.h"
+#include "common.h"
+#include "packet.h"
+#include "trace.h"
+
+//
+// Transport
+//
+// The handful of host, peer and packet operations the server uses, so it
+// can run on something other than ENet sockets. The implementation is
+// picked at compile time, TRANSPORT_LOOPBACK selects the in-memory
+// loopback below, otherwise ENet is used.
+//
+// Both hand out ENet events, peers and packets so nothing built on top of
+// the transport has to care which one is used. Packets are owned as with
+// enet_peer_send: the transport holds a reference to a sent packet until
+// it's been delivered, and destroys it itself if nobody else holds one.
+//
+
+#if !defined(TRANSPORT_LOOPBACK)
+
+struct transport {
+    ENetHost *host;
+};
+
+static inline int transport_service(struct transport *t, ENetEvent *event, u32 timeout) {
+    trace_begin("enet_host_service");
+    const int result = enet_host_service(t->host, event, timeout);
+    trace_end("enet_host_service");
+    return result;
+}
+
+static inline int transport_send(struct transport *t, ENetPeer *peer, ENetPacket *packet) {
+    (void) t;
+    return enet_peer_send(peer, 0, packet);
+}
+
+static inline void transport_flush(struct transport *t) {
+    enet_host_flush(t->host);
+}
+
+static inline void transport_disconnect(struct transport *t, ENetPeer *peer) {
+    (void) t;
+    enet_peer_disconnect(peer, 0);
+}
+
+static inline u32 transport_num_peers(struct transport *t) {
+    return (u32) t->host->peerCount;
+}
+
+static inline ENetPeer *transport_peer(struct transport *t, u32 index) {
+    return &t->host->peers[index];
+}
+
+#else
+
+//
+// Loopback
+//
+// Virtual peers living in the same process. Connects, disconnects and
+// received packets are queued by whoever drives the virtual peers and
+// handed out by transport_service, in order and without ever blocking.
+// Sent packets are delivered immediately: we only keep per peer counters
+// and the latest network tick it received a batch for, so virtual peers
+// can acknowledge baselines like real clients.
+//
+
+struct loopback_peer {
+    ENetPeer peer;
+    bool connected;
+
+    u64 num_packets_received;
+    u64 bytes_received;
+    u64 last_net_tick;
+};
+
+struct transport {
+    struct loopback_peer *peers;
+    u32 num_peers;
+
+    // Growable FIFO of events waiting to be serviced
+    ENetEvent *events;
+    u64 events_capacity;
+    u64 events_bottom;
+    u64 events_used;
+};
+
+static inline struct transport transport_loopback_init(u32 num_peers) {
+    struct transport t = {
+        .num_peers = num_peers,
+        .peers = calloc(num_peers, sizeof(struct loopback_peer)),
+        .events_capacity = 2*num_peers,
+    };
+    assert(t.peers);
+    t.events = malloc(t.events_capacity*sizeof(ENetEvent));
+    assert(t.events);
+    return t;
+}
+
+static inline void transport_loopback_free(struct transport *t) {
+    for (u64 i = 0; i < t->events_used; ++i) {
+        ENetEvent *event = &t->events[(t->events_bottom + i) % t->events_capacity];
+        if (event->packet != NULL)
+            enet_packet_destroy(event->packet);
+    }
+    free(t->events);
+    free(t->peers);
+}
+
+static inline void transport_loopback_push(struct transport *t, ENetEvent event) {
+    if (t->events_used == t->events_capacity) {
+        // Unwrap into a buffer twice the size
+        ENetEvent *events = malloc(2*t->events_capacity*sizeof(ENetEvent));
+        assert(events);
+        for (u64 i = 0; i < t->events_used; ++i)
+            events[i] = t->events[(t->events_bottom + i) % t->events_capacity];
+        free(t->events);
+        t->events = events;
+        t->events_capacity *= 2;
+        t->events_bottom = 0;
+    }
+    t->events[(t->events_bottom + t->events_used) % t->events_capacity] = event;
+    ++t->events_used;
+}
+
+// data is passed along as the connect data, the match index for the server
+static inline void transport_loopback_connect(struct transport *t, u32 index, u32 data) {
+    struct loopback_peer *p = &t->peers[index];
+    assert(!p->connected);
+    p->connected = true;
+    transport_loopback_push(t, (ENetEvent) {
+        .type = ENET_EVENT_TYPE_CONNECT,
+        .peer = &p->peer,
+        .data = data,
+    });
+}
+
+static inline void transport_loopback_disconnect(struct transport *t, u32 index) {
+    struct loopback_peer *p = &t->peers[index];
+    if (!p->connected)
+        return;
+    p->connected = false;
+    transport_loopback_push(t, (ENetEvent) {
+        .type = ENET_EVENT_TYPE_DISCONNECT,
+        .peer = &p->peer,
+    });
+}
+
+// Queues a copy of data as received from virtual peer index
+static inline void transport_loopback_receive(struct transport *t, u32 index, const void *data, size_t size) {
+    struct loopback_peer *p = &t->peers[index];
+    if (!p->connected)
+        return;
+    transport_loopback_push(t, (ENetEvent) {
+        .type = ENET_EVENT_TYPE_RECEIVE,
+        .peer = &p->peer,
+        .packet = enet_packet_create(data, size, ENET_PACKET_FLAG_UNSEQUENCED),
+    });
+}
+
+static inline int transport_service(struct transport *t, ENetEvent *event, u32 timeout) {
+    (void) timeout;
+    if (t->events_used == 0) {
+        event->type = ENET_EVENT_TYPE_NONE;
+        return 0;
+    }
+    *event = t->events[t->events_bottom];
+    t->events_bottom = (t->events_bottom + 1) % t->events_capacity;
+    --t->events_used;
+    return 1;
+}
+
+static inline int transport_send(struct transport *t, ENetPeer *peer, ENetPacket *packet) {
+    struct loopback_peer *p = (struct loopback_peer *) peer;
+    assert(p >= t->peers && p < t->peers + t->num_peers);
+    if (!p->connected)
+        return -1;
+
+    ++p->num_packets_received;
+    p->bytes_received += packet->dataLength;
+
+    const struct server_batch_header *batch = (const void *) packet->data;
+    if (packet->dataLength >= sizeof(*batch) && !(batch->flags & SERVER_BATCH_FLAG_BROADCAST) && batch->net_tick > p->last_net_tick)
+        p->last_net_tick = batch->net_tick;
+
+    // Delivered, no reference is kept
+    return 0;
+}
+
+static inline void transport_flush(struct transport *t) {
+    (void) t;
+}
+
+static inline void transport_disconnect(struct transport *t, ENetPeer *peer) {
+    struct loopback_peer *p = (struct loopback_peer *) peer;
+    transport_loopback_disconnect(t, (u32) (p - t->peers));
+}
+
+static inline u32 transport_num_peers(struct transport *t) {
+    return t->num_peers;
+}
+
+static inline ENetPeer *transport_peer(struct transport *t, u32 index) {
+    return &t->peers[index].peer;
+}
+
+#endif
+
+//
+// Packets are allocated by ENet for both transports, they cross between
+// the network thread and the match workers so a pool would have to be
+// thread safe.
+//
+// @OPTIMIZATION
+//
+
+static inline ENetPacket *transport_packet_create(const void *data, size_t size) {
+    return enet_packet_create(data, size, ENET_PACKET_FLAG_UNSEQUENCED);
+}
+
+static inline void transport_packet_destroy(ENetPacket *packet) {
+    enet_packet_destroy(packet);
+}
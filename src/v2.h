@@ -2,6 +2,7 @@
 
 #include <math.h>
 #include "common.h"
+#include "fixed.h"
 
 typedef struct v2 v2;
 struct v2 {
@@ -38,6 +39,57 @@ static inline v2 v2neg(v2 v) {
     };
 }
 
+#if defined(FIXED_POINT)
+
+// See fixed.h. Adds and subtracts above stay in float, they're correctly
+// rounded and deterministic on their own.
+
+static inline v2 v2scale(f32 f, v2 v) {
+    const fixed k = fixed_from_f32(f);
+    return (v2) {
+        .x = fixed_to_f32(fixed_mul(k, fixed_from_f32(v.x))),
+        .y = fixed_to_f32(fixed_mul(k, fixed_from_f32(v.y))),
+    };
+}
+
+static inline v2 v2div(v2 v, f32 f) {
+    const fixed d = fixed_from_f32(f);
+    return (v2) {
+        .x = fixed_to_f32(fixed_div(fixed_from_f32(v.x), d)),
+        .y = fixed_to_f32(fixed_div(fixed_from_f32(v.y), d)),
+    };
+}
+
+static inline fixed v2dot_fixed(v2 a, v2 b) {
+    return fixed_saturate((__int128) fixed_mul(fixed_from_f32(a.x), fixed_from_f32(b.x)) +
+                                     fixed_mul(fixed_from_f32(a.y), fixed_from_f32(b.y)));
+}
+
+static inline f32 v2dot(v2 a, v2 b) {
+    return fixed_to_f32(v2dot_fixed(a, b));
+}
+
+static inline f32 v2len2(v2 v) {
+    return v2dot(v, v);
+}
+
+static inline f32 v2len(v2 v) {
+    return fixed_to_f32(fixed_sqrt(v2dot_fixed(v, v)));
+}
+
+// Zero vectors stay zero instead of turning into NaNs
+static inline v2 v2normalize(v2 v) {
+    const fixed len = fixed_sqrt(v2dot_fixed(v, v));
+    if (len == 0)
+        return (v2) {0, 0};
+    return (v2) {
+        .x = fixed_to_f32(fixed_div(fixed_from_f32(v.x), len)),
+        .y = fixed_to_f32(fixed_div(fixed_from_f32(v.y), len)),
+    };
+}
+
+#else
+
 static inline v2 v2scale(f32 f, v2 v) {
     return (v2) {
         .x = f*v.x,
@@ -68,6 +120,8 @@ static inline v2 v2normalize(v2 v) {
     return v2div(v, v2len(v));
 }
 
+#endif
+
 static inline v2 v2reflect(v2 v, v2 r) {
     assert(f32_equal(v2len2(r), 1.0f));
     const f32 amount_in_dir = v2dot(v, r);
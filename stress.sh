@@ -1,5 +1,17 @@
-#!/bin/sh
+#!/bin/bash
 
-for i in {1..100}; do
-    ./build/client-stress 127.0.0.1 $i &
+# Bots are spread over MATCHES matches of at most PLAYERS_PER_MATCH
+# (MAX_PLAYERS_PER_MATCH in game.h) players each, by default as few as
+# fit all of them. Run the server with the same number of matches.
+BOTS=${BOTS:-100}
+PLAYERS_PER_MATCH=16
+MATCHES=${MATCHES:-$(( (BOTS + PLAYERS_PER_MATCH - 1) / PLAYERS_PER_MATCH ))}
+
+if (( MATCHES*PLAYERS_PER_MATCH < BOTS )); then
+    echo "$BOTS bots don't fit in $MATCHES matches of $PLAYERS_PER_MATCH players, use MATCHES=$(( (BOTS + PLAYERS_PER_MATCH - 1) / PLAYERS_PER_MATCH )) or more" >&2
+    exit 1
+fi
+
+for (( i = 1; i <= BOTS; ++i )); do
+    ./build/client-stress 127.0.0.1 $i --match $(( (i - 1) % MATCHES )) &
 done